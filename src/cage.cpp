@@ -158,7 +158,7 @@ namespace libcage {
                 case type_dht_store:
                         if (len >= (int)(sizeof(msg_dht_store) -
                                          sizeof(uint32_t))) {
-                                m_cage.m_dht.recv_store(buf, len, from);
+                                m_cage.m_dht.recv_store(buf, len, from, pbuf);
                         }
                         break;
                 case type_dht_find_value:
@@ -171,11 +171,14 @@ namespace libcage {
                         if (len >= (int)(sizeof(msg_dht_find_value_reply) - 
                                          sizeof(uint32_t))) {
                                 m_cage.m_dht.recv_find_value_reply(buf, len,
-                                                                   from);
+                                                                   from, pbuf);
                         }
                         break;
                 case type_rdp:
                 case type_dgram:
+                case type_dgram_frag:
+                case type_dgram_probe:
+                case type_dgram_probe_reply:
                         if (len >= (int)sizeof(msg_hdr)) {
                                 m_cage.m_dgram.recv_dgram(pbuf, from);
                         }
@@ -193,7 +196,7 @@ namespace libcage {
                 case type_proxy_store:
                         if (len >= (int)(sizeof(msg_proxy_store) -
                                          sizeof(uint32_t))) {
-                                m_cage.m_proxy.recv_store(buf, len, from);
+                                m_cage.m_proxy.recv_store(buf, len, from, pbuf);
                         }
                         break;
                 case type_proxy_get:
@@ -205,7 +208,7 @@ namespace libcage {
                 case type_proxy_get_reply:
                         if (len >= (int)(sizeof(msg_proxy_get) -
                                          sizeof(uint32_t))) {
-                                m_cage.m_proxy.recv_get_reply(buf, len);
+                                m_cage.m_proxy.recv_get_reply(buf, len, pbuf);
                         }
                         break;
                 case type_proxy_rdp:
@@ -251,8 +254,8 @@ namespace libcage {
                        m_rdp(m_rnd, m_timer),
                        m_dht(m_rnd, m_drnd, m_id, m_timer, m_peers, m_nat,
                              m_udp, m_dtun, m_rdp),
-                       m_dgram(m_id, m_peers, m_udp, m_dtun, m_dht, m_proxy,
-                               m_advertise, m_rdp),
+                       m_dgram(m_id, m_timer, m_peers, m_udp, m_nat, m_dtun,
+                               m_dht, m_proxy, m_advertise, m_rdp),
                        m_proxy(m_rnd, m_drnd, m_id, m_udp, m_timer, m_nat,
                                m_peers, m_dtun, m_dht, m_dgram, m_advertise,
                                m_rdp),
@@ -260,6 +263,7 @@ namespace libcage {
                                    m_peers, m_dtun)
         {
                 m_rdp.set_callback_dgram_out(rdp_output(*this));
+                m_rdp.set_callback_path_mtu(rdp_path_mtu(*this));
         }
 
         cage::~cage()
@@ -285,16 +289,26 @@ namespace libcage {
         }
 
         int
-        cage::rdp_listen(uint16_t sport, callback_rdp_event func)
+        cage::rdp_listen(uint16_t sport, callback_rdp_event func,
+                         const rdp_config &conf)
         {
-                return m_rdp.listen(sport, func);
+                return m_rdp.listen(sport, func, conf);
         }
 
         int
         cage::rdp_connect(uint16_t sport, id_ptr did, uint16_t dport,
-                          callback_rdp_event func)
+                          callback_rdp_event func, const rdp_config &conf)
         {
-                return m_rdp.connect(sport, did, dport, func);
+                return m_rdp.connect(sport, did, dport, func, conf);
+        }
+
+        int
+        cage::rdp_connect(uint16_t sport, id_ptr did, uint16_t dport,
+                          callback_rdp_event func, const void *buf, int len,
+                          const rdp_config &conf)
+        {
+                return m_rdp.connect(sport, did, dport, func, buf, len,
+                                     conf);
         }
 
         void
@@ -315,12 +329,48 @@ namespace libcage {
                 m_rdp.receive(desc, buf, len);
         }
 
+        int
+        cage::rdp_send(int desc, packetbuf_ptr pbuf)
+        {
+                return m_rdp.send(desc, pbuf);
+        }
+
+        void
+        cage::rdp_receive(int desc, std::vector<packetbuf_ptr> &bufs, int *len)
+        {
+                m_rdp.receive(desc, bufs, len);
+        }
+
+        int
+        cage::rdp_send(int desc, uint16_t stream, const void *buf, int len)
+        {
+                return m_rdp.send(desc, stream, buf, len);
+        }
+
+        void
+        cage::rdp_receive(int desc, uint16_t stream, void *buf, int *len)
+        {
+                m_rdp.receive(desc, stream, buf, len);
+        }
+
+        void
+        cage::rdp_get_readable_streams(int desc, std::vector<uint16_t> &ids)
+        {
+                m_rdp.get_readable_streams(desc, ids);
+        }
+
         rdp_state
         cage::rdp_get_desc_state(int desc)
         {
                 return m_rdp.get_desc_state(desc);
         }
 
+        int
+        cage::rdp_get_send_space(int desc)
+        {
+                return m_rdp.get_send_space(desc);
+        }
+
         void
         cage::rdp_get_status(std::vector<rdp_status> &vec)
         {
@@ -341,6 +391,28 @@ namespace libcage {
                 }
         }
 
+        void
+        cage::send_dgram(const void *buf, int len, uint8_t *dsts, int num)
+        {
+                std::vector<id_ptr> ids;
+
+                ids.reserve(num);
+
+                for (int i = 0; i < num; i++) {
+                        id_ptr id(new uint160_t);
+
+                        id->from_binary(dsts + i * CAGE_ID_LEN, CAGE_ID_LEN);
+
+                        if (m_nat.get_state() == node_symmetric)
+                                m_proxy.send_dgram(buf, len, id);
+                        else
+                                ids.push_back(id);
+                }
+
+                if (! ids.empty())
+                        m_dgram.send_dgram(buf, len, ids);
+        }
+
         void
         cage::print_state() const
         {
@@ -380,6 +452,16 @@ namespace libcage {
 
                 printf("DHT Table:\n");
                 m_dht.print_table();
+                printf("\n");
+
+                printf("Dgram Reassembly:\n");
+                printf("  %lu bytes in %lu messages\n",
+                       (unsigned long)m_dgram.get_reassembly_bytes(),
+                       (unsigned long)m_dgram.get_reassembly_num());
+                printf("\n");
+
+                printf("Dgram Paths:\n");
+                m_dgram.print_paths();
         }
 
         bool
@@ -420,6 +502,72 @@ namespace libcage {
 
         }
 
+        void
+        cage::set_dgram_pacing(int burst, int usec)
+        {
+                m_dgram.set_pacing(burst, usec);
+        }
+
+        void
+        cage::set_dgram_fragment(bool flag)
+        {
+                m_dgram.set_fragment(flag);
+        }
+
+        void
+        cage::set_dgram_reassembly_limit(size_t bytes)
+        {
+                m_dgram.set_reassembly_limit(bytes);
+        }
+
+        void
+        cage::get_dgram_reassembly(size_t &bytes, size_t &num) const
+        {
+                bytes = m_dgram.get_reassembly_bytes();
+                num   = m_dgram.get_reassembly_num();
+        }
+
+        void
+        cage::set_dgram_queue_limit(size_t dst_bytes, size_t total_bytes,
+                                    dgram::queue_policy policy)
+        {
+                m_dgram.set_queue_limit(dst_bytes, total_bytes, policy);
+        }
+
+        void
+        cage::get_dgram_queue_status(dgram::queue_status &st) const
+        {
+                m_dgram.get_queue_status(st);
+        }
+
+        void
+        cage::set_dgram_keepalive(node_state state, time_t interval)
+        {
+                m_dgram.set_keepalive(state, interval);
+        }
+
+        uint64_t
+        cage::get_dtun_request_count() const
+        {
+                return m_dtun.get_request_count();
+        }
+
+        void
+        cage::set_dgram_pmtud(bool flag)
+        {
+                m_dgram.set_pmtud(flag);
+        }
+
+        int
+        cage::get_path_mtu(uint8_t *id)
+        {
+                id_ptr p(new uint160_t);
+
+                p->from_binary(id, CAGE_ID_LEN);
+
+                return m_peers.get_mtu(p);
+        }
+
         void
         cage::unset_dgram_callback()
         {
@@ -429,7 +577,7 @@ namespace libcage {
 
         void
         cage::put(const void *key, uint16_t keylen,
-                  const void *value, uint16_t valuelen, uint16_t ttl,
+                  const void *value, uint32_t valuelen, uint16_t ttl,
                   bool is_unique)
         {
                 EVP_MD_CTX      ctx;
@@ -446,6 +594,10 @@ namespace libcage {
                 id.from_binary(buf, sizeof(buf));
 
                 if (m_nat.get_state() == node_symmetric) {
+                        // the proxy protocol carries 16 bits lengths
+                        if (valuelen > 0xffff)
+                                return;
+
                         m_proxy.store(id, key, keylen, value, valuelen, ttl,
                                       is_unique);
                 } else {
@@ -478,6 +630,51 @@ namespace libcage {
                 }
         }
 
+        void
+        cage::get(const void *key, uint16_t keylen,
+                  dht::callback_find_value func,
+                  dht::callback_value_chunk chunk)
+        {
+                EVP_MD_CTX      ctx;
+                uint160_t       id;
+                uint32_t        len;
+                uint8_t         buf[20];
+
+                EVP_MD_CTX_init(&ctx);
+                EVP_DigestInit_ex(&ctx, EVP_sha1(), NULL);
+                EVP_DigestUpdate(&ctx, key, keylen);
+                EVP_DigestFinal_ex(&ctx, buf, &len);
+                EVP_MD_CTX_cleanup(&ctx);
+
+                id.from_binary(buf, sizeof(buf));
+
+                if (m_nat.get_state() == node_symmetric) {
+                        get_chunk_func f;
+
+                        f.func  = func;
+                        f.chunk = chunk;
+
+                        m_proxy.get(id, key, keylen, f);
+                } else {
+                        m_dht.find_value(id, key, keylen, func, chunk);
+                }
+        }
+
+        void
+        cage::get_chunk_func::operator() (bool result, dht::value_set_ptr vset)
+        {
+                if (result) {
+                        dht::value_set::iterator it;
+                        for (it = vset->begin(); it != vset->end(); ++it) {
+                                chunk(it->value.get(), it->len, 0, it->len);
+                        }
+
+                        vset->clear();
+                }
+
+                func(result, vset);
+        }
+
         void
         cage::join_func::operator() (std::vector<cageaddr> &nodes)
         {
@@ -528,6 +725,16 @@ namespace libcage {
                 }
         }
 
+        int
+        cage::rdp_path_mtu::operator() (id_ptr id_dst)
+        {
+                // the segments go through the proxy
+                if (m_cage.m_nat.get_state() == node_symmetric)
+                        return 0;
+
+                return m_cage.m_peers.get_mtu(id_dst);
+        }
+
         void
         cage::rdp_set_max_retrans(time_t sec)
         {
@@ -540,6 +747,18 @@ namespace libcage {
                 return m_rdp.get_max_retrans();
         }
 
+        void
+        cage::rdp_set_congestion_control(rdp_cc_algo algo)
+        {
+                m_rdp.set_congestion_control(algo);
+        }
+
+        void
+        cage::rdp_get_retrans_count(uint64_t &timeout, uint64_t &fast)
+        {
+                m_rdp.get_retrans_count(timeout, fast);
+        }
+
 #ifdef DEBUG_NAT
         void
         cage::test_natdetect()
@@ -677,7 +896,8 @@ namespace libcage {
         }
 
         void
-        cage::dht_get_callback::operator() (bool result, void *buf, int len)
+        cage::dht_get_callback::operator() (bool result,
+                                            dht::value_set_ptr vset)
         {
                 printf("dht: get\n");
 
@@ -711,5 +931,17 @@ namespace libcage {
                 func.p_cage[0].m_dtun.find_node("localhost", 10000, func);
                 func.p_cage[0].m_dht.find_node("localhost", 10000, func2);
         }
+
+        void
+        cage::test_sync_timeout()
+        {
+                cage *c;
+
+                c = new cage;
+                c->open(PF_INET, 10000);
+                c->m_nat.set_state_global();
+
+                c->m_dht.test_sync_timeout();
+        }
 #endif // DEBUG
 }
@@ -62,44 +62,116 @@ namespace libcage {
                 bool            open(int domain, uint16_t port,
                                      bool is_dtun = true);
                 void            put(const void *key, uint16_t keylen,
-                                    const void *value, uint16_t valuelen,
+                                    const void *value, uint32_t valuelen,
                                     uint16_t ttl, bool is_unique = false);
                 void            get(const void *key, uint16_t keylen,
                                     dht::callback_find_value func);
+
+                // values are passed to chunk part by part instead of
+                // being buffered, and then func is called with an empty set
+                void            get(const void *key, uint16_t keylen,
+                                    dht::callback_find_value func,
+                                    dht::callback_value_chunk chunk);
                 void            join(std::string host, int port,
                                      callback_join func);
 
                 // for reliable datagram transmission like TCP
                 //
                 // NOTICE:
-                //     Currentry, this protocol doesn't support congestion
-                //     control.
+                //     The congestion control algorithm is NewReno by
+                //     default. It can be changed by
+                //     rdp_set_congestion_control() and is applied to
+                //     connections opened after that.
                 int             rdp_listen(uint16_t sport,
-                                           callback_rdp_event func);
+                                           callback_rdp_event func,
+                                           const rdp_config &conf =
+                                           rdp_config());
                 int             rdp_connect(uint16_t sport, id_ptr did,
                                             uint16_t dport,
-                                            callback_rdp_event func);
+                                            callback_rdp_event func,
+                                            const rdp_config &conf =
+                                            rdp_config());
+                int             rdp_connect(uint16_t sport, id_ptr did,
+                                            uint16_t dport,
+                                            callback_rdp_event func,
+                                            const void *buf, int len,
+                                            const rdp_config &conf =
+                                            rdp_config());
                 void            rdp_close(int desc);
                 int             rdp_send(int desc, const void *buf, int len);
                 void            rdp_receive(int desc, void *buf, int *len);
+
+                // without copying. see rdp::send() and rdp::receive()
+                int             rdp_send(int desc, packetbuf_ptr pbuf);
+                void            rdp_receive(int desc,
+                                            std::vector<packetbuf_ptr> &bufs,
+                                            int *len);
+
+                // substreams. see rdp::send() and rdp::receive()
+                int             rdp_send(int desc, uint16_t stream,
+                                         const void *buf, int len);
+                void            rdp_receive(int desc, uint16_t stream,
+                                            void *buf, int *len);
+                void            rdp_get_readable_streams(int desc,
+                                        std::vector<uint16_t> &ids);
                 rdp_state       rdp_get_desc_state(int desc);
+                int             rdp_get_send_space(int desc);
                 void            rdp_get_status(std::vector<rdp_status> &vec);
                 void            rdp_set_max_retrans(time_t sec);
                 time_t          rdp_get_max_retrans();
+                void            rdp_set_congestion_control(rdp_cc_algo algo);
+                void            rdp_get_retrans_count(uint64_t &timeout,
+                                                      uint64_t &fast);
 
 
                 // for dgram messege transmission like UDP
                 //
                 // NOTCE:
-                //     If the length is bigger than 896 bytes, the message is
-                //     automatically divided and then deliverd to the
-                //     destination unlike UDP.
-                //     The destination node should be receive multiple times.
+                //     If the length is bigger than 896 bytes, or than the
+                //     size for the path MTU found by dgram::set_pmtud(), the
+                //     message is automatically divided and then deliverd to
+                //     the destination unlike UDP.
+                //     The destination node should be receive multiple times,
+                //     unless set_dgram_fragment(true) is called by the
+                //     source node.
                 void            send_dgram(const void *buf, int len,
                                            uint8_t *dst);
+
+                // the same message to num destinations. dsts is num IDs
+                // of CAGE_ID_LEN bytes each
+                void            send_dgram(const void *buf, int len,
+                                           uint8_t *dsts, int num);
                 void            set_dgram_callback(dgram::callback func);
                 void            unset_dgram_callback();
 
+                // see dgram::set_pacing()
+                void            set_dgram_pacing(int burst, int usec);
+
+                // see dgram::set_fragment() and
+                // dgram::set_reassembly_limit()
+                void            set_dgram_fragment(bool flag);
+                void            set_dgram_reassembly_limit(size_t bytes);
+                void            get_dgram_reassembly(size_t &bytes,
+                                                     size_t &num) const;
+
+                // see dgram::set_queue_limit()
+                void            set_dgram_queue_limit(size_t dst_bytes,
+                                        size_t total_bytes,
+                                        dgram::queue_policy policy =
+                                        dgram::queue_drop_oldest);
+                void            get_dgram_queue_status(
+                                        dgram::queue_status &st) const;
+
+                // see dgram::set_keepalive()
+                void            set_dgram_keepalive(node_state state,
+                                                    time_t interval);
+                uint64_t        get_dtun_request_count() const;
+
+                // see dgram::set_pmtud(). get_path_mtu() returns the
+                // largest UDP payload found to reach id, or 0 if unknown
+                void            set_dgram_pmtud(bool flag);
+                int             get_path_mtu(uint8_t *id);
+
                 std::string     get_id_str() const;
                 void            get_id(void *addr) const;
                 node_state      get_nat_state() const { return m_nat.get_state(); }
@@ -111,6 +183,10 @@ namespace libcage {
                 void            set_symmetric_nat() { m_nat.set_state_symmetric_nat(); }
                 void            set_id(const char *buf, int len);
 
+                // compress values put by this node or through it as a
+                // proxy. see dht::set_enabled_compress()
+                void            set_compress(bool flag) { m_dht.set_enabled_compress(flag); }
+
                 void            print_state() const;
 
 
@@ -136,6 +212,14 @@ namespace libcage {
                         cage   *p_cage;
                 };
 
+                class get_chunk_func {
+                public:
+                        void operator() (bool result, dht::value_set_ptr vset);
+
+                        dht::callback_find_value        func;
+                        dht::callback_value_chunk       chunk;
+                };
+
                 class rdp_output {
                 public:
                         cage &m_cage;
@@ -145,6 +229,15 @@ namespace libcage {
                         void operator() (id_ptr id_dst, packetbuf_ptr pbuf);
                 };
 
+                class rdp_path_mtu {
+                public:
+                        cage &m_cage;
+
+                        rdp_path_mtu(cage &c) : m_cage(c) { }
+
+                        int operator() (id_ptr id_dst);
+                };
+
                 class gen_id {
                 public:
                         gen_id(uint160_t &id)
@@ -226,11 +319,13 @@ namespace libcage {
 
                 class dht_get_callback {
                 public:
-                        void operator() (bool result, void *buf, int len);
+                        void operator() (bool result,
+                                         dht::value_set_ptr vset);
                 };
 
         public:
                 static void     test_dtun();
+                static void     test_sync_timeout();
 #endif // DEBUG
         };
 }
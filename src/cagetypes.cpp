@@ -35,6 +35,9 @@
 #include "udphandler.hpp"
 
 #include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
+
+#include <zlib.h>
 
 namespace libcage {
         size_t
@@ -215,4 +218,64 @@ namespace libcage {
                                    sizeof(sockaddr_in6));
                 }
         }
+
+        bool
+        compress_value(const void *value, uint32_t len,
+                       boost::shared_array<char> &buf, uint32_t &buflen)
+        {
+                uint32_t orig;
+                uLongf   size = compressBound(len);
+                boost::scoped_array<char> tmp(new char[size]);
+
+                if (compress2((Bytef*)tmp.get(), &size, (const Bytef*)value,
+                              len, Z_BEST_SPEED) != Z_OK)
+                        return false;
+
+                if (sizeof(orig) + size >= len)
+                        return false;
+
+                // values stay compressed in memory,
+                // so the buffer is fitted to the size
+                boost::shared_array<char> p(new char[sizeof(orig) + size]);
+
+                orig = htonl(len);
+                memcpy(p.get(), &orig, sizeof(orig));
+                memcpy(p.get() + sizeof(orig), tmp.get(), size);
+
+                buf    = p;
+                buflen = sizeof(orig) + size;
+
+                return true;
+        }
+
+        bool
+        uncompress_value(const void *value, uint32_t len,
+                         boost::shared_array<char> &buf, uint32_t &buflen,
+                         uint32_t maxlen)
+        {
+                uint32_t orig;
+                uLongf   size;
+
+                if (len < sizeof(orig))
+                        return false;
+
+                memcpy(&orig, value, sizeof(orig));
+                orig = ntohl(orig);
+
+                if (orig == 0 || orig > maxlen)
+                        return false;
+
+                boost::shared_array<char> p(new char[orig]);
+
+                size = orig;
+                if (uncompress((Bytef*)p.get(), &size,
+                               (const Bytef*)value + sizeof(orig),
+                               len - sizeof(orig)) != Z_OK || size != orig)
+                        return false;
+
+                buf    = p;
+                buflen = orig;
+
+                return true;
+        }
 }
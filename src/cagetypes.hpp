@@ -40,6 +40,7 @@
 #include <vector>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/shared_array.hpp>
 #include <boost/random.hpp>
 #include <boost/variant.hpp>
 
@@ -99,6 +100,9 @@ namespace libcage {
         static const uint8_t type_dgram                   = 0x01;
         static const uint8_t type_advertise               = 0x02;
         static const uint8_t type_advertise_reply         = 0x03;
+        static const uint8_t type_dgram_frag              = 0x04;
+        static const uint8_t type_dgram_probe             = 0x05;
+        static const uint8_t type_dgram_probe_reply       = 0x06;
         static const uint8_t type_nat                     = 0x10;
         static const uint8_t type_nat_echo                = 0x11;
         static const uint8_t type_nat_echo_reply          = 0x12;
@@ -138,17 +142,24 @@ namespace libcage {
         static const uint8_t data_are_nodes  = 0xa0;
         static const uint8_t data_are_values = 0xa1;
         static const uint8_t data_are_nul    = 0xa2;
+        static const uint8_t data_are_packed = 0xa3;
 
         static const uint8_t get_by_udp = 0xb0;
         static const uint8_t get_by_rdp = 0xb1;
 
         static const uint8_t dht_flag_unique = 0x01;
+        static const uint8_t dht_flag_large  = 0x02;
+        static const uint8_t dht_flag_compressed = 0x04;
+        static const uint8_t dht_flag_packed     = 0x08;
+        static const uint8_t dht_flag_keep       = 0x10;
 
-        static const uint8_t dht_get_next = 0xc0;
+        static const uint8_t dht_get_next   = 0xc0;
+        static const uint8_t dht_store_done = 0xc1;
 
         static const uint8_t proxy_get_success = 0xd0;
         static const uint8_t proxy_get_fail    = 0xd1;
         static const uint8_t proxy_get_next    = 0xd2;
+        static const uint8_t proxy_get_ack     = 0xd3;
 
 
         struct msg_hdr {
@@ -288,7 +299,11 @@ namespace libcage {
                 uint32_t        nonce;
                 uint8_t         id[CAGE_ID_LEN];
                 uint16_t        domain;
-                uint16_t        padding;
+
+                // dht_flag_compressed when compressed values are acceptable
+                uint8_t         accept;
+
+                uint8_t         padding;
         };
 
         struct msg_dht_find_node_reply {
@@ -297,7 +312,7 @@ namespace libcage {
                 uint8_t         id[CAGE_ID_LEN];
                 uint16_t        domain;
                 uint8_t         num;
-                uint8_t         padding;
+                uint8_t         accept; // same as msg_dht_find_node
                 uint32_t        addrs[1];
         };
 
@@ -311,7 +326,11 @@ namespace libcage {
                 // use RDP when 1
                 uint8_t         flag;
 
-                uint8_t         padding[3];
+                // dht_flag_compressed when compressed values are acceptable
+                // dht_flag_packed when data_are_packed is acceptable
+                uint8_t         accept;
+
+                uint8_t         padding[2];
                 uint32_t        key[1];
         };
 
@@ -328,6 +347,21 @@ namespace libcage {
                 uint32_t        data[1];
         };
 
+        // data[] of msg_dht_find_value_reply when data_are_packed.
+        // the key is followed by num records, which are msg_value
+        // followed by the value, without any padding
+        struct msg_data_packed {
+                uint16_t        keylen;
+                uint16_t        num;
+                uint32_t        data[1];
+        };
+
+        struct msg_value {
+                uint16_t        valuelen;
+                uint8_t         flags;
+                uint8_t         reserved;
+        };
+
         struct msg_dht_find_value_reply {
                 msg_hdr         hdr;
                 uint32_t        nonce;
@@ -336,12 +370,16 @@ namespace libcage {
                 uint16_t        index; // the index of the value in data[]
                 uint16_t        total; // the number of values 
 
+                // data[] is packed values when 3
                 // data[] is nul when 2
                 // data[] is value when 1
                 // data[] is nodes when 0
                 uint8_t         flag;
 
-                uint8_t         padding[3];
+                // dht_flag_compressed when the value is compressed
+                uint8_t         vflags;
+
+                uint8_t         padding[2];
                 uint32_t        data[1];
         };
 
@@ -357,6 +395,9 @@ namespace libcage {
                 uint32_t        data[1];
         };
 
+        // when dht_flag_keep is set, the receiver replies dht_store_done
+        // for each stored value and waits for the next msg_dht_rdp_store
+        // on the same connection instead of closing it
         struct msg_dht_rdp_store {
                 uint8_t         id[CAGE_ID_LEN];
                 uint8_t         from[CAGE_ID_LEN];
@@ -367,15 +408,46 @@ namespace libcage {
                 uint8_t         reserved;
         };
 
+        // when dht_flag_keep is set, the receiver sets dht_flag_keep in
+        // the msg_dht_rdp_get_reply which ends the values, and waits for
+        // the next msg_dht_rdp_get on the same connection
         struct msg_dht_rdp_get {
                 uint8_t         id[CAGE_ID_LEN];
                 uint16_t        keylen;
-                uint16_t        reserved;
+                uint8_t         accept; // same as msg_dht_find_value
+                uint8_t         flags;
         };
 
         struct msg_dht_rdp_get_reply {
                 uint16_t        valuelen;
+                uint8_t         flags;
+                uint8_t         reserved;
+        };
+
+        // follows msg_dht_rdp_store or msg_dht_rdp_get_reply
+        // when dht_flag_large is set and valuelen of them is 0
+        struct msg_dht_rdp_valuelen {
+                uint32_t        valuelen;
+        };
+
+        // anti-entropy between replica holders
+        // msg_dht_rdp_sync is followed by len bytes of buckets
+        struct msg_dht_rdp_sync {
+                uint32_t        len; // the length of the buckets in bytes
+                uint32_t        num; // the number of buckets
+        };
+
+        struct msg_dht_rdp_sync_bucket {
+                uint8_t         id[CAGE_ID_LEN];
+                uint16_t        num; // the number of digests
                 uint16_t        reserved;
+                uint32_t        digest[1]; // 64 bits digests, 2 words each
+        };
+
+        // msg_dht_rdp_sync_reply is followed by num indices of
+        // the entries that the replica lacks
+        struct msg_dht_rdp_sync_reply {
+                uint32_t        num;
         };
 
         struct msg_dgram {
@@ -383,6 +455,30 @@ namespace libcage {
                 uint32_t        data[1];
         };
 
+        // a piece of a message which is reassembled before delivery
+        struct msg_dgram_frag {
+                msg_hdr         hdr;
+                uint32_t        msgid;
+                uint16_t        index;
+                uint16_t        count; // the number of pieces
+                uint32_t        data[1];
+        };
+
+        // padded to size bytes, which is the UDP payload probed
+        struct msg_dgram_probe {
+                msg_hdr         hdr;
+                uint32_t        nonce;
+                uint16_t        size;
+                uint16_t        reserved;
+        };
+
+        struct msg_dgram_probe_reply {
+                msg_hdr         hdr;
+                uint32_t        nonce;
+                uint16_t        size; // the size of the probe received
+                uint16_t        reserved;
+        };
+
         struct msg_proxy_register {
                 msg_hdr         hdr;
                 uint32_t        session;
@@ -430,23 +526,32 @@ namespace libcage {
                 uint32_t        data[1];
         };
 
+        // dht_flag_keep is set in flags when the connection is kept for
+        // the next reply
         struct msg_proxy_rdp_get_reply {
                 uint32_t        nonce;
                 uint8_t         id[CAGE_ID_LEN];
                 uint8_t         flag;
-                uint8_t         reserved[3];
+                uint8_t         flags;
+                uint8_t         reserved[2];
         };
 
+        // on a kept connection, dht_flag_keep in flags ends the values
         struct msg_proxy_rdp_get_reply_val {
                 uint16_t        valuelen;
-                uint16_t        reserved;
+                uint8_t         flags;
+                uint8_t         reserved;
         };
 
+        // when dht_flag_keep is set, the receiver replies proxy_get_ack
+        // for each get and waits for the next msg_proxy_rdp_get on the
+        // same connection. it also keeps the connection of the replies
         struct msg_proxy_rdp_get {
                 uint32_t        nonce;
                 uint8_t         id[CAGE_ID_LEN];
                 uint16_t        keylen;
-                uint16_t        reserved;
+                uint8_t         flags;
+                uint8_t         reserved;
         };        
 
         struct msg_proxy_dgram {
@@ -496,6 +601,16 @@ namespace libcage {
         void            send_msg(udphandler &udp, msg_hdr *hdr, uint16_t len,
                                  uint8_t type, cageaddr &dst,
                                  const uint160_t &src);
+
+        // a compressed value is the original length in 4 bytes
+        // followed by the deflate stream.
+        // false is returned when compression does not shrink the value
+        bool            compress_value(const void *value, uint32_t len,
+                                       boost::shared_array<char> &buf,
+                                       uint32_t &buflen);
+        bool            uncompress_value(const void *value, uint32_t len,
+                                         boost::shared_array<char> &buf,
+                                         uint32_t &buflen, uint32_t maxlen);
 }
 
 #endif // CAGETYPES_HPP
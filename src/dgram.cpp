@@ -31,10 +31,33 @@
 
 #include "dgram.hpp"
 
+#include <boost/foreach.hpp>
+
 #include "advertise.hpp"
+#include "ping.hpp"
 #include "proxy.hpp"
 
 namespace libcage {
+        // datagrams are split into pieces which leave PBUF_DEFAULT_OFFSET
+        // bytes for the headers the lower layers prepend, so that a whole
+        // datagram is received by older nodes of PBUF_LEGACY_SIZE buffers
+        const int dgram::data_len_max = PBUF_LEGACY_SIZE - PBUF_DEFAULT_OFFSET;
+        const int dgram::frag_count_max = 128;
+        const time_t dgram::frag_timeout = 10;
+        const size_t dgram::frag_mem_default = 1024 * 1024;
+        const size_t dgram::queue_dst_default = 256 * 1024;
+        const size_t dgram::queue_total_default = 4 * 1024 * 1024;
+        const time_t dgram::path_idle = 180;
+
+        // the UDP payloads on the paths of the minimum MTU of IPv6,
+        // tunnels, and Ethernet with IPv6 and IPv4, in ascending order
+        const uint16_t dgram::probe_sizes[] = {1232, 1372, 1452, 1472};
+        const int dgram::probe_sizes_num = sizeof(probe_sizes) /
+                                           sizeof(probe_sizes[0]);
+        const int dgram::probe_tries = 3;
+        const time_t dgram::probe_timeout = 1;
+        const time_t dgram::probe_interval = 600;
+
         void
         dgram::request_func::operator() (bool result, cageaddr &addr)
         {
@@ -44,8 +67,7 @@ namespace libcage {
                         p_dgram->send_queue(dst);
                 } else {
                         i.id = dst;
-                        p_dgram->m_queue.erase(i);
-                        p_dgram->m_data_pool.erase(i);
+                        p_dgram->drop_queue(i);
                 }
 
                 i.id = dst;
@@ -56,16 +78,14 @@ namespace libcage {
         void
         dgram::find_node_func::operator() (std::vector<cageaddr> &nodes)
         {
-                _id i;
+                cageaddr addr;
+                _id      i;
 
-                try {
-                        // throw std::out_of_range
-                        p_dgram->m_peers.get_addr(dst);
+                if (p_dgram->m_peers.find_addr(dst, addr)) {
                         p_dgram->send_queue(dst);
-                } catch (std::out_of_range) {
+                } else {
                         i.id = dst;
-                        p_dgram->m_queue.erase(i);
-                        p_dgram->m_data_pool.erase(i);
+                        p_dgram->drop_queue(i);
                 }
 
                 i.id = dst;
@@ -101,91 +121,640 @@ namespace libcage {
         void
         dgram::request(id_ptr id)
         {
-                _id i;
+                cageaddr addr;
+                _id      i;
 
                 i.id = id;
 
-                if (m_requesting.find(i) == m_requesting.end()) {
-                        try {
-                                m_peers.get_addr(id); // throw std::out_of_range
-                                send_queue(id);
-                        } catch (std::out_of_range) {
-                                // request
-                                if (m_dtun.is_enabled()) {
-                                        request_func func;
+                if (m_requesting.find(i) != m_requesting.end())
+                        return;
 
-                                        func.p_dgram = this;
-                                        func.dst     = id;
+                if (m_peers.find_addr(id, addr)) {
+                        send_queue(id);
+                } else if (m_dtun.is_enabled()) {
+                        // request
+                        request_func func;
 
-                                        m_requesting.insert(i);
-                                        m_dtun.request(*id, func);
-                                } else {
-                                        find_node_func func;
+                        func.p_dgram = this;
+                        func.dst     = id;
 
-                                        func.p_dgram = this;
-                                        func.dst     = id;
+                        m_requesting.insert(i);
+                        m_queue_stat.requests++;
+                        m_dtun.request(*id, func);
+                } else {
+                        find_node_func func;
 
-                                        m_requesting.insert(i);
-                                        m_dht.find_node(*id, func);
-                                }
-                        }
+                        func.p_dgram = this;
+                        func.dst     = id;
+
+                        m_requesting.insert(i);
+                        m_queue_stat.requests++;
+                        m_dht.find_node(*id, func);
                 }
         }
 
-        dgram::dgram(const uint160_t &id, peers &p, udphandler &udp,
-                     dtun &dt, dht &dh, proxy &pr, advertise &adv,
-                     rdp &r) :
+        dgram::dgram(const uint160_t &id, timer &t, peers &p,
+                     udphandler &udp, natdetector &nat, dtun &dt, dht &dh,
+                     proxy &pr, advertise &adv, rdp &r) :
                 m_id(id),
+                m_timer(t),
                 m_peers(p),
                 m_udp(udp),
+                m_nat(nat),
                 m_dtun(dt),
                 m_dht(dh),
                 m_proxy(pr),
                 m_advertise(adv),
                 m_rdp(r),
-                m_is_callback(false)
+                m_is_callback(false),
+                m_timer_pace(*this),
+                m_pace_burst(0),
+                m_pace_usec(0),
+                m_timer_frag(*this),
+                m_is_frag(false),
+                m_frag_msgid(0),
+                m_frag_mem(0),
+                m_frag_mem_max(frag_mem_default),
+                m_queue_bytes(0),
+                m_queue_dst_max(queue_dst_default),
+                m_queue_total_max(queue_total_default),
+                m_queue_policy(queue_drop_oldest),
+                m_queue_seq(0),
+                m_timer_keepalive(*this),
+                m_timer_probe(*this),
+                m_is_pmtud(false),
+                m_probe_nonce(0)
+        {
+                memset(&m_queue_stat, 0, sizeof(m_queue_stat));
+
+                // UDP mappings of NATs often expire in 30 seconds.
+                // symmetric NATs send through the proxy
+                m_keepalive[node_undefined] = 20;
+                m_keepalive[node_nat]       = 20;
+                m_keepalive[node_cone]      = 20;
+                m_keepalive[node_symmetric] = 0;
+                m_keepalive[node_global]    = 60;
+        }
+
+        dgram::~dgram()
+        {
+                if (! m_paced.empty())
+                        m_timer.unset_timer(&m_timer_pace);
+
+                if (! m_frags.empty())
+                        m_timer.unset_timer(&m_timer_frag);
+
+                if (! m_paths.empty())
+                        m_timer.unset_timer(&m_timer_keepalive);
+
+                if (! m_probing.empty())
+                        m_timer.unset_timer(&m_timer_probe);
+        }
+
+        void
+        dgram::set_keepalive(node_state state, time_t interval)
+        {
+                m_keepalive[state] = (interval > 0) ? interval : 0;
+        }
+
+        void
+        dgram::use_path(const _id &i)
+        {
+                boost::unordered_map<_id, path>::iterator it;
+                time_t now = time(NULL);
+
+                it = m_paths.find(i);
+                if (it != m_paths.end()) {
+                        it->second.last_send = now;
+                        return;
+                }
+
+                path p;
+
+                p.last_send      = now;
+                p.last_keepalive = now;
+                p.last_probe     = 0;
+                p.mtu            = 0;
+                p.probe_mtu      = 0;
+                p.probe_idx      = -1;
+                p.probe_tries    = 0;
+                p.probe_nonce    = 0;
+
+                if (m_paths.empty()) {
+                        m_paths[i] = p;
+                        schedule_keepalive();
+                } else {
+                        m_paths[i] = p;
+                }
+
+                if (m_is_pmtud)
+                        start_probe(i, m_paths[i]);
+        }
+
+        void
+        dgram::schedule_keepalive()
+        {
+                timeval tval;
+                time_t  interval = m_keepalive[m_nat.get_state()];
+
+                // check again later if disabled in the current state
+                tval.tv_sec  = (interval > 0) ? interval : path_idle;
+                tval.tv_usec = 0;
+
+                m_timer.set_timer(&m_timer_keepalive, &tval);
+        }
+
+        void
+        dgram::timer_keepalive::operator() ()
+        {
+                boost::unordered_map<_id, path>::iterator it;
+                node_state state = m_dgram.m_nat.get_state();
+                time_t now       = time(NULL);
+                time_t interval  = m_dgram.m_keepalive[state];
+
+                it = m_dgram.m_paths.begin();
+                while (it != m_dgram.m_paths.end()) {
+                        cageaddr addr;
+
+                        // no recent traffic, or the address was lost
+                        if (now - it->second.last_send > path_idle ||
+                            ! m_dgram.m_peers.find_addr(it->first.id, addr)) {
+                                m_dgram.m_probing.erase(it->first);
+                                m_dgram.m_paths.erase(it++);
+                                continue;
+                        }
+
+                        // search again if the MTU was forgotten by the
+                        // peers, because of a new address for example
+                        if (m_dgram.m_is_pmtud &&
+                            it->second.probe_idx < 0 &&
+                            (now - it->second.last_probe >= probe_interval ||
+                             m_dgram.m_peers.get_mtu(it->first.id) !=
+                             it->second.mtu)) {
+                                m_dgram.start_probe(it->first, it->second);
+                        }
+
+                        if (interval > 0 &&
+                            now - it->second.last_keepalive >= interval) {
+                                // the reply refreshes the peers
+                                send_ping_tmpl<msg_dht_ping>(addr, 0,
+                                                             type_dht_ping,
+                                                             m_dgram.m_id,
+                                                             m_dgram.m_udp);
+
+                                it->second.last_keepalive = now;
+                                m_dgram.m_queue_stat.keepalives++;
+                        }
+
+                        ++it;
+                }
+
+                if (m_dgram.m_probing.empty())
+                        m_dgram.m_timer.unset_timer(&m_dgram.m_timer_probe);
+
+                if (! m_dgram.m_paths.empty())
+                        m_dgram.schedule_keepalive();
+        }
+
+        void
+        dgram::set_pmtud(bool flag)
+        {
+                m_is_pmtud = flag;
+
+                if (flag)
+                        return;
+
+                // stop searching, and keep what was found
+                BOOST_FOREACH(const _id &i, m_probing) {
+                        m_paths[i].probe_idx = -1;
+                }
+
+                if (! m_probing.empty()) {
+                        m_probing.clear();
+                        m_timer.unset_timer(&m_timer_probe);
+                }
+        }
+
+        int
+        dgram::piece_len(id_ptr id)
+        {
+                int dmax = m_peers.get_mtu(id) - (int)sizeof(msg_hdr);
+
+                // the pieces bigger than data_len_max are sent only on
+                // the paths which were confirmed to carry them
+                if (dmax > data_len_max)
+                        return dmax;
+
+                return data_len_max;
+        }
+
+        void
+        dgram::start_probe(const _id &i, path &p)
         {
+                p.probe_mtu   = 0;
+                p.probe_idx   = 0;
+                p.probe_tries = 0;
+
+                if (m_probing.empty()) {
+                        timeval tval;
+
+                        tval.tv_sec  = probe_timeout;
+                        tval.tv_usec = 0;
+
+                        m_timer.set_timer(&m_timer_probe, &tval);
+                }
+
+                m_probing.insert(i);
 
+                send_probe(i, p);
+        }
+
+        void
+        dgram::send_probe(const _id &i, path &p)
+        {
+                msg_dgram_probe *probe;
+                packetbuf_ptr    pbuf;
+                cageaddr         addr;
+                bool             is_sent = false;
+                int              size;
+
+                size = probe_sizes[p.probe_idx];
+
+                // larger than the buffers of this node
+                if (size > PBUF_SIZE - PBUF_DEFAULT_OFFSET ||
+                    ! m_peers.find_addr(i.id, addr)) {
+                        finish_probe(i, p);
+                        return;
+                }
+
+                pbuf  = packetbuf::construct();
+                probe = (msg_dgram_probe*)pbuf->append(size);
+
+                memset(probe, 0, size);
+
+                set_hdr(&probe->hdr, m_id, *i.id, type_dgram_probe, size);
+
+                p.probe_nonce = ++m_probe_nonce;
+                p.probe_tries++;
+
+                probe->nonce = htonl(p.probe_nonce);
+                probe->size  = htons(size);
+
+                if (addr.domain == domain_inet) {
+                        in_ptr in;
+                        in = boost::get<in_ptr>(addr.saddr);
+                        is_sent = m_udp.sendto_dontfrag(probe, size,
+                                                        (sockaddr*)in.get(),
+                                                        sizeof(sockaddr_in));
+                } else if (addr.domain == domain_inet6) {
+                        in6_ptr in6;
+                        in6 = boost::get<in6_ptr>(addr.saddr);
+                        is_sent = m_udp.sendto_dontfrag(probe, size,
+                                                        (sockaddr*)in6.get(),
+                                                        sizeof(sockaddr_in6));
+                }
+
+                // the link of this node is too small
+                if (! is_sent)
+                        finish_probe(i, p);
+        }
+
+        void
+        dgram::finish_probe(const _id &i, path &p)
+        {
+                p.probe_idx  = -1;
+                p.mtu        = p.probe_mtu;
+                p.last_probe = time(NULL);
+
+                m_probing.erase(i);
+
+                if (m_probing.empty())
+                        m_timer.unset_timer(&m_timer_probe);
+
+                if (m_peers.get_mtu(i.id) != p.mtu) {
+                        m_peers.set_mtu(i.id, p.mtu);
+                        m_rdp.update_path_mtu(i.id);
+                }
+        }
+
+        void
+        dgram::timer_probe::operator() ()
+        {
+                std::vector<_id> probing(m_dgram.m_probing.begin(),
+                                         m_dgram.m_probing.end());
+
+                BOOST_FOREACH(const _id &i, probing) {
+                        boost::unordered_map<_id, path>::iterator it;
+
+                        it = m_dgram.m_paths.find(i);
+                        if (it == m_dgram.m_paths.end()) {
+                                m_dgram.m_probing.erase(i);
+                                continue;
+                        }
+
+                        // no reply to the probes. the size is too large
+                        if (it->second.probe_tries >= probe_tries)
+                                m_dgram.finish_probe(i, it->second);
+                        else
+                                m_dgram.send_probe(i, it->second);
+                }
+
+                if (! m_dgram.m_probing.empty()) {
+                        timeval tval;
+
+                        tval.tv_sec  = probe_timeout;
+                        tval.tv_usec = 0;
+
+                        m_dgram.m_timer.set_timer(&m_dgram.m_timer_probe,
+                                                  &tval);
+                }
+        }
+
+        void
+        dgram::recv_probe(packetbuf_ptr pbuf, sockaddr *from)
+        {
+                msg_dgram_probe       *probe;
+                msg_dgram_probe_reply  reply;
+                uint160_t              src;
+
+                if (pbuf->get_len() < (int)sizeof(*probe))
+                        return;
+
+                probe = (msg_dgram_probe*)pbuf->get_data();
+
+                src.from_binary(probe->hdr.src, sizeof(probe->hdr.src));
+
+                set_hdr(&reply.hdr, m_id, src, type_dgram_probe_reply,
+                        sizeof(reply));
+
+                reply.nonce    = probe->nonce;
+                reply.size     = htons(pbuf->get_len());
+                reply.reserved = 0;
+
+                if (from->sa_family == PF_INET)
+                        m_udp.sendto(&reply, sizeof(reply), from,
+                                     sizeof(sockaddr_in));
+                else if (from->sa_family == PF_INET6)
+                        m_udp.sendto(&reply, sizeof(reply), from,
+                                     sizeof(sockaddr_in6));
+        }
+
+        void
+        dgram::recv_probe_reply(packetbuf_ptr pbuf, id_ptr src)
+        {
+                boost::unordered_map<_id, path>::iterator it;
+                msg_dgram_probe_reply *reply;
+                _id i;
+
+                if (pbuf->get_len() != (int)sizeof(*reply))
+                        return;
+
+                reply = (msg_dgram_probe_reply*)pbuf->get_data();
+
+                i.id = src;
+
+                it = m_paths.find(i);
+                if (it == m_paths.end())
+                        return;
+
+                path &p = it->second;
+
+                if (p.probe_idx < 0 ||
+                    ntohl(reply->nonce) != p.probe_nonce ||
+                    ntohs(reply->size) != probe_sizes[p.probe_idx])
+                        return;
+
+                // confirmed. try the next size
+                p.probe_mtu   = probe_sizes[p.probe_idx];
+                p.probe_tries = 0;
+                p.probe_idx++;
+
+                if (p.probe_idx >= probe_sizes_num)
+                        finish_probe(i, p);
+                else
+                        send_probe(i, p);
+        }
+
+        void
+        dgram::print_paths() const
+        {
+                boost::unordered_map<_id, path>::const_iterator it;
+
+                for (it = m_paths.begin(); it != m_paths.end(); ++it) {
+                        std::string str = it->first.id->to_string();
+
+                        if (it->second.mtu > 0)
+                                printf("  %s, MTU = %d\n", str.c_str(),
+                                       it->second.mtu);
+                        else
+                                printf("  %s, MTU = unknown\n", str.c_str());
+                }
+        }
+
+        void
+        dgram::set_pacing(int burst, int usec)
+        {
+                m_pace_burst = (burst > 0) ? burst : 0;
+                m_pace_usec  = (usec > 0) ? usec : 0;
+        }
+
+        void
+        dgram::timer_pace::operator() ()
+        {
+                boost::unordered_set<_id> paced;
+
+                paced.swap(m_dgram.m_paced);
+
+                BOOST_FOREACH(const _id &i, paced) {
+                        m_dgram.send_queue(i.id);
+                }
         }
 
         void
         dgram::send_queue(id_ptr id)
         {
-                try {
-                        boost::unordered_map<_id, type_queue>::iterator it;
-                        cageaddr   addr;
-                        send_data *data;
-                        _id        i;
+                boost::unordered_map<_id, dst_queue>::iterator it;
+                cageaddr   addr;
+                _id        i;
 
-                        i.id = id;
+                i.id = id;
+
+                if (! m_peers.find_addr(id, addr)) {
+                        drop_queue(i);
+                        return;
+                }
 
-                        addr = m_peers.get_addr(id); // throw std::out_of_range
+                it = m_queue.find(i);
+                if (it == m_queue.end())
+                        return;
 
-                        it = m_queue.find(i);
-                        if (it == m_queue.end())
-                                return;
+                // waiting for the timer
+                if (m_paced.find(i) != m_paced.end())
+                        return;
+
+                int n = 0;
+
+                std::deque<send_data> &datas = it->second.datas;
 
-                        while (! it->second.empty()) {
-                                data = it->second.front();
-                                send_msg(data, addr);
-                                m_data_pool[i]->destroy(data);
-                                it->second.pop();
+                while (! datas.empty()) {
+                        if (m_pace_burst > 0 && n >= m_pace_burst) {
+                                pace(i);
+                                return;
                         }
-                } catch (std::out_of_range) {
-                        _id i;
- 
-                        i.id = id;
-                        m_queue.erase(i);
-                        m_data_pool.erase(i);
+
+                        send_msg(&datas.front(), addr);
+
+                        it->second.bytes -= datas.front().len;
+                        m_queue_bytes    -= datas.front().len;
+                        m_queue_stat.sent++;
+
+                        datas.pop_front();
+
+                        n++;
+                }
+
+                m_queue.erase(it);
+
+                use_path(i);
+        }
+
+        void
+        dgram::drop_queue(const _id &i)
+        {
+                boost::unordered_map<_id, dst_queue>::iterator it;
+
+                it = m_queue.find(i);
+                if (it == m_queue.end())
+                        return;
+
+                m_queue_stat.dropped_unreachable += it->second.datas.size();
+                m_queue_bytes -= it->second.bytes;
+
+                m_queue.erase(it);
+        }
+
+        bool
+        dgram::drop_oldest_queued()
+        {
+                boost::unordered_map<_id, dst_queue>::iterator it, oldest;
+
+                oldest = m_queue.end();
+                for (it = m_queue.begin(); it != m_queue.end(); ++it) {
+                        if (it->second.datas.empty())
+                                continue;
+
+                        if (oldest == m_queue.end() ||
+                            it->second.datas.front().seq <
+                            oldest->second.datas.front().seq)
+                                oldest = it;
+                }
+
+                if (oldest == m_queue.end())
+                        return false;
+
+                oldest->second.bytes -= oldest->second.datas.front().len;
+                m_queue_bytes        -= oldest->second.datas.front().len;
+                m_queue_stat.dropped_full++;
+
+                oldest->second.datas.pop_front();
+
+                if (oldest->second.datas.empty())
+                        m_queue.erase(oldest);
+
+                return true;
+        }
+
+        void
+        dgram::set_queue_limit(size_t dst_bytes, size_t total_bytes,
+                               queue_policy policy)
+        {
+                m_queue_dst_max   = dst_bytes;
+                m_queue_total_max = total_bytes;
+                m_queue_policy    = policy;
+        }
+
+        void
+        dgram::get_queue_status(queue_status &st) const
+        {
+                st = m_queue_stat;
+
+                st.bytes   = m_queue_bytes;
+                st.num_dst = m_queue.size();
+        }
+
+        void
+        dgram::pace(const _id &i)
+        {
+                if (m_paced.empty()) {
+                        timeval tval;
+
+                        tval.tv_sec  = m_pace_usec / 1000000;
+                        tval.tv_usec = m_pace_usec % 1000000;
+
+                        m_timer.set_timer(&m_timer_pace, &tval);
                 }
+
+                m_paced.insert(i);
         }
 
         void
         dgram::push2queue(id_ptr id, const void *msg, int len,
                           const uint160_t &src)
+        {
+                std::vector<packetbuf_ptr> pbufs;
+                uint8_t type;
+
+                type = split_msg(msg, len, piece_len(id), pbufs);
+
+                BOOST_FOREACH(packetbuf_ptr &pbuf, pbufs) {
+                        push2queue(id, pbuf, src, type);
+                }
+        }
+
+        uint8_t
+        dgram::split_msg(const void *msg, int len, int dmax,
+                         std::vector<packetbuf_ptr> &pbufs)
         {
                 int total = 0;
-                int dmax  = PBUF_SIZE - PBUF_DEFAULT_OFFSET;
+
+                if (m_is_frag && len > dmax) {
+                        msg_dgram_frag *frag;
+                        int hlen = sizeof(*frag) - sizeof(frag->data) -
+                                   sizeof(frag->hdr);
+                        int count;
+
+                        dmax -= hlen;
+                        count = (len + dmax - 1) / dmax;
+
+                        if (count > frag_count_max) {
+                                m_queue_stat.dropped_large++;
+                                return type_dgram_frag;
+                        }
+
+                        m_frag_msgid++;
+
+                        for (int idx = 0; idx < count; idx++) {
+                                packetbuf_ptr pbuf = packetbuf::construct();
+                                int plen = (len > dmax) ? dmax : len;
+
+                                frag = (msg_dgram_frag*)pbuf->append(
+                                        sizeof(frag->hdr) + hlen + plen);
+                                pbuf->rm_head(sizeof(frag->hdr));
+
+                                frag->msgid = htonl(m_frag_msgid);
+                                frag->index = htons(idx);
+                                frag->count = htons(count);
+
+                                memcpy(frag->data, (char*)msg + total, plen);
+
+                                pbufs.push_back(pbuf);
+
+                                len   -= plen;
+                                total += plen;
+                        }
+
+                        return type_dgram_frag;
+                }
 
                 while (len > 0) {
                         packetbuf_ptr pbuf = packetbuf::construct();
@@ -195,36 +764,62 @@ namespace libcage {
                         p = pbuf->append(plen);
                         memcpy(p, (char*)msg + total, plen);
 
-                        push2queue(id, pbuf, src);
+                        pbufs.push_back(pbuf);
 
                         len   -= plen;
                         total += plen;
                 }
+
+                return type_dgram;
         }
 
         void
         dgram::push2queue(id_ptr id, packetbuf_ptr pbuf, const uint160_t &src,
                           uint8_t type)
         {
-                boost::unordered_map<_id, data_pool_ptr>::iterator it;
-                send_data *data;
+                send_data data;
+                size_t    len = pbuf->get_len();
                 _id i;
 
                 i.id = id;
 
-                it = m_data_pool.find(i);
-                if (it == m_data_pool.end()) {
-                        m_data_pool[i] = data_pool_ptr(new data_pool);
+                if (len > m_queue_dst_max || len > m_queue_total_max) {
+                        m_queue_stat.dropped_full++;
+                        return;
                 }
 
-                data = m_data_pool[i]->construct();
+                while (m_queue_bytes + len > m_queue_total_max) {
+                        if (m_queue_policy == queue_reject ||
+                            ! drop_oldest_queued()) {
+                                m_queue_stat.dropped_full++;
+                                return;
+                        }
+                }
 
-                data->pbuf = pbuf;
-                data->len  = pbuf->get_len();
-                data->src  = src;
-                data->type = type;
+                dst_queue &q = m_queue[i];
 
-                m_queue[i].push(data);
+                while (q.bytes + len > m_queue_dst_max) {
+                        if (m_queue_policy == queue_reject) {
+                                m_queue_stat.dropped_full++;
+                                return;
+                        }
+
+                        q.bytes       -= q.datas.front().len;
+                        m_queue_bytes -= q.datas.front().len;
+                        m_queue_stat.dropped_full++;
+
+                        q.datas.pop_front();
+                }
+
+                data.pbuf = pbuf;
+                data.len  = len;
+                data.src  = src;
+                data.seq  = m_queue_seq++;
+                data.type = type;
+
+                q.datas.push_back(data);
+                q.bytes       += len;
+                m_queue_bytes += len;
         }
 
         void
@@ -240,15 +835,7 @@ namespace libcage {
 
                 size = data->len + sizeof(msg_hdr);
 
-                memset(dgram, 0 , sizeof(dgram->hdr));
-
-                dgram->hdr.magic = htons(MAGIC_NUMBER);
-                dgram->hdr.ver   = CAGE_VERSION;
-                dgram->hdr.type  = data->type;
-                dgram->hdr.len   = htons(size);
-                
-                data->src.to_binary(dgram->hdr.src, sizeof(dgram->hdr.src));
-                dst.id->to_binary(dgram->hdr.dst, sizeof(dgram->hdr.dst));
+                set_hdr(&dgram->hdr, data->src, *dst.id, data->type, size);
 
                 if (dst.domain == domain_inet) {
                         in_ptr in;
@@ -265,6 +852,113 @@ namespace libcage {
                 data->pbuf->rm_head(sizeof(dgram->hdr));
         }
 
+        void
+        dgram::set_hdr(msg_hdr *hdr, const uint160_t &src,
+                       const uint160_t &dst, uint8_t type, int size)
+        {
+                memset(hdr, 0 , sizeof(*hdr));
+
+                hdr->magic = htons(MAGIC_NUMBER);
+                hdr->ver   = CAGE_VERSION;
+                hdr->type  = type;
+                hdr->len   = htons(size);
+
+                src.to_binary(hdr->src, sizeof(hdr->src));
+                dst.to_binary(hdr->dst, sizeof(hdr->dst));
+        }
+
+        void
+        dgram::send_dgram(const void *msg, int len,
+                          const std::vector<id_ptr> &ids)
+        {
+                std::vector<udphandler::datagram> dgrams;
+                std::vector<packetbuf_ptr> pbufs;
+                std::vector<cageaddr>      addrs;
+                std::vector<id_ptr>        unknown;
+                boost::unordered_set<_id>  done;
+                uint8_t type;
+
+                if (len < 0)
+                        return;
+
+                // the pieces are shared by all the destinations
+                type = split_msg(msg, len, data_len_max, pbufs);
+
+                if (pbufs.empty())
+                        return;
+
+                addrs.reserve(ids.size());
+
+                BOOST_FOREACH(const id_ptr &id, ids) {
+                        cageaddr addr;
+                        _id      i;
+
+                        i.id = id;
+
+                        if (! done.insert(i).second)
+                                continue;
+
+                        // keep the order with the queued pieces
+                        if (m_queue.find(i) != m_queue.end() ||
+                            (m_pace_burst > 0 &&
+                             (int)pbufs.size() > m_pace_burst) ||
+                            ! m_peers.find_addr(id, addr)) {
+                                BOOST_FOREACH(packetbuf_ptr &pbuf, pbufs) {
+                                        push2queue(id, pbuf, m_id, type);
+                                }
+
+                                unknown.push_back(id);
+                                continue;
+                        }
+
+                        addrs.push_back(addr);
+                        use_path(i);
+                }
+
+                // the headers for each destination, and the datagrams
+                // pointing them and the shared pieces
+                std::vector<msg_hdr> hdrs(addrs.size() * pbufs.size());
+                int n = 0;
+
+                dgrams.reserve(hdrs.size());
+
+                BOOST_FOREACH(cageaddr &addr, addrs) {
+                        udphandler::datagram d;
+
+                        if (addr.domain == domain_inet) {
+                                d.to    = (sockaddr*)boost::get<in_ptr>(
+                                        addr.saddr).get();
+                                d.tolen = sizeof(sockaddr_in);
+                        } else {
+                                d.to    = (sockaddr*)boost::get<in6_ptr>(
+                                        addr.saddr).get();
+                                d.tolen = sizeof(sockaddr_in6);
+                        }
+
+                        BOOST_FOREACH(packetbuf_ptr &pbuf, pbufs) {
+                                int size = pbuf->get_len() + sizeof(msg_hdr);
+
+                                set_hdr(&hdrs[n], m_id, *addr.id, type, size);
+
+                                d.head    = &hdrs[n];
+                                d.headlen = sizeof(msg_hdr);
+                                d.body    = pbuf->get_data();
+                                d.bodylen = pbuf->get_len();
+
+                                dgrams.push_back(d);
+                                n++;
+                        }
+                }
+
+                m_udp.sendto(dgrams);
+                m_queue_stat.sent += dgrams.size();
+
+                // look up the rest together
+                BOOST_FOREACH(id_ptr &id, unknown) {
+                        request(id);
+                }
+        }
+
         void
         dgram::set_callback(dgram::callback func)
         {
@@ -321,9 +1015,176 @@ namespace libcage {
 
                 if (dgram->hdr.type == type_dgram && m_is_callback) {
                         m_callback(dgram->data, size, (uint8_t*)dgram->hdr.src);
+                } else if (dgram->hdr.type == type_dgram_frag) {
+                        recv_frag(pbuf, size);
                 } else if (dgram->hdr.type == type_rdp) {
                         pbuf->rm_head(sizeof(dgram->hdr));
                         m_rdp.input_dgram(addr.id, pbuf);
+                } else if (dgram->hdr.type == type_dgram_probe) {
+                        recv_probe(pbuf, from);
+                } else if (dgram->hdr.type == type_dgram_probe_reply) {
+                        recv_probe_reply(pbuf, addr.id);
+                }
+        }
+
+        void
+        dgram::set_reassembly_limit(size_t bytes)
+        {
+                m_frag_mem_max = bytes;
+
+                while (m_frag_mem > m_frag_mem_max)
+                        drop_oldest_frag();
+        }
+
+        void
+        dgram::recv_frag(packetbuf_ptr pbuf, int size)
+        {
+                frag_map::iterator it;
+                msg_dgram_frag *frag;
+                frag_key  key;
+                size_t    mem = sizeof(packetbuf);
+                int       hlen;
+                int       idx, count;
+
+                hlen = sizeof(*frag) - sizeof(frag->data) - sizeof(frag->hdr);
+
+                if (size <= hlen || ! m_is_callback)
+                        return;
+
+                frag = (msg_dgram_frag*)pbuf->get_data();
+
+                idx   = ntohs(frag->index);
+                count = ntohs(frag->count);
+
+                if (count == 0 || count > frag_count_max || idx >= count)
+                        return;
+
+                if (mem * count > m_frag_mem_max)
+                        return;
+
+                key.src.from_binary(frag->hdr.src, sizeof(frag->hdr.src));
+                key.msgid = ntohl(frag->msgid);
+
+                it = m_frags.find(key);
+                if (it == m_frags.end()) {
+                        frag_buf buf;
+
+                        buf.pieces.resize(count);
+                        buf.num   = 0;
+                        buf.len   = 0;
+                        buf.mem   = 0;
+                        buf.stamp = time(NULL);
+
+                        if (m_frags.empty()) {
+                                timeval tval;
+
+                                tval.tv_sec  = frag_timeout;
+                                tval.tv_usec = 0;
+
+                                m_timer.set_timer(&m_timer_frag, &tval);
+                        }
+
+                        it = m_frags.insert(std::make_pair(key, buf)).first;
+                } else if ((int)it->second.pieces.size() != count ||
+                           it->second.pieces[idx].get() != NULL) {
+                        return;
+                }
+
+                // make room by dropping the oldest messages
+                while (m_frag_mem + mem > m_frag_mem_max) {
+                        drop_oldest_frag();
+
+                        it = m_frags.find(key);
+                        if (it == m_frags.end())
+                                return;
+                }
+
+                frag_buf &buf = it->second;
+
+                pbuf->rm_head(sizeof(frag->hdr) + hlen);
+
+                buf.pieces[idx] = pbuf;
+                buf.num++;
+                buf.len += pbuf->get_len();
+                buf.mem += mem;
+
+                m_frag_mem += mem;
+
+                if (buf.num < count)
+                        return;
+
+                // all the pieces arrived
+                std::vector<char> msg(buf.len);
+                uint8_t src[CAGE_ID_LEN];
+                int     len = 0;
+
+                BOOST_FOREACH(packetbuf_ptr &p, buf.pieces) {
+                        memcpy(&msg[len], p->get_data(), p->get_len());
+                        len += p->get_len();
+                }
+
+                key.src.to_binary(src, sizeof(src));
+
+                drop_frag(it);
+
+                m_callback(&msg[0], msg.size(), src);
+        }
+
+        void
+        dgram::drop_frag(frag_map::iterator it)
+        {
+                m_frag_mem -= it->second.mem;
+                m_frags.erase(it);
+
+                if (m_frags.empty())
+                        m_timer.unset_timer(&m_timer_frag);
+        }
+
+        void
+        dgram::drop_oldest_frag()
+        {
+                frag_map::iterator it, oldest;
+
+                if (m_frags.empty())
+                        return;
+
+                oldest = m_frags.begin();
+                for (it = m_frags.begin(); it != m_frags.end(); ++it) {
+                        if (it->second.stamp < oldest->second.stamp)
+                                oldest = it;
+                }
+
+                drop_frag(oldest);
+        }
+
+        void
+        dgram::timer_frag::operator() ()
+        {
+                dgram::frag_map::iterator it;
+                time_t now = time(NULL);
+                time_t oldest = now;
+
+                it = m_dgram.m_frags.begin();
+                while (it != m_dgram.m_frags.end()) {
+                        if (now - it->second.stamp >= frag_timeout) {
+                                m_dgram.m_frag_mem -= it->second.mem;
+                                m_dgram.m_frags.erase(it++);
+                        } else {
+                                if (it->second.stamp < oldest)
+                                        oldest = it->second.stamp;
+                                ++it;
+                        }
+                }
+
+                // wake up when the oldest one expires
+                if (! m_dgram.m_frags.empty()) {
+                        timeval tval;
+
+                        tval.tv_sec  = frag_timeout - (now - oldest);
+                        tval.tv_usec = 0;
+
+                        m_dgram.m_timer.set_timer(&m_dgram.m_timer_frag,
+                                                  &tval);
                 }
         }
 }
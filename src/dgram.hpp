@@ -38,15 +38,17 @@
 #include "cagetypes.hpp"
 #include "dht.hpp"
 #include "dtun.hpp"
+#include "natdetector.hpp"
 #include "packetbuf.hpp"
 #include "peers.hpp"
 #include "rdp.hpp"
+#include "timer.hpp"
 #include "udphandler.hpp"
 
-#include <queue>
+#include <deque>
+#include <map>
+#include <vector>
 
-#include <boost/pool/object_pool.hpp>
-#include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/unordered_set.hpp>
 
@@ -60,9 +62,41 @@ namespace libcage {
                                               uint8_t *addr)> callback;
 
 
-                dgram(const uint160_t &id, peers &p, udphandler &udp,
-                      dtun &dt, dht &dh, proxy &pr, advertise &adv,
-                      rdp &r);
+                static const int        data_len_max;
+                static const int        frag_count_max;
+                static const time_t     frag_timeout;
+                static const size_t     frag_mem_default;
+                static const size_t     queue_dst_default;
+                static const size_t     queue_total_default;
+                static const time_t     path_idle;
+                static const uint16_t   probe_sizes[];
+                static const int        probe_sizes_num;
+                static const int        probe_tries;
+                static const time_t     probe_timeout;
+                static const time_t     probe_interval;
+
+                // what is done when a queue reaches its limit
+                enum queue_policy {
+                        queue_drop_oldest, // drop the oldest pieces
+                        queue_reject,      // drop the new one
+                };
+
+                class queue_status {
+                public:
+                        size_t          bytes;    // bytes waiting to be sent
+                        size_t          num_dst;  // the number of queues
+                        uint64_t        sent;
+                        uint64_t        dropped_full;
+                        uint64_t        dropped_unreachable;
+                        uint64_t        dropped_large; // over set_fragment()
+                        uint64_t        requests;   // address lookups
+                        uint64_t        keepalives;
+                };
+
+                dgram(const uint160_t &id, timer &t, peers &p,
+                      udphandler &udp, natdetector &nat, dtun &dt, dht &dh,
+                      proxy &pr, advertise &adv, rdp &r);
+                virtual ~dgram();
 
                 void            recv_dgram(packetbuf_ptr pbuf, sockaddr *from);
 
@@ -71,8 +105,60 @@ namespace libcage {
                 void            send_dgram(const void *msg, int len, id_ptr id);
                 void            send_dgram(const void *msg, int len, id_ptr id,
                                            const uint160_t &src);
+
+                // the same message to many destinations. the pieces are
+                // built once, and are sent at once to the destinations
+                // whose addresses are known
+                void            send_dgram(const void *msg, int len,
+                                           const std::vector<id_ptr> &ids);
                 void            set_callback(callback func);
 
+                // at most burst pieces queued for a destination are sent
+                // back to back, and the rest follow every usec
+                // microseconds. burst 0 sends all at once
+                void            set_pacing(int burst, int usec);
+
+                // messages bigger than data_len_max are sent as numbered
+                // pieces and delivered to the callback at once after all
+                // the pieces arrive, instead of piece by piece. a message
+                // is at most frag_count_max pieces, which is 113664 bytes
+                // (128 * 888) on the paths not probed for a bigger MTU.
+                // bigger ones are dropped and counted in dropped_large
+                void            set_fragment(bool flag) { m_is_frag = flag; }
+
+                // incomplete messages are dropped, oldest first, when
+                // holding their pieces needs more than bytes
+                void            set_reassembly_limit(size_t bytes);
+                size_t          get_reassembly_bytes() const { return m_frag_mem; }
+                size_t          get_reassembly_num() const { return m_frags.size(); }
+
+                // pieces wait in a queue per destination while its address
+                // is looked up. dst_bytes limits each queue and total_bytes
+                // limits all of them
+                void            set_queue_limit(size_t dst_bytes,
+                                                size_t total_bytes,
+                                                queue_policy policy);
+                void            get_queue_status(queue_status &st) const;
+
+                // the paths to the destinations sent to within path_idle
+                // seconds are kept by pinging them every interval seconds
+                // while this node is in the state, so that the NAT
+                // mappings and the entries of the peers do not expire
+                // and no more lookup is needed. 0 for no keepalive
+                void            set_keepalive(node_state state,
+                                              time_t interval);
+
+                // the path MTU to each destination in use is searched by
+                // padded probes of probe_sizes, and again every
+                // probe_interval seconds. the messages to a destination
+                // are split into pieces as big as its MTU, which is kept
+                // in the peers, instead of data_len_max.
+                // the same message to many destinations is split by
+                // data_len_max, since its pieces are shared by them all.
+                // disabled by default
+                void            set_pmtud(bool flag);
+                void            print_paths() const;
+
         private:
                 class request_func {
                 public:
@@ -90,15 +176,97 @@ namespace libcage {
                         id_ptr  dst;
                 };
 
+                class timer_pace : public timer::callback {
+                public:
+                        virtual void operator() ();
+
+                        timer_pace(dgram &d) : m_dgram(d) { }
+
+                        dgram  &m_dgram;
+                };
+
+                class timer_frag : public timer::callback {
+                public:
+                        virtual void operator() ();
+
+                        timer_frag(dgram &d) : m_dgram(d) { }
+
+                        dgram  &m_dgram;
+                };
+
+                class timer_keepalive : public timer::callback {
+                public:
+                        virtual void operator() ();
+
+                        timer_keepalive(dgram &d) : m_dgram(d) { }
+
+                        dgram  &m_dgram;
+                };
+
+                class timer_probe : public timer::callback {
+                public:
+                        virtual void operator() ();
+
+                        timer_probe(dgram &d) : m_dgram(d) { }
+
+                        dgram  &m_dgram;
+                };
+
+                class path {
+                public:
+                        time_t          last_send;
+                        time_t          last_keepalive;
+                        time_t          last_probe; // the last search
+                        uint16_t        mtu;        // found by it
+                        uint16_t        probe_mtu;  // confirmed so far
+                        int             probe_idx;  // -1 if not searching
+                        int             probe_tries;
+                        uint32_t        probe_nonce;
+                };
+
+                class frag_key {
+                public:
+                        uint160_t       src;
+                        uint32_t        msgid;
+
+                        bool operator< (const frag_key &rhs) const
+                        {
+                                if (msgid != rhs.msgid)
+                                        return msgid < rhs.msgid;
+                                return src < rhs.src;
+                        }
+                };
+
+                class frag_buf {
+                public:
+                        std::vector<packetbuf_ptr>      pieces;
+                        int             num;  // the number of arrived pieces
+                        int             len;  // bytes of arrived data
+                        size_t          mem;
+                        time_t          stamp;
+                };
+
+                typedef std::map<frag_key, frag_buf>    frag_map;
+
                 class send_data {
                 public:
                         packetbuf_ptr   pbuf;
                         uint160_t       src;
+                        uint64_t        seq;
                         int             len;
                         uint8_t         type;
                 };
 
+                class dst_queue {
+                public:
+                        std::deque<send_data>   datas;
+                        size_t                  bytes;
+
+                        dst_queue() : bytes(0) { }
+                };
+
                 void            send_queue(id_ptr id);
+                void            pace(const _id &i);
                 void            push2queue(id_ptr id, const void *msg, int len,
                                            const uint160_t &src);
                 void            push2queue(id_ptr id, packetbuf_ptr pbuf,
@@ -106,20 +274,43 @@ namespace libcage {
                                            uint8_t type = type_dgram);
 
                 void            request(id_ptr id);
+                void            drop_queue(const _id &i);
+                void            use_path(const _id &i);
+                void            schedule_keepalive();
+                bool            drop_oldest_queued();
+
+                int             piece_len(id_ptr id);
+                void            start_probe(const _id &i, path &p);
+                void            send_probe(const _id &i, path &p);
+                void            finish_probe(const _id &i, path &p);
+                void            recv_probe(packetbuf_ptr pbuf, sockaddr *from);
+                void            recv_probe_reply(packetbuf_ptr pbuf,
+                                                 id_ptr src);
 
                 void            send_msg(send_data *data, cageaddr &dst);
+                void            set_hdr(msg_hdr *hdr, const uint160_t &src,
+                                        const uint160_t &dst, uint8_t type,
+                                        int size);
+                // pbufs is left empty when the message is too large
+                uint8_t         split_msg(const void *msg, int len, int dmax,
+                                          std::vector<packetbuf_ptr> &pbufs);
 
+                void            recv_frag(packetbuf_ptr pbuf, int size);
+                void            drop_frag(frag_map::iterator it);
+                void            drop_oldest_frag();
 
-                typedef boost::object_pool<send_data>   data_pool;
-                typedef boost::shared_ptr<data_pool>    data_pool_ptr;
-                typedef std::queue<send_data*>          type_queue;
 
-                boost::unordered_map<_id, data_pool_ptr>        m_data_pool;
-                boost::unordered_map<_id, type_queue>   m_queue;
+                boost::unordered_map<_id, dst_queue>    m_queue;
                 boost::unordered_set<_id>               m_requesting;
+                boost::unordered_set<_id>               m_paced;
+                frag_map                                m_frags;
+                boost::unordered_map<_id, path>         m_paths;
+                boost::unordered_set<_id>               m_probing;
                 const uint160_t        &m_id;
+                timer                  &m_timer;
                 peers                  &m_peers;
                 udphandler             &m_udp;
+                natdetector            &m_nat;
                 dtun                   &m_dtun;
                 dht                    &m_dht;
                 proxy                  &m_proxy;
@@ -127,6 +318,25 @@ namespace libcage {
                 rdp                    &m_rdp;
                 callback                m_callback;
                 bool                    m_is_callback;
+                timer_pace              m_timer_pace;
+                int                     m_pace_burst;
+                int                     m_pace_usec;
+                timer_frag              m_timer_frag;
+                bool                    m_is_frag;
+                uint32_t                m_frag_msgid;
+                size_t                  m_frag_mem;
+                size_t                  m_frag_mem_max;
+                size_t                  m_queue_bytes;
+                size_t                  m_queue_dst_max;
+                size_t                  m_queue_total_max;
+                queue_policy            m_queue_policy;
+                uint64_t                m_queue_seq;
+                queue_status            m_queue_stat;
+                timer_keepalive         m_timer_keepalive;
+                time_t                  m_keepalive[node_global + 1];
+                timer_probe             m_timer_probe;
+                bool                    m_is_pmtud;
+                uint32_t                m_probe_nonce;
         };
 }
 
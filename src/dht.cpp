@@ -46,7 +46,15 @@ namespace libcage {
         const int       dht::recvd_value_timeout = 3;
         const uint16_t  dht::rdp_store_port      = 100;
         const uint16_t  dht::rdp_get_port        = 101;
+        const uint16_t  dht::rdp_sync_port       = 102;
         const time_t    dht::rdp_timeout         = 30;
+        const time_t    dht::rdp_pool_idle       = 20;
+        const int       dht::sync_max_entries    = 4096;
+        const uint32_t  dht::max_value_len       = 64 * 1024 * 1024;
+        const uint32_t  dht::compress_min_len    = 128;
+        const uint32_t  dht::value_chunk         = 64 * 1024;
+        const size_t    dht::rdp_recv_mem_max    = 128 * 1024 * 1024;
+        const time_t    dht::compress_node_ttl   = 60 * 60;
 
         size_t
         hash_value(const dht::_key &k)
@@ -74,7 +82,7 @@ namespace libcage {
                 for (int i = 0; i < len; i++)
                         boost::hash_combine(h, p[i]);
 
-                for (int j = len * 4; j < sdata.valuelen; j++)
+                for (uint32_t j = len * 4; j < sdata.valuelen; j++)
                         boost::hash_combine(h, sdata.value[j]);
 
                 return h;
@@ -99,14 +107,18 @@ namespace libcage {
                 m_fast_timer_dht(*this),
                 m_join(*this),
                 m_sync(*this),
-                m_is_use_rdp(true)
+                m_is_use_rdp(true),
+                m_is_use_compress(false),
+                m_rdp_recv_mem(0)
         {
                 rdp_recv_store_func func_recv(*this);
                 rdp_recv_get_func   func_get(*this);
+                rdp_recv_sync_func  func_sync(*this);
 
 
                 m_rdp_recv_listen = m_rdp.listen(rdp_store_port, func_recv);
                 m_rdp_get_listen  = m_rdp.listen(rdp_get_port, func_get);
+                m_rdp_sync_listen = m_rdp.listen(rdp_sync_port, func_sync);
 
 
                 m_mask_bit = 1;
@@ -116,6 +128,10 @@ namespace libcage {
         {
                 std::map<int, rdp_recv_store_ptr>::iterator it1;
                 std::map<int, time_t>::iterator it2;
+                std::map<int, rdp_sync_ptr>::iterator it3;
+                std::map<int, rdp_recv_sync_ptr>::iterator it4;
+                std::map<int, rdp_pool_ptr>::iterator it5;
+                std::map<int, rdp_get_pool_ptr>::iterator it6;
 
                 for (it1 = m_rdp_recv_store.begin();
                      it1 != m_rdp_recv_store.end(); ++it1) {
@@ -127,9 +143,30 @@ namespace libcage {
                         m_rdp.close(it2->first);
                 }
 
+                for (it3 = m_rdp_sync.begin(); it3 != m_rdp_sync.end();
+                     ++it3) {
+                        m_rdp.close(it3->first);
+                }
+
+                for (it4 = m_rdp_recv_sync.begin();
+                     it4 != m_rdp_recv_sync.end(); ++it4) {
+                        m_rdp.close(it4->first);
+                }
+
+                for (it5 = m_rdp_pool_desc.begin();
+                     it5 != m_rdp_pool_desc.end(); ++it5) {
+                        m_rdp.close(it5->first);
+                }
+
+                for (it6 = m_rdp_get_pool_desc.begin();
+                     it6 != m_rdp_get_pool_desc.end(); ++it6) {
+                        m_rdp.close(it6->first);
+                }
+
 
                 m_rdp.close(m_rdp_recv_listen);
                 m_rdp.close(m_rdp_get_listen);
+                m_rdp.close(m_rdp_sync_listen);
         }
 
         void
@@ -381,43 +418,150 @@ namespace libcage {
                         return false;
                 }
 
-                m_query->rdp_state = query::QUERY_VAL;
                 m_query->rdp_time  = time(NULL);
                 m_query->vallen    = ntohs(msg.valuelen);
                 m_query->val_read  = 0;
+                m_query->val_flags = msg.flags;
+
+                // compressed values are not acceptable when streaming
+                if (m_query->is_chunk &&
+                    (msg.flags & dht_flag_compressed)) {
+                        close_rdp(desc);
+                        return false;
+                }
+
+                if (msg.flags & dht_flag_large) {
+                        m_query->rdp_state = query::QUERY_LEN;
+                        return true;
+                }
 
                 if (m_query->vallen == 0) {
+                        // the end of the values
+                        if (msg.flags & dht_flag_keep) {
+                                m_pool->current.reset();
+                                m_pool->last_time = time(NULL);
+
+                                m_dht.next_get(m_query);
+                                m_dht.send_get(m_pool);
+
+                                return true;
+                        }
+
+                        m_dht.close_get_pool(m_pool, true);
+                        return false;
+                }
+
+                alloc_val();
+
+                return true;
+        }
+
+        bool
+        dht::rdp_get_func::read_len(int desc)
+        {
+                msg_dht_rdp_valuelen msg;
+                int size = sizeof(msg);
+
+                m_dht.m_rdp.receive(desc, &msg, &size);
+
+                if (size == 0)
+                        return false;
+
+                if (size != sizeof(msg)) {
+                        close_rdp(desc);
+                        return false;
+                }
+
+                m_query->rdp_time = time(NULL);
+                m_query->vallen   = ntohl(msg.valuelen);
+
+                if (m_query->vallen == 0 || m_query->vallen > max_value_len) {
                         close_rdp(desc);
                         return false;
                 }
 
-                boost::shared_array<char> val(new char[m_query->vallen]);
-                m_query->val = val;
+                alloc_val();
 
                 return true;
         }
 
+        void
+        dht::rdp_get_func::alloc_val()
+        {
+                // received segments are passed to chunk directly when
+                // streaming, and the buffer grows as the value arrives
+                // otherwise
+                m_query->val.reset();
+                m_query->val_cap = 0;
+
+                m_query->rdp_state = query::QUERY_VAL;
+        }
+
         bool
         dht::rdp_get_func::read_val(int desc)
         {
-                int   size = m_query->vallen - m_query->val_read;
-                char *buf  = &m_query->val[m_query->val_read];
+                std::vector<packetbuf_ptr> bufs;
+                int size = m_query->vallen - m_query->val_read;
 
-                m_dht.m_rdp.receive(desc, buf, &size);
+                m_dht.m_rdp.receive(desc, bufs, &size);
 
                 if (size == 0)
                         return false;
 
-                m_query->val_read += size;
+                if (! m_query->is_chunk &&
+                    m_query->val_read + size > m_query->val_cap) {
+                        uint32_t cap;
+
+                        cap = next_value_cap(m_query->val_cap,
+                                             m_query->val_read + size,
+                                             m_query->vallen);
+
+                        grow_value(m_query->val, m_query->val_read, cap);
+
+                        m_query->val_cap = cap;
+                }
+
+                BOOST_FOREACH(packetbuf_ptr &pbuf, bufs) {
+                        if (m_query->is_chunk)
+                                m_query->chunk(pbuf->get_data(),
+                                               pbuf->get_len(),
+                                               m_query->val_read,
+                                               m_query->vallen);
+                        else
+                                memcpy(&m_query->val[m_query->val_read],
+                                       pbuf->get_data(), pbuf->get_len());
+
+                        m_query->val_read += pbuf->get_len();
+                }
 
                 if (m_query->vallen == m_query->val_read) {
-                        value_t val;
+                        if (m_query->is_chunk) {
+                                m_query->num_streamed++;
+                        } else if (m_query->val_flags & dht_flag_compressed) {
+                                boost::shared_array<char> plain;
+                                uint32_t plainlen;
+                                value_t  val;
+
+                                if (uncompress_value(m_query->val.get(),
+                                                     m_query->vallen, plain,
+                                                     plainlen,
+                                                     max_value_len)) {
+                                        val.value = plain;
+                                        val.len   = plainlen;
+
+                                        m_query->vset->insert(val);
+                                }
+                        } else {
+                                value_t val;
 
-                        val.value = m_query->val;
-                        val.len   = m_query->vallen;
+                                val.value = m_query->val;
+                                val.len   = m_query->vallen;
 
-                        m_query->vset->insert(val);
+                                m_query->vset->insert(val);
+                        }
 
+                        m_query->val.reset();
+                        m_query->val_cap   = 0;
                         m_query->rdp_state = query::QUERY_HDR;
 
                         uint8_t op = dht_get_next;
@@ -432,61 +576,45 @@ namespace libcage {
         void
         dht::rdp_get_func::close_rdp(int desc)
         {
-                m_dht.m_rdp.close(desc);
-
-                if (m_query->vset->size() > 0) {
-                        m_dht.recvd_value(m_query);
-                        return;
-                }
-
-                if (m_query->ids.size() > 0) {
-                        id_ptr id = m_query->ids.front();
-
-                        m_query->ids.pop();
-                        m_query->rdp_time = time(NULL);
-                        m_query->rdp_desc = m_dht.m_rdp.connect(rdp_get_port,
-                                                                id, 0, *this);
-                } else {
-                        m_query->is_rdp_con = false;
-                        m_dht.send_find(m_query);
-                }
+                m_dht.close_get_pool(m_pool, false);
         }
 
         void
         dht::rdp_get_func::operator() (int desc, rdp_addr addr,
                                        rdp_event event)
         {
-                switch (event) {
-                case CONNECTED:
-                {
-                        m_query->is_rdp_con = true;
-                        m_query->rdp_desc   = desc;
-                        m_query->rdp_time   = time(NULL);
-                        m_query->rdp_state  = query::QUERY_HDR;
-
-                        msg_dht_rdp_get get;
-
-                        memset(&get, 0, sizeof(get));
-                        m_query->dst->to_binary(get.id, sizeof(get.id));
-                        get.keylen = htons(m_query->keylen);
+                std::map<int, rdp_get_pool_ptr>::iterator it;
 
-                        m_dht.m_rdp.send(desc, &get, sizeof(get));
-                        m_dht.m_rdp.send(desc, m_query->key.get(),
-                                         m_query->keylen);
+                it = m_dht.m_rdp_get_pool_desc.find(desc);
+                if (it == m_dht.m_rdp_get_pool_desc.end()) {
+                        m_dht.m_rdp.close(desc);
+                        return;
+                }
 
-                        uint8_t op = dht_get_next;
-                        m_dht.m_rdp.send(desc, &op, sizeof(op));
+                m_pool = it->second;
 
+                switch (event) {
+                case CONNECTED:
+                        m_pool->is_connected = true;
+                        m_dht.send_get(m_pool);
                         break;
-                }
                 case READY2READ:
                 {
                         for (;;) {
+                                // nothing is expected between queries
+                                m_query = m_pool->current;
+                                if (! m_query)
+                                        return;
+
                                 switch (m_query->rdp_state) {
                                 case query::QUERY_HDR:
                                         if (! read_hdr(desc))
                                                 return;
                                         break;
+                                case query::QUERY_LEN:
+                                        if (! read_len(desc))
+                                                return;
+                                        break;
                                 case query::QUERY_VAL:
                                         if (! read_val(desc))
                                                 return;
@@ -496,6 +624,8 @@ namespace libcage {
 
                         break;
                 }
+                case WRITABLE:
+                        break;
                 default:
                         close_rdp(desc);
                 }
@@ -521,6 +651,7 @@ namespace libcage {
                         it = m_dht.m_rdp_recv_get.find(desc);
                         if (it == m_dht.m_rdp_recv_get.end()) {
                                 m_dht.m_rdp.close(desc);
+                                return;
                         }
 
                         for (;;) {
@@ -534,8 +665,9 @@ namespace libcage {
                                                 return;
                                         break;
                                 case rdp_recv_get::RGET_VAL:
-                                        read_op(desc, it->second);
-                                        return;
+                                        if (! read_op(desc, it->second))
+                                                return;
+                                        break;
                                 case rdp_recv_get::RGET_END:
                                         m_dht.m_rdp.close(desc);
                                         m_dht.m_rdp_recv_get.erase(desc);
@@ -545,13 +677,16 @@ namespace libcage {
 
                         break;
                 }
+                case WRITABLE:
+                        m_dht.flush_rdp(desc);
+                        break;
                 default:
                         m_dht.m_rdp.close(desc);
                         m_dht.m_rdp_recv_get.erase(desc);
                 }
         }
 
-        void
+        bool
         dht::rdp_recv_get_func::read_op(int desc, rdp_recv_get_ptr rget)
         {
                 for (;;) {
@@ -561,12 +696,12 @@ namespace libcage {
                         m_dht.m_rdp.receive(desc, &op, &size);
 
                         if (size == 0)
-                                return;
+                                return false;
 
                         if (op != dht_get_next) {
                                 m_dht.m_rdp.close(desc);
                                 m_dht.m_rdp_recv_get.erase(desc);
-                                return;
+                                return false;
                         }
 
                         rget->m_time = time(NULL);
@@ -577,17 +712,55 @@ namespace libcage {
 
                         memset(&msg, 0, sizeof(msg));
 
-                        if (rget->m_data.size() == 0) {
+                        if (rget->m_data.size() == 0 && rget->m_is_keep) {
+                                // wait for the next query
+                                msg.flags = dht_flag_keep;
+                                m_dht.m_rdp.send(desc, &msg, sizeof(msg));
+
+                                rget->m_key.reset();
+
+                                rget->m_key_read = 0;
+                                rget->m_state    = rdp_recv_get::RGET_HDR;
+
+                                rget->m_is_accept_compressed = false;
+
+                                return true;
+                        } else if (rget->m_data.size() == 0) {
                                 m_dht.m_rdp.send(desc, &msg, sizeof(msg));
                                 rget->m_state = rdp_recv_get::RGET_END;
                         } else {
                                 data = rget->m_data.front();
                                 rget->m_data.pop();
 
-                                msg.valuelen = htons(data.valuelen);
-                                m_dht.m_rdp.send(desc, &msg, sizeof(msg));
-                                m_dht.m_rdp.send(desc, data.value.get(),
-                                                 data.valuelen);
+                                if (data.is_compressed &&
+                                    ! rget->m_is_accept_compressed &&
+                                    ! m_dht.uncompress_sdata(data)) {
+                                        m_dht.m_rdp.close(desc);
+                                        m_dht.m_rdp_recv_get.erase(desc);
+                                        return false;
+                                }
+
+                                if (data.is_compressed)
+                                        msg.flags |= dht_flag_compressed;
+
+                                if (data.valuelen > 0xffff) {
+                                        msg_dht_rdp_valuelen vlen;
+
+                                        vlen.valuelen = htonl(data.valuelen);
+                                        msg.flags    |= dht_flag_large;
+
+                                        m_dht.m_rdp.send(desc, &msg,
+                                                         sizeof(msg));
+                                        m_dht.m_rdp.send(desc, &vlen,
+                                                         sizeof(vlen));
+                                } else {
+                                        msg.valuelen = htons(data.valuelen);
+                                        m_dht.m_rdp.send(desc, &msg,
+                                                         sizeof(msg));
+                                }
+
+                                m_dht.send_rdp(desc, data.value,
+                                               data.valuelen);
                         }
 
                 }
@@ -625,267 +798,1431 @@ namespace libcage {
                                 continue;
                         }
 
-                        rget->m_data.push(*it3);
-                        ++it3;
+                        rget->m_data.push(*it3);
+                        ++it3;
+                }
+
+                if (it2->second.size() == 0)
+                        it1->second.erase(it2);
+
+                if (it1->second.size() == 0)
+                        m_dht.m_stored.erase(it1);
+        }
+
+        bool
+        dht::rdp_recv_get_func::read_key(int desc, rdp_recv_get_ptr rget)
+        {
+                for (;;) {
+                        int   size = rget->m_keylen - rget->m_key_read;
+                        char *buf  = &rget->m_key[rget->m_key_read];
+                        m_dht.m_rdp.receive(desc, buf, &size);
+
+                        if (size == 0)
+                                return false;
+
+                        rget->m_key_read += size;
+                        if (rget->m_keylen == rget->m_key_read) {
+                                rget->m_state = rdp_recv_get::RGET_VAL;
+                                read_val(rget);
+                                return true;
+                        }
+                }
+
+                return true;
+        }
+
+        bool
+        dht::rdp_recv_get_func::read_hdr(int desc, rdp_recv_get_ptr rget)
+        {
+                msg_dht_rdp_get msg;
+                int size = sizeof(msg);
+
+                m_dht.m_rdp.receive(desc, &msg, &size);
+
+                // the next query on a kept connection
+                if (size == 0 && rget->m_is_keep)
+                        return false;
+
+                if (size != sizeof(msg)) {
+                        m_dht.m_rdp.close(desc);
+                        m_dht.m_rdp_recv_get.erase(desc);
+                        return false;
+                }
+
+                id_ptr id(new uint160_t);
+
+                id->from_binary(msg.id, sizeof(msg.id));
+
+                rget->m_time   = time(NULL);
+                rget->m_state  = rdp_recv_get::RGET_KEY;
+                rget->m_id     = id;
+                rget->m_keylen = ntohs(msg.keylen);
+
+                if (msg.accept & dht_flag_compressed)
+                        rget->m_is_accept_compressed = true;
+
+                if (msg.flags & dht_flag_keep)
+                        rget->m_is_keep = true;
+
+                boost::shared_array<char> key(new char[rget->m_keylen]);
+                rget->m_key = key;
+
+                return true;
+        }
+
+        bool
+        dht::rdp_recv_store_func::read_hdr(int desc,
+                                           dht::rdp_recv_store_func::it_rcvs it)
+        {
+                // read header
+                msg_dht_rdp_store msg;
+                int size = sizeof(msg);
+
+                m_dht.m_rdp.receive(desc, &msg, &size);
+
+                // the next value on a kept connection
+                if (size == 0 && it->second->is_keep)
+                        return false;
+
+                if (size != (int)sizeof(msg)) {
+                        m_dht.m_rdp_recv_store.erase(desc);
+                        m_dht.m_rdp.close(desc);
+                        return false;
+                }
+
+                it->second->keylen   = ntohs(msg.keylen);
+                it->second->valuelen = ntohs(msg.valuelen);
+
+                // the length of a large value follows the header
+                if (msg.flags & dht_flag_large)
+                        it->second->is_len_read = false;
+
+                if (it->second->keylen == 0 ||
+                    (it->second->valuelen == 0 && it->second->is_len_read)) {
+                        m_dht.m_rdp_recv_store.erase(desc);
+                        m_dht.m_rdp.close(desc);
+                        return false;
+                }
+
+                id_ptr id(new uint160_t);
+                id_ptr src(new uint160_t);
+
+                id->from_binary(msg.id, sizeof(msg.id));
+                src->from_binary(msg.from, sizeof(msg.from));
+
+                it->second->ttl         = ntohs(msg.ttl);
+                it->second->id          = id;
+                it->second->src         = src;
+                it->second->last_time   = time(NULL);
+                it->second->is_hdr_read = true;
+
+                boost::shared_array<char> key(new char[it->second->keylen]);
+                it->second->key = key;
+
+                if (msg.flags & dht_flag_unique)
+                        it->second->is_unique = true;
+
+                if (msg.flags & dht_flag_compressed)
+                        it->second->is_compressed = true;
+
+                if (msg.flags & dht_flag_keep)
+                        it->second->is_keep = true;
+
+                return true;
+        }
+
+        bool
+        dht::rdp_recv_store_func::read_len(int desc,
+                                           dht::rdp_recv_store_func::it_rcvs it)
+        {
+                msg_dht_rdp_valuelen msg;
+                int size = sizeof(msg);
+
+                m_dht.m_rdp.receive(desc, &msg, &size);
+
+                if (size == 0)
+                        return false;
+
+                if (size != (int)sizeof(msg)) {
+                        m_dht.m_rdp_recv_store.erase(desc);
+                        m_dht.m_rdp.close(desc);
+                        return false;
+                }
+
+                it->second->valuelen = ntohl(msg.valuelen);
+                if (it->second->valuelen == 0 ||
+                    it->second->valuelen > max_value_len) {
+                        m_dht.m_rdp_recv_store.erase(desc);
+                        m_dht.m_rdp.close(desc);
+                        return false;
+                }
+
+                it->second->last_time   = time(NULL);
+                it->second->is_len_read = true;
+
+                return true;
+        }
+
+        bool
+        dht::rdp_recv_store_func::read_body(int desc,
+                                            dht::rdp_recv_store_func::it_rcvs it)
+        {
+                if (it->second->key_read < it->second->keylen) {
+                        int size  = it->second->keylen - it->second->key_read;
+                        char *buf = &it->second->key[it->second->key_read];
+                        m_dht.m_rdp.receive(desc, buf, &size);
+
+                        if (size == 0)
+                                return false;
+
+                        it->second->key_read  += size;
+                        it->second->last_time  = time(NULL);
+                } else {
+                        rdp_recv_store &rs = *it->second;
+                        std::vector<packetbuf_ptr> bufs;
+                        int size = rs.valuelen - rs.val_read;
+
+                        m_dht.m_rdp.receive(desc, bufs, &size);
+
+                        if (size == 0)
+                                return false;
+
+                        // the buffer grows as the value arrives, within
+                        // rdp_recv_mem_max for all the connections
+                        if (rs.val_read + size > rs.val_cap) {
+                                uint32_t cap;
+
+                                cap = next_value_cap(rs.val_cap,
+                                                     rs.val_read + size,
+                                                     rs.valuelen);
+
+                                if (m_dht.m_rdp_recv_mem + cap - rs.val_cap >
+                                    rdp_recv_mem_max) {
+                                        m_dht.m_rdp_recv_store.erase(desc);
+                                        m_dht.m_rdp.close(desc);
+                                        return false;
+                                }
+
+                                grow_value(rs.value, rs.val_read, cap);
+
+                                m_dht.m_rdp_recv_mem += cap - rs.val_cap;
+                                rs.val_cap = cap;
+                        }
+
+                        BOOST_FOREACH(packetbuf_ptr &pbuf, bufs) {
+                                memcpy(&rs.value[rs.val_read],
+                                       pbuf->get_data(), pbuf->get_len());
+
+                                rs.val_read += pbuf->get_len();
+                        }
+
+                        it->second->last_time  = time(NULL);
+
+                        if (it->second->valuelen == it->second->val_read) {
+                                it->second->store2local();
+
+                                if (it->second->is_keep) {
+                                        uint8_t op = dht_store_done;
+
+                                        m_dht.m_rdp.send(desc, &op,
+                                                         sizeof(op));
+                                        it->second->next();
+
+                                        return true;
+                                }
+
+                                m_dht.m_rdp_recv_store.erase(desc);
+                                m_dht.m_rdp.close(desc);
+
+                                return false;
+                        }
+                }
+
+                return true;
+        }
+
+        void
+        dht::rdp_recv_store_func::operator() (int desc, rdp_addr addr,
+                                              rdp_event event)
+        {
+                switch (event) {
+                case ACCEPTED:
+                {
+                        rdp_recv_store_ptr rs(new rdp_recv_store(&m_dht,
+                                                                 addr.did));
+
+                        m_dht.m_rdp_recv_store[desc] = rs;
+
+                        break;
+                }
+                case READY2READ:
+                {
+                        it_rcvs it;
+                        it = m_dht.m_rdp_recv_store.find(desc);
+
+                        if (it == m_dht.m_rdp_recv_store.end())
+                                return;
+
+                        for (;;) {
+                                if (! it->second->is_hdr_read) {
+                                        if (! read_hdr(desc, it))
+                                                return;
+                                } else if (! it->second->is_len_read) {
+                                        if (! read_len(desc, it))
+                                                return;
+                                } else {
+                                        if (! read_body(desc, it))
+                                                return;
+                                }
+                        }
+
+                        break;
+                }
+                default:
+                        m_dht.m_rdp_recv_store.erase(desc);
+                        m_dht.m_rdp.close(desc);
+                        break;
+                }
+        }
+
+        void
+        dht::rdp_recv_store::next()
+        {
+                p_dht->m_rdp_recv_mem -= val_cap;
+
+                key.reset();
+                value.reset();
+
+                keylen        = 0;
+                valuelen      = 0;
+                key_read      = 0;
+                val_read      = 0;
+                val_cap       = 0;
+                is_hdr_read   = false;
+                is_len_read   = true;
+                is_unique     = false;
+                is_compressed = false;
+                last_time     = time(NULL);
+        }
+
+        void
+        dht::rdp_recv_store::store2local()
+        {
+                stored_data data;
+
+                data.value       = value;
+                data.valuelen    = valuelen;
+                data.key         = key;
+                data.keylen      = keylen;
+                data.ttl         = ttl;
+                data.stored_time = time(NULL);
+                data.id          = id;
+                data.src         = src;
+                data.original    = 0;
+                data.is_unique   = is_unique;
+                data.is_compressed = is_compressed;
+
+                if (ttl == 0) {
+                        p_dht->erase_sdata(data);
+                        return;
+                }
+
+                p_dht->add_sdata(data, false);
+                p_dht->insert2recvd_sdata(data, src);
+        }
+
+        void
+        dht::rdp_store_func::operator() (int desc, rdp_addr addr,
+                                         rdp_event event)
+        {
+                switch (event) {
+                case CONNECTED:
+                        send_store(desc, 0);
+                        break;
+                case RESET:
+                {
+                        stored(addr.did);
+
+                        p_dht->m_rdp_store.erase(desc);
+                        p_dht->m_rdp.close(desc);
+                        break;
+                }
+                case WRITABLE:
+                        p_dht->flush_rdp(desc);
+                        break;
+                default:
+                        p_dht->m_rdp_store.erase(desc);
+                        p_dht->m_rdp.close(desc);
+                        break;
+                }
+        }
+
+        void
+        dht::rdp_store_func::send_store(int desc, uint8_t flags)
+        {
+                // each part is sent by itself, since the receiver
+                // reads segments as a whole. send_rdp() keeps them in
+                // order when the send window is full
+                msg_dht_rdp_store        *msg;
+                boost::shared_array<char> buf(new char[sizeof(*msg)]);
+
+                msg = (msg_dht_rdp_store*)buf.get();
+
+                memset(msg, 0, sizeof(*msg));
+
+                id->to_binary(&msg->id, sizeof(msg->id));
+                from->to_binary(&msg->from, sizeof(msg->from));
+
+                msg->keylen = htons(keylen);
+                msg->ttl    = htons(ttl);
+                msg->flags  = flags;
+
+                if (is_unique)
+                        msg->flags |= dht_flag_unique;
+
+                boost::shared_array<char> sval = value;
+                uint32_t slen = valuelen;
+
+                if (plain) {
+                        sval = plain;
+                        slen = plainlen;
+                } else if (is_compressed) {
+                        msg->flags |= dht_flag_compressed;
+                }
+
+                if (slen > 0xffff) {
+                        msg_dht_rdp_valuelen     *vlen;
+                        boost::shared_array<char> vbuf(new char[sizeof(*vlen)]);
+
+                        vlen = (msg_dht_rdp_valuelen*)vbuf.get();
+
+                        vlen->valuelen = htonl(slen);
+                        msg->flags    |= dht_flag_large;
+
+                        p_dht->send_rdp(desc, buf, sizeof(*msg));
+                        p_dht->send_rdp(desc, vbuf, sizeof(*vlen));
+                } else {
+                        msg->valuelen = htons(slen);
+                        p_dht->send_rdp(desc, buf, sizeof(*msg));
+                }
+
+                p_dht->send_rdp(desc, key, keylen);
+                p_dht->send_rdp(desc, sval, slen);
+        }
+
+        void
+        dht::rdp_store_func::stored(id_ptr dst)
+        {
+                stored_data sdata;
+
+                sdata.value    = value;
+                sdata.valuelen = valuelen;
+                sdata.key      = key;
+                sdata.keylen   = keylen;
+                sdata.id       = id;
+
+                p_dht->insert2recvd_sdata(sdata, dst);
+        }
+
+        void
+        dht::rdp_pool_func::operator() (int desc, rdp_addr addr,
+                                        rdp_event event)
+        {
+                std::map<int, rdp_pool_ptr>::iterator it;
+
+                it = m_dht.m_rdp_pool_desc.find(desc);
+                if (it == m_dht.m_rdp_pool_desc.end()) {
+                        m_dht.m_rdp.close(desc);
+                        return;
+                }
+
+                rdp_pool_ptr pool = it->second;
+
+                switch (event) {
+                case CONNECTED:
+                        pool->is_connected = true;
+                        m_dht.send_pool(pool);
+                        break;
+                case READY2READ:
+                        read_acks(desc, pool);
+                        break;
+                case WRITABLE:
+                        m_dht.flush_rdp(desc);
+                        break;
+                case RESET:
+                {
+                        // a peer which does not understand dht_flag_keep
+                        // resets the connection after storing a value
+                        if (! pool->is_keep && ! pool->sent.empty()) {
+                                pool->sent.front().stored(pool->dst);
+                                pool->sent.pop_front();
+                        }
+
+                        m_dht.close_pool(pool);
+
+                        // the rest is stored by a connection for each
+                        BOOST_FOREACH(rdp_store_func &func, pool->sent) {
+                                m_dht.connect_store(func, pool->dst);
+                        }
+
+                        BOOST_FOREACH(rdp_store_func &func, pool->queued) {
+                                m_dht.connect_store(func, pool->dst);
+                        }
+
+                        break;
+                }
+                default:
+                        m_dht.close_pool(pool);
+                }
+        }
+
+        void
+        dht::rdp_pool_func::read_acks(int desc, rdp_pool_ptr pool)
+        {
+                for (;;) {
+                        uint8_t op;
+                        int     size = sizeof(op);
+
+                        m_dht.m_rdp.receive(desc, &op, &size);
+
+                        if (size == 0)
+                                break;
+
+                        if (op != dht_store_done || pool->sent.empty()) {
+                                m_dht.close_pool(pool);
+                                return;
+                        }
+
+                        pool->sent.front().stored(pool->dst);
+                        pool->sent.pop_front();
+
+                        pool->is_keep   = true;
+                        pool->last_time = time(NULL);
+                }
+
+                m_dht.send_pool(pool);
+        }
+
+        static uint64_t
+        fnv1a(uint64_t h, const void *buf, int len)
+        {
+                const uint8_t *p = (const uint8_t*)buf;
+
+                for (int i = 0; i < len; i++) {
+                        h ^= p[i];
+                        h *= 1099511628211ULL;
+                }
+
+                return h;
+        }
+
+        uint64_t
+        dht::get_digest(const stored_data &sdata)
+        {
+                // the digest must be same on every node,
+                // so boost::hash cannot be used here
+                uint8_t  src[CAGE_ID_LEN];
+                uint8_t  flags = 0;
+                uint32_t keylen, valuelen;
+                uint64_t h = 14695981039346656037ULL;
+
+                keylen   = htonl(sdata.keylen);
+                valuelen = htonl(sdata.valuelen);
+
+                if (sdata.is_unique)
+                        flags |= dht_flag_unique;
+
+                if (sdata.is_compressed)
+                        flags |= dht_flag_compressed;
+
+                sdata.src->to_binary(src, sizeof(src));
+
+                h = fnv1a(h, &keylen, sizeof(keylen));
+                h = fnv1a(h, sdata.key.get(), sdata.keylen);
+                h = fnv1a(h, &valuelen, sizeof(valuelen));
+                h = fnv1a(h, sdata.value.get(), sdata.valuelen);
+                h = fnv1a(h, src, sizeof(src));
+                h = fnv1a(h, &flags, sizeof(flags));
+
+                return h;
+        }
+
+        void
+        dht::get_digests(id_ptr id, boost::unordered_set<uint64_t> &digests)
+        {
+                boost::unordered_map<_id, sdata_map>::iterator it1;
+                sdata_map::iterator it2;
+                sdata_set::iterator it3;
+                _id i;
+
+                i.id = id;
+
+                it1 = m_stored.find(i);
+                if (it1 == m_stored.end())
+                        return;
+
+                time_t now = time(NULL);
+                for (it2 = it1->second.begin(); it2 != it1->second.end();
+                     ++it2) {
+                        for (it3 = it2->second.begin();
+                             it3 != it2->second.end(); ++it3) {
+                                time_t diff = now - it3->stored_time;
+                                if (diff > it3->ttl)
+                                        continue;
+
+                                digests.insert(get_digest(*it3));
+                        }
+                }
+        }
+
+        void
+        dht::push_sdata(stored_data &sdata, id_ptr dst)
+        {
+                rdp_store_func func;
+                time_t         diff;
+
+                diff = time(NULL) - sdata.stored_time;
+                if (diff >= sdata.ttl)
+                        return;
+
+                func.key       = sdata.key;
+                func.value     = sdata.value;
+                func.keylen    = sdata.keylen;
+                func.valuelen  = sdata.valuelen;
+                func.ttl       = sdata.ttl - diff;
+                func.id        = sdata.id;
+                func.from      = sdata.src;
+                func.is_unique = sdata.is_unique;
+                func.p_dht     = this;
+
+                func.is_compressed = sdata.is_compressed;
+
+                store_rdp(func, dst);
+        }
+
+        void
+        dht::store_rdp(rdp_store_func &func, id_ptr dst)
+        {
+                std::map<_id, rdp_pool_ptr>::iterator it;
+                rdp_pool_ptr pool;
+                _id i;
+
+                i.id = dst;
+
+                it = m_rdp_pool.find(i);
+                if (it == m_rdp_pool.end()) {
+                        rdp_pool_func pfunc(*this);
+                        int desc;
+
+                        desc = m_rdp.connect(0, dst, rdp_store_port, pfunc);
+                        if (desc <= 0)
+                                return;
+
+                        pool = rdp_pool_ptr(new rdp_pool);
+
+                        pool->desc = desc;
+                        pool->dst  = dst;
+
+                        m_rdp_pool[i]         = pool;
+                        m_rdp_pool_desc[desc] = pool;
+                } else {
+                        pool = it->second;
+                }
+
+                pool->queued.push_back(func);
+
+                rdp_store_func &queued = pool->queued.back();
+
+                if (queued.is_compressed && ! is_accept_compressed(dst)) {
+                        stored_data sdata;
+
+                        sdata.value         = queued.value;
+                        sdata.valuelen      = queued.valuelen;
+                        sdata.is_compressed = true;
+
+                        if (! uncompress_sdata(sdata)) {
+                                pool->queued.pop_back();
+                                return;
+                        }
+
+                        queued.plain    = sdata.value;
+                        queued.plainlen = sdata.valuelen;
+                }
+
+                send_pool(pool);
+        }
+
+        void
+        dht::connect_store(rdp_store_func &func, id_ptr dst)
+        {
+                int desc;
+
+                desc = m_rdp.connect(0, dst, rdp_store_port, func);
+                if (desc <= 0)
+                        return;
+
+                m_rdp_store[desc] = time(NULL);
+        }
+
+        void
+        dht::send_pool(rdp_pool_ptr pool)
+        {
+                if (! pool->is_connected)
+                        return;
+
+                while (! pool->queued.empty()) {
+                        // wait for the first acknowledgement, since the
+                        // peer may close the connection after a value
+                        if (! pool->is_keep && ! pool->sent.empty())
+                                return;
+
+                        rdp_store_func &func = pool->queued.front();
+
+                        func.send_store(pool->desc, dht_flag_keep);
+
+                        pool->sent.push_back(func);
+                        pool->queued.pop_front();
+                        pool->last_time = time(NULL);
+                }
+        }
+
+        void
+        dht::close_pool(rdp_pool_ptr pool)
+        {
+                _id i;
+
+                i.id = pool->dst;
+
+                m_rdp.close(pool->desc);
+                m_rdp_pool.erase(i);
+                m_rdp_pool_desc.erase(pool->desc);
+        }
+
+        void
+        dht::get_rdp(query_ptr q, id_ptr dst)
+        {
+                std::map<_id, rdp_get_pool_ptr>::iterator it;
+                rdp_get_pool_ptr pool;
+                _id i;
+
+                i.id = dst;
+
+                q->is_rdp_con = true;
+                q->rdp_time   = time(NULL);
+
+                it = m_rdp_get_pool.find(i);
+                if (it == m_rdp_get_pool.end()) {
+                        rdp_get_func func(*this);
+                        int desc;
+
+                        desc = m_rdp.connect(0, dst, rdp_get_port, func);
+                        if (desc <= 0) {
+                                next_get(q);
+                                return;
+                        }
+
+                        pool = rdp_get_pool_ptr(new rdp_get_pool);
+
+                        pool->desc = desc;
+                        pool->dst  = dst;
+
+                        m_rdp_get_pool[i]         = pool;
+                        m_rdp_get_pool_desc[desc] = pool;
+                } else {
+                        pool = it->second;
+                }
+
+                pool->queued.push_back(q);
+
+                send_get(pool);
+        }
+
+        void
+        dht::send_get(rdp_get_pool_ptr pool)
+        {
+                if (! pool->is_connected || pool->current)
+                        return;
+
+                while (! pool->queued.empty()) {
+                        std::map<uint32_t, query_ptr>::iterator it;
+                        query_ptr q = pool->queued.front();
+
+                        pool->queued.pop_front();
+
+                        // finished while it was queued
+                        it = m_query.find(q->nonce);
+                        if (it == m_query.end() || it->second != q)
+                                continue;
+
+                        pool->current   = q;
+                        pool->last_time = time(NULL);
+
+                        q->rdp_time  = time(NULL);
+                        q->rdp_state = query::QUERY_HDR;
+
+                        msg_dht_rdp_get get;
+
+                        memset(&get, 0, sizeof(get));
+                        q->dst->to_binary(get.id, sizeof(get.id));
+                        get.keylen = htons(q->keylen);
+                        get.flags  = dht_flag_keep;
+
+                        if (! q->is_chunk)
+                                get.accept = dht_flag_compressed;
+
+                        m_rdp.send(pool->desc, &get, sizeof(get));
+                        m_rdp.send(pool->desc, q->key.get(), q->keylen);
+
+                        uint8_t op = dht_get_next;
+                        m_rdp.send(pool->desc, &op, sizeof(op));
+
+                        return;
+                }
+        }
+
+        void
+        dht::close_get_pool(rdp_get_pool_ptr pool, bool is_retry)
+        {
+                // the queued queries are got by a new connection when
+                // the peer closed it after a query, or from the next
+                // node otherwise
+                std::deque<query_ptr> queued;
+                query_ptr q = pool->current;
+                _id i;
+
+                i.id = pool->dst;
+
+                m_rdp.close(pool->desc);
+                m_rdp_get_pool.erase(i);
+                m_rdp_get_pool_desc.erase(pool->desc);
+
+                queued.swap(pool->queued);
+                pool->current.reset();
+
+                if (q)
+                        next_get(q);
+
+                BOOST_FOREACH(query_ptr &qq, queued) {
+                        if (is_retry)
+                                get_rdp(qq, pool->dst);
+                        else
+                                next_get(qq);
+                }
+        }
+
+        void
+        dht::next_get(query_ptr q)
+        {
+                std::map<uint32_t, query_ptr>::iterator it;
+
+                it = m_query.find(q->nonce);
+                if (it == m_query.end() || it->second != q)
+                        return;
+
+                if (q->vset->size() > 0 || q->num_streamed > 0) {
+                        recvd_value(q);
+                        return;
+                }
+
+                if (q->ids.size() > 0) {
+                        id_ptr id = q->ids.front();
+
+                        q->ids.pop();
+                        get_rdp(q, id);
+                } else {
+                        q->is_rdp_con = false;
+                        send_find(q);
+                }
+        }
+
+        bool
+        dht::uncompress_sdata(stored_data &sdata)
+        {
+                boost::shared_array<char> plain;
+                uint32_t plainlen;
+
+                if (! uncompress_value(sdata.value.get(), sdata.valuelen,
+                                       plain, plainlen, max_value_len))
+                        return false;
+
+                sdata.value         = plain;
+                sdata.valuelen      = plainlen;
+                sdata.is_compressed = false;
+
+                return true;
+        }
+
+        void
+        dht::set_accept_compressed(id_ptr id, uint8_t accept)
+        {
+                _id i;
+
+                i.id = id;
+
+                if (accept & dht_flag_compressed)
+                        m_compress_nodes[i] = time(NULL);
+                else
+                        m_compress_nodes.erase(i);
+        }
+
+        bool
+        dht::is_accept_compressed(id_ptr id)
+        {
+                // older nodes take dht_flag_compressed for padding and
+                // would serve the compressed bytes as the value
+                _id i;
+
+                i.id = id;
+
+                return m_compress_nodes.find(i) != m_compress_nodes.end();
+        }
+
+        int
+        dht::plain_store(const msg_dht_store *msg, char *buf, int buflen)
+        {
+                // rewrite a store of a compressed value
+                // for a node which does not accept it
+                boost::shared_array<char> plain;
+                msg_dht_store *pmsg;
+                const char    *p_value;
+                uint32_t plainlen;
+                uint16_t keylen, valuelen;
+                int      size;
+
+                keylen   = ntohs(msg->keylen);
+                valuelen = ntohs(msg->valuelen);
+                p_value  = (const char*)msg->data + keylen;
+
+                if (! uncompress_value(p_value, valuelen, plain, plainlen,
+                                       max_value_len))
+                        return 0;
+
+                size = sizeof(*msg) - sizeof(msg->data) + keylen + plainlen;
+
+                if (plainlen > 0xffff || size > buflen)
+                        return 0;
+
+                pmsg = (msg_dht_store*)buf;
+
+                memcpy(pmsg, msg, sizeof(*msg) - sizeof(msg->data) + keylen);
+                memcpy((char*)pmsg->data + keylen, plain.get(), plainlen);
+
+                pmsg->valuelen = htons(plainlen);
+                pmsg->flags   &= ~dht_flag_compressed;
+
+                return size;
+        }
+
+        uint32_t
+        dht::next_value_cap(uint32_t cap, uint32_t need, uint32_t total)
+        {
+                // doubled, so that the memory follows what was received
+                // rather than the length the peer claims
+                uint32_t size = cap * 2;
+
+                if (size < value_chunk)
+                        size = value_chunk;
+
+                if (size < need)
+                        size = need;
+
+                if (size > total)
+                        size = total;
+
+                return size;
+        }
+
+        void
+        dht::grow_value(boost::shared_array<char> &buf, uint32_t len,
+                        uint32_t cap)
+        {
+                boost::shared_array<char> p(new char[cap]);
+
+                if (len > 0)
+                        memcpy(p.get(), buf.get(), len);
+
+                buf = p;
+        }
+
+        void
+        dht::sync_replica(rdp_sync_ptr sync)
+        {
+                rdp_sync_func func(*this, sync);
+                int desc;
+
+                desc = m_rdp.connect(0, sync->m_dst, rdp_sync_port, func);
+                if (desc <= 0)
+                        return;
+
+                m_rdp_sync[desc] = sync;
+        }
+
+        void
+        dht::send_rdp(int desc, boost::shared_array<char> buf, uint32_t len)
+        {
+                rdp_sending sending;
+
+                sending.buf  = buf;
+                sending.len  = len;
+                sending.sent = 0;
+
+                // keep the order behind buffers which wait for WRITABLE
+                if (m_rdp_sending.find(desc) == m_rdp_sending.end()) {
+                        int size;
+
+                        size = m_rdp.send(desc, buf.get(), len);
+                        if (size < 0 || (uint32_t)size == len)
+                                return;
+
+                        sending.sent = size;
+                }
+
+                // the rest is sent when RDP signals WRITABLE
+                m_rdp_sending[desc].push_back(sending);
+        }
+
+        void
+        dht::flush_rdp(int desc)
+        {
+                std::map<int, std::deque<rdp_sending> >::iterator it;
+
+                it = m_rdp_sending.find(desc);
+                if (it == m_rdp_sending.end())
+                        return;
+
+                while (! it->second.empty()) {
+                        rdp_sending &sending = it->second.front();
+                        int size;
+
+                        size = m_rdp.send(desc, &sending.buf[sending.sent],
+                                          sending.len - sending.sent);
+
+                        if (size < 0) {
+                                // closed
+                                m_rdp_sending.erase(it);
+                                return;
+                        }
+
+                        sending.sent += size;
+
+                        if (sending.sent < sending.len)
+                                return;
+
+                        it->second.pop_front();
+                }
+
+                m_rdp_sending.erase(it);
+        }
+
+        void
+        dht::rdp_sync::send_digest(int desc)
+        {
+                std::vector<stored_data>::iterator it;
+                msg_dht_rdp_sync_bucket *bucket = NULL;
+                msg_dht_rdp_sync *msg;
+                uint32_t *digest = NULL;
+                uint16_t  n      = 0;
+                uint32_t  num    = 0;
+                int       hlen   = sizeof(*bucket) - sizeof(bucket->digest);
+                int       len    = 0;
+                char     *p;
+                id_ptr    prev;
+
+                // consecutive entries which have the same ID form a bucket
+                for (it = m_data.begin(); it != m_data.end(); ++it) {
+                        if (! prev || *prev != *it->id) {
+                                prev = it->id;
+                                len += hlen;
+                                num++;
+                        }
+                        len += sizeof(uint32_t) * 2;
+                }
+
+                boost::shared_array<char> buf(new char[len]);
+
+                p = buf.get();
+                prev.reset();
+                for (it = m_data.begin(); it != m_data.end(); ++it) {
+                        if (! prev || *prev != *it->id) {
+                                if (bucket != NULL)
+                                        bucket->num = htons(n);
+
+                                bucket = (msg_dht_rdp_sync_bucket*)p;
+                                digest = bucket->digest;
+                                prev   = it->id;
+                                n      = 0;
+                                p     += hlen;
+
+                                memset(bucket, 0, hlen);
+                                it->id->to_binary(bucket->id,
+                                                  sizeof(bucket->id));
+                        }
+
+                        uint64_t d = get_digest(*it);
+
+                        digest[0] = htonl((uint32_t)(d >> 32));
+                        digest[1] = htonl((uint32_t)(d & 0xffffffff));
+
+                        digest += 2;
+                        p      += sizeof(uint32_t) * 2;
+                        n++;
+                }
+
+                if (bucket != NULL)
+                        bucket->num = htons(n);
+
+                // the header is sent by itself, since the receiver reads
+                // it as a segment. send_rdp() sends the rest of the digest
+                // when the send window is full
+                boost::shared_array<char> hbuf(new char[sizeof(*msg)]);
+
+                msg = (msg_dht_rdp_sync*)hbuf.get();
+                msg->len = htonl(len);
+                msg->num = htonl(num);
+
+                m_dht.send_rdp(desc, hbuf, sizeof(*msg));
+                m_dht.send_rdp(desc, buf, len);
+        }
+
+        void
+        dht::rdp_sync::push_lacking()
+        {
+                std::vector<bool> lacking(m_data.size(), false);
+
+                for (uint32_t i = 0; i < m_num; i++) {
+                        uint32_t idx = ntohl(m_idx[i]);
+                        if (idx < m_data.size())
+                                lacking[idx] = true;
+                }
+
+                for (uint32_t i = 0; i < m_data.size(); i++) {
+                        if (lacking[i]) {
+                                m_dht.push_sdata(m_data[i], m_dst);
+                        } else {
+                                m_dht.insert2recvd_sdata(m_data[i], m_dst);
+                        }
+                }
+
+                m_state = SYNC_END;
+        }
+
+        void
+        dht::rdp_sync::push_all()
+        {
+                // the neighbor does not answer digests,
+                // store the entries as before
+                std::vector<stored_data>::iterator it;
+                _id i;
+
+                i.id = m_dst;
+
+                for (it = m_data.begin(); it != m_data.end(); ++it) {
+                        if (it->recvd.find(i) != it->recvd.end())
+                                continue;
+
+                        m_dht.push_sdata(*it, m_dst);
+                }
+
+                m_state = SYNC_END;
+        }
+
+        void
+        dht::rdp_sync_func::close_rdp(int desc)
+        {
+                if (m_sync->m_state != rdp_sync::SYNC_END)
+                        m_sync->push_all();
+
+                m_dht.m_rdp_sync.erase(desc);
+                m_dht.m_rdp.close(desc);
+        }
+
+        bool
+        dht::rdp_sync_func::read_hdr(int desc)
+        {
+                msg_dht_rdp_sync_reply msg;
+                int size = sizeof(msg);
+
+                m_dht.m_rdp.receive(desc, &msg, &size);
+
+                if (size == 0)
+                        return false;
+
+                if (size != sizeof(msg)) {
+                        close_rdp(desc);
+                        return false;
+                }
+
+                m_sync->m_time = time(NULL);
+                m_sync->m_num  = ntohl(msg.num);
+                m_sync->m_read = 0;
+
+                if (m_sync->m_num > m_sync->m_data.size()) {
+                        close_rdp(desc);
+                        return false;
+                }
+
+                if (m_sync->m_num == 0) {
+                        m_sync->push_lacking();
+                        close_rdp(desc);
+                        return false;
                 }
 
-                if (it2->second.size() == 0)
-                        it1->second.erase(it2);
+                boost::shared_array<uint32_t> idx(new uint32_t[m_sync->m_num]);
+                m_sync->m_idx   = idx;
+                m_sync->m_state = rdp_sync::SYNC_IDX;
 
-                if (it1->second.size() == 0)
-                        m_dht.m_stored.erase(it1);
+                return true;
         }
 
         bool
-        dht::rdp_recv_get_func::read_key(int desc, rdp_recv_get_ptr rget)
+        dht::rdp_sync_func::read_idx(int desc)
         {
-                for (;;) {
-                        int   size = rget->m_keylen - rget->m_key_read;
-                        char *buf  = &rget->m_key[rget->m_key_read];
-                        m_dht.m_rdp.receive(desc, buf, &size);
+                int   len  = m_sync->m_num * sizeof(uint32_t);
+                int   size = len - m_sync->m_read;
+                char *buf  = (char*)m_sync->m_idx.get() + m_sync->m_read;
 
-                        if (size == 0)
-                                return false;
+                m_dht.m_rdp.receive(desc, buf, &size);
 
-                        rget->m_key_read += size;
-                        if (rget->m_keylen == rget->m_key_read) {
-                                rget->m_state = rdp_recv_get::RGET_VAL;
-                                read_val(rget);
-                                return true;
-                        }
+                if (size == 0)
+                        return false;
+
+                m_sync->m_read += size;
+                m_sync->m_time  = time(NULL);
+
+                if ((int)m_sync->m_read == len) {
+                        m_sync->push_lacking();
+                        close_rdp(desc);
+                        return false;
                 }
 
                 return true;
         }
 
+        void
+        dht::rdp_sync_func::operator() (int desc, rdp_addr addr,
+                                        rdp_event event)
+        {
+                switch (event) {
+                case CONNECTED:
+                        m_sync->m_time = time(NULL);
+                        m_sync->send_digest(desc);
+                        break;
+                case READY2READ:
+                        for (;;) {
+                                switch (m_sync->m_state) {
+                                case rdp_sync::SYNC_HDR:
+                                        if (! read_hdr(desc))
+                                                return;
+                                        break;
+                                case rdp_sync::SYNC_IDX:
+                                        if (! read_idx(desc))
+                                                return;
+                                        break;
+                                case rdp_sync::SYNC_END:
+                                        return;
+                                }
+                        }
+                        break;
+                case WRITABLE:
+                        m_sync->m_time = time(NULL);
+                        m_dht.flush_rdp(desc);
+                        break;
+                default:
+                        close_rdp(desc);
+                }
+        }
+
+        void
+        dht::rdp_recv_sync_func::close_rdp(int desc)
+        {
+                m_dht.m_rdp_recv_sync.erase(desc);
+                m_dht.m_rdp.close(desc);
+        }
+
         bool
-        dht::rdp_recv_get_func::read_hdr(int desc, rdp_recv_get_ptr rget)
+        dht::rdp_recv_sync_func::read_hdr(int desc, rdp_recv_sync_ptr rsync)
         {
-                msg_dht_rdp_get msg;
+                msg_dht_rdp_sync msg;
                 int size = sizeof(msg);
+                int hlen = sizeof(msg_dht_rdp_sync_bucket) - sizeof(uint32_t);
+                int dlen = sizeof(uint32_t) * 2;
 
                 m_dht.m_rdp.receive(desc, &msg, &size);
 
+                if (size == 0)
+                        return false;
+
                 if (size != sizeof(msg)) {
-                        m_dht.m_rdp.close(desc);
-                        m_dht.m_rdp_recv_get.erase(desc);
+                        close_rdp(desc);
                         return false;
                 }
 
-                id_ptr id(new uint160_t);
-
-                id->from_binary(msg.id, sizeof(msg.id));
+                rsync->m_time = time(NULL);
+                rsync->m_len  = ntohl(msg.len);
+                rsync->m_num  = ntohl(msg.num);
+                rsync->m_read = 0;
 
-                rget->m_time   = time(NULL);
-                rget->m_state  = rdp_recv_get::RGET_KEY;
-                rget->m_id     = id;
-                rget->m_keylen = ntohs(msg.keylen);
+                if (rsync->m_len == 0 || rsync->m_num == 0 ||
+                    rsync->m_len > (uint32_t)sync_max_entries * (hlen + dlen)) {
+                        close_rdp(desc);
+                        return false;
+                }
 
-                boost::shared_array<char> key(new char[rget->m_keylen]);
-                rget->m_key = key;
+                boost::shared_array<char> buf(new char[rsync->m_len]);
+                rsync->m_buf   = buf;
+                rsync->m_state = rdp_recv_sync::RSYNC_BODY;
 
                 return true;
         }
 
         bool
-        dht::rdp_recv_store_func::read_hdr(int desc,
-                                           dht::rdp_recv_store_func::it_rcvs it)
+        dht::rdp_recv_sync_func::read_body(int desc, rdp_recv_sync_ptr rsync)
         {
-                // read header
-                msg_dht_rdp_store msg;
-                int size = sizeof(msg);
+                int   size = rsync->m_len - rsync->m_read;
+                char *buf  = &rsync->m_buf[rsync->m_read];
 
-                m_dht.m_rdp.receive(desc, &msg, &size);
-                if (size != (int)sizeof(msg)) {
-                        m_dht.m_rdp_recv_store.erase(desc);
-                        m_dht.m_rdp.close(desc);
-                        return -1;
-                }
+                m_dht.m_rdp.receive(desc, buf, &size);
 
-                it->second->keylen   = ntohs(msg.keylen);
-                it->second->valuelen = ntohs(msg.valuelen);
-                if (it->second->keylen == 0 ||
-                    it->second->valuelen == 0) {
-                        m_dht.m_rdp_recv_store.erase(desc);
-                        m_dht.m_rdp.close(desc);
+                if (size == 0)
                         return false;
-                }
-
-                id_ptr id(new uint160_t);
-                id_ptr src(new uint160_t);
-
-                id->from_binary(msg.id, sizeof(msg.id));
-                src->from_binary(msg.from, sizeof(msg.from));
 
-                it->second->ttl         = ntohs(msg.ttl);
-                it->second->id          = id;
-                it->second->src         = src;
-                it->second->last_time   = time(NULL);
-                it->second->is_hdr_read = true;
+                rsync->m_read += size;
+                rsync->m_time  = time(NULL);
 
-                boost::shared_array<char> key(new char[it->second->keylen]);
-                boost::shared_array<char> val(new char[it->second->valuelen]);
-                it->second->key   = key;
-                it->second->value = val;
+                if (rsync->m_read == rsync->m_len) {
+                        if (! reply(desc, rsync)) {
+                                close_rdp(desc);
+                                return false;
+                        }
 
-                if (msg.flags & dht_flag_unique)
-                        it->second->is_unique = true;
+                        // wait for the peer to close
+                        rsync->m_state = rdp_recv_sync::RSYNC_END;
+                        rsync->m_buf.reset();
+                }
 
                 return true;
         }
 
         bool
-        dht::rdp_recv_store_func::read_body(int desc,
-                                            dht::rdp_recv_store_func::it_rcvs it)
+        dht::rdp_recv_sync_func::reply(int desc, rdp_recv_sync_ptr rsync)
         {
-                if (it->second->key_read < it->second->keylen) {
-                        int size  = it->second->keylen - it->second->key_read;
-                        char *buf = &it->second->key[it->second->key_read];
-                        m_dht.m_rdp.receive(desc, buf, &size);
-
-                        if (size == 0)
+                msg_dht_rdp_sync_bucket *bucket;
+                msg_dht_rdp_sync_reply  *msg;
+                std::vector<uint32_t>    lacking;
+                uint32_t idx  = 0;
+                int      hlen = sizeof(*bucket) - sizeof(bucket->digest);
+                char    *p    = rsync->m_buf.get();
+                char    *end  = p + rsync->m_len;
+
+                for (uint32_t i = 0; i < rsync->m_num; i++) {
+                        if (p + hlen > end)
                                 return false;
 
-                        it->second->key_read  += size;
-                        it->second->last_time  = time(NULL);
-                } else {
-                        int size  = it->second->valuelen - it->second->val_read;
-                        char *buf = &it->second->value[it->second->val_read];
-                        m_dht.m_rdp.receive(desc, buf, &size);
+                        bucket = (msg_dht_rdp_sync_bucket*)p;
 
-                        if (size == 0)
+                        int n = ntohs(bucket->num);
+
+                        p += hlen;
+                        if (p + n * sizeof(uint32_t) * 2 > end)
                                 return false;
 
-                        it->second->val_read  += size;
-                        it->second->last_time  = time(NULL);
 
-                        if (it->second->valuelen == it->second->val_read) {
-                                it->second->store2local();
+                        boost::unordered_set<uint64_t> digests;
+                        id_ptr id(new uint160_t);
+                        uint32_t *digest = (uint32_t*)p;
 
-                                m_dht.m_rdp_recv_store.erase(desc);
-                                m_dht.m_rdp.close(desc);
+                        id->from_binary(bucket->id, sizeof(bucket->id));
+                        m_dht.get_digests(id, digests);
 
-                                return false;
+                        for (int j = 0; j < n; j++) {
+                                uint64_t d;
+
+                                d  = (uint64_t)ntohl(digest[0]) << 32;
+                                d |= ntohl(digest[1]);
+
+                                if (digests.find(d) == digests.end())
+                                        lacking.push_back(htonl(idx));
+
+                                digest += 2;
+                                idx++;
                         }
+
+                        p += n * sizeof(uint32_t) * 2;
+                }
+
+                boost::shared_array<char> hbuf(new char[sizeof(*msg)]);
+
+                msg = (msg_dht_rdp_sync_reply*)hbuf.get();
+                msg->num = htonl(lacking.size());
+
+                m_dht.send_rdp(desc, hbuf, sizeof(*msg));
+
+                if (lacking.size() > 0) {
+                        uint32_t len = lacking.size() * sizeof(uint32_t);
+                        boost::shared_array<char> buf(new char[len]);
+
+                        memcpy(buf.get(), &lacking[0], len);
+                        m_dht.send_rdp(desc, buf, len);
                 }
 
                 return true;
         }
 
         void
-        dht::rdp_recv_store_func::operator() (int desc, rdp_addr addr,
-                                              rdp_event event)
+        dht::rdp_recv_sync_func::operator() (int desc, rdp_addr addr,
+                                             rdp_event event)
         {
                 switch (event) {
                 case ACCEPTED:
                 {
-                        rdp_recv_store_ptr rs(new rdp_recv_store(&m_dht,
-                                                                 addr.did));
+                        rdp_recv_sync_ptr rsync(new rdp_recv_sync(m_dht));
 
-                        m_dht.m_rdp_recv_store[desc] = rs;
+                        m_dht.m_rdp_recv_sync[desc] = rsync;
 
                         break;
                 }
                 case READY2READ:
                 {
-                        it_rcvs it;
-                        it = m_dht.m_rdp_recv_store.find(desc);
+                        std::map<int, rdp_recv_sync_ptr>::iterator it;
 
-                        if (it == m_dht.m_rdp_recv_store.end())
+                        it = m_dht.m_rdp_recv_sync.find(desc);
+                        if (it == m_dht.m_rdp_recv_sync.end()) {
+                                m_dht.m_rdp.close(desc);
                                 return;
+                        }
+
+                        rdp_recv_sync_ptr rsync = it->second;
 
                         for (;;) {
-                                if (it->second->is_hdr_read) {
-                                        if (! read_body(desc, it))
+                                switch (rsync->m_state) {
+                                case rdp_recv_sync::RSYNC_HDR:
+                                        if (! read_hdr(desc, rsync))
                                                 return;
-                                } else {
-                                        if (! read_hdr(desc, it))
+                                        break;
+                                case rdp_recv_sync::RSYNC_BODY:
+                                        if (! read_body(desc, rsync))
                                                 return;
+                                        break;
+                                case rdp_recv_sync::RSYNC_END:
+                                        return;
                                 }
                         }
 
                         break;
                 }
-                default:
-                        m_dht.m_rdp_recv_store.erase(desc);
-                        m_dht.m_rdp.close(desc);
-                        break;
-                }
-        }
-
-        void
-        dht::rdp_recv_store::store2local()
-        {
-                stored_data data;
-
-                data.value       = value;
-                data.valuelen    = valuelen;
-                data.key         = key;
-                data.keylen      = keylen;
-                data.ttl         = ttl;
-                data.stored_time = time(NULL);
-                data.id          = id;
-                data.src         = src;
-                data.original    = 0;
-                data.is_unique   = is_unique;
-
-                if (ttl == 0) {
-                        p_dht->erase_sdata(data);
-                        return;
-                }
-
-                p_dht->add_sdata(data, false);
-                p_dht->insert2recvd_sdata(data, src);
-        }
-
-        void
-        dht::rdp_store_func::operator() (int desc, rdp_addr addr,
-                                         rdp_event event)
-        {
-                switch (event) {
-                case CONNECTED:
-                {
-                        msg_dht_rdp_store msg;
-
-                        memset(&msg, 0, sizeof(msg));
-
-                        id->to_binary(&msg.id, sizeof(msg.id));
-                        from->to_binary(&msg.from, sizeof(msg.from));
-
-                        msg.keylen   = ntohs(keylen);
-                        msg.valuelen = ntohs(valuelen);
-                        msg.ttl      = ntohs(ttl);
-
-                        if (is_unique)
-                                msg.flags |= dht_flag_unique;
-
-                        p_dht->m_rdp.send(desc, &msg, sizeof(msg));
-                        p_dht->m_rdp.send(desc, key.get(), keylen);
-                        p_dht->m_rdp.send(desc, value.get(), valuelen);
-
-                        uint160_t dist;
-                        dist = *id ^ *addr.did;
-                        break;
-                }
-                case RESET:
+                case WRITABLE:
                 {
-                        stored_data sdata;
+                        std::map<int, rdp_recv_sync_ptr>::iterator it;
 
-                        sdata.value    = value;
-                        sdata.valuelen = valuelen;
-                        sdata.key      = key;
-                        sdata.keylen   = keylen;
-                        sdata.id       = id;
+                        it = m_dht.m_rdp_recv_sync.find(desc);
+                        if (it != m_dht.m_rdp_recv_sync.end())
+                                it->second->m_time = time(NULL);
 
-                        p_dht->insert2recvd_sdata(sdata, addr.did);
-                        p_dht->m_rdp_store.erase(desc);
-                        p_dht->m_rdp.close(desc);
+                        m_dht.flush_rdp(desc);
                         break;
                 }
                 default:
-                        p_dht->m_rdp_store.erase(desc);
-                        p_dht->m_rdp.close(desc);
-                        break;
+                        close_rdp(desc);
                 }
         }
 
@@ -902,28 +2239,29 @@ namespace libcage {
         void
         dht::send_ping(cageaddr &dst, uint32_t nonce)
         {
-                try {
-                        if (m_is_dtun) {
-                                node_state state = m_nat.get_state();
-                                if (state == node_symmetric ||
-                                    state == node_undefined ||
-                                    state == node_nat)
-                                        return;
+                if (m_is_dtun) {
+                        node_state state = m_nat.get_state();
+                        cageaddr   addr;
 
-                                m_peers.get_addr(dst.id);
-                        }
+                        if (state == node_symmetric ||
+                            state == node_undefined ||
+                            state == node_nat)
+                                return;
 
-                        send_ping_tmpl<msg_dht_ping>(dst, nonce, type_dht_ping,
-                                                     m_id, m_udp);
-                } catch (std::out_of_range) {
-                        ping_func func;
+                        if (! m_peers.find_addr(dst.id, addr)) {
+                                ping_func func;
 
-                        func.dst   = dst;
-                        func.nonce = nonce;
-                        func.p_dht = this;
+                                func.dst   = dst;
+                                func.nonce = nonce;
+                                func.p_dht = this;
 
-                        m_dtun.request(*dst.id, func);
+                                m_dtun.request(*dst.id, func);
+                                return;
+                        }
                 }
+
+                send_ping_tmpl<msg_dht_ping>(dst, nonce, type_dht_ping,
+                                             m_id, m_udp);
         }
 
         void
@@ -942,7 +2280,7 @@ namespace libcage {
                                                          m_id, m_peers, this);
         }
 
-        void
+        dht::query_ptr
         dht::find_nv(const uint160_t &dst, callback_func func,
                      bool is_find_value, const void *key = NULL, int keylen = 0)
         {
@@ -961,7 +2299,7 @@ namespace libcage {
                                 f = boost::get<callback_find_node>(func);
                                 f(q->nodes);
                         }
-                        return;
+                        return query_ptr();
                 }
 
                 id_ptr p_dst(new uint160_t);
@@ -1001,6 +2339,8 @@ namespace libcage {
                 m_query[nonce] = q;
 
                 send_find(q);
+
+                return q;
         }
 
         void
@@ -1108,6 +2448,7 @@ namespace libcage {
 
                 msg.nonce  = htonl(nonce);
                 msg.domain = htons(addr.domain);
+                msg.accept = dht_flag_compressed;
 
                 dst->to_binary(msg.id, sizeof(msg.id));
 
@@ -1118,22 +2459,10 @@ namespace libcage {
         void
         dht::send_find_node(cageaddr &dst, query_ptr q)
         {
-                try {
-                        if (m_is_dtun && ! dst.id->is_zero())
-                                m_peers.get_addr(dst.id);
-
-                        msg_dht_find_node msg;
-
-                        memset(&msg, 0, sizeof(msg));
-
-                        msg.nonce  = htonl(q->nonce);
-                        msg.domain = htons(dst.domain);
-
-                        q->dst->to_binary(msg.id, sizeof(msg.id));
+                cageaddr addr;
 
-                        send_msg(m_udp, &msg.hdr, sizeof(msg),
-                                 type_dht_find_node, dst, m_id);
-                } catch (std::out_of_range) {
+                if (m_is_dtun && ! dst.id->is_zero() &&
+                    ! m_peers.find_addr(dst.id, addr)) {
                         find_node_func func;
 
                         func.dst   = q->dst;
@@ -1141,7 +2470,21 @@ namespace libcage {
                         func.p_dht = this;
 
                         m_dtun.request(*dst.id, func);
+                        return;
                 }
+
+                msg_dht_find_node msg;
+
+                memset(&msg, 0, sizeof(msg));
+
+                msg.nonce  = htonl(q->nonce);
+                msg.domain = htons(dst.domain);
+                msg.accept = dht_flag_compressed;
+
+                q->dst->to_binary(msg.id, sizeof(msg.id));
+
+                send_msg(m_udp, &msg.hdr, sizeof(msg), type_dht_find_node,
+                         dst, m_id);
         }
 
         void
@@ -1206,6 +2549,8 @@ namespace libcage {
                 m_peers.add_node(addr);
                 add(addr);
 
+                set_accept_compressed(addr.id, req->accept);
+
                 // lookup
                 id.from_binary(req->id, sizeof(req->id));
                 lookup(id, num_find_node, nodes);
@@ -1217,6 +2562,7 @@ namespace libcage {
                 reply->nonce  = req->nonce;
                 reply->domain = req->domain;
                 reply->num    = nodes.size();
+                reply->accept = dht_flag_compressed;
 
                 memcpy(reply->id, req->id, sizeof(reply->id));
 
@@ -1283,6 +2629,8 @@ namespace libcage {
                 m_peers.add_node(addr);
                 add(addr);
 
+                set_accept_compressed(addr.id, reply->accept);
+
                 // stop timer
                 c_id.id = addr.id;
                 if (q->timers.find(c_id) == q->timers.end()) {
@@ -1461,11 +2809,33 @@ namespace libcage {
                 m_is_use_rdp = flag;
         }
 
+        void
+        dht::set_enabled_compress(bool flag)
+        {
+                m_is_use_compress = flag;
+        }
+
         void
         dht::store(id_ptr id, boost::shared_array<char> key, uint16_t keylen,
-                   boost::shared_array<char> value, uint16_t valuelen,
-                   uint16_t ttl, id_ptr from, bool is_unique)
+                   boost::shared_array<char> value, uint32_t valuelen,
+                   uint16_t ttl, id_ptr from, bool is_unique,
+                   bool is_compressed)
         {
+                // values put by this node or stored through the proxy
+                // are compressed here
+                if (m_is_use_compress && ! is_compressed &&
+                    valuelen >= compress_min_len) {
+                        boost::shared_array<char> comp;
+                        uint32_t comp_len;
+
+                        if (compress_value(value.get(), valuelen, comp,
+                                           comp_len)) {
+                                value         = comp;
+                                valuelen      = comp_len;
+                                is_compressed = true;
+                        }
+                }
+
                 // store to dht network
                 store_func func;
 
@@ -1479,6 +2849,8 @@ namespace libcage {
                 func.p_dht     = this;
                 func.from      = from;
 
+                func.is_compressed = is_compressed;
+
                 find_node(*id, func);
 
 
@@ -1496,6 +2868,8 @@ namespace libcage {
                 data.src         = from;
                 data.is_unique   = is_unique;
 
+                data.is_compressed = is_compressed;
+
                 if (ttl == 0) {
                         erase_sdata(data);
                 } else {
@@ -1505,9 +2879,12 @@ namespace libcage {
 
         void
         dht::store(const uint160_t &id, const void *key, uint16_t keylen,
-                   const void *value, uint16_t valuelen, uint16_t ttl,
+                   const void *value, uint32_t valuelen, uint16_t ttl,
                    bool is_unique)
         {
+                if (valuelen > max_value_len)
+                        return;
+
                 id_ptr     p_id(new uint160_t);
                 id_ptr     p_from(new uint160_t(m_id));
                 boost::shared_array<char> p_key(new char[keylen]);
@@ -1546,6 +2923,8 @@ namespace libcage {
                 if (is_unique)
                         msg->flags |= dht_flag_unique;
 
+                if (is_compressed)
+                        msg->flags |= dht_flag_compressed;
 
                 id->to_binary(msg->id, sizeof(msg->id));
                 p_dht->m_id.to_binary(msg->from, sizeof(msg->from));
@@ -1557,6 +2936,8 @@ namespace libcage {
                 memcpy(p_value, value.get(), valuelen);
 
                 // send store
+                char plain[1024 * 2];
+                int  plain_size = -1;
                 bool me = false;
                 BOOST_FOREACH(cageaddr &addr, nodes) {
                         if (*addr.id == p_dht->m_id) {
@@ -1564,6 +2945,20 @@ namespace libcage {
                                 continue;
                         }
 
+                        if (is_compressed &&
+                            ! p_dht->is_accept_compressed(addr.id)) {
+                                if (plain_size < 0)
+                                        plain_size = p_dht->plain_store(msg,
+                                                                        plain,
+                                                                        sizeof(plain));
+                                if (plain_size > 0)
+                                        send_msg(p_dht->m_udp,
+                                                 &((msg_dht_store*)plain)->hdr,
+                                                 plain_size, type_dht_store,
+                                                 addr, p_dht->m_id);
+                                continue;
+                        }
+
                         send_msg(p_dht->m_udp, &msg->hdr, size,
                                  type_dht_store, addr, p_dht->m_id);
                 }
@@ -1587,20 +2982,15 @@ namespace libcage {
                 func.is_unique = is_unique;
                 func.p_dht     = p_dht;
 
+                func.is_compressed = is_compressed;
+
                 BOOST_FOREACH(cageaddr &addr, nodes) {
                         if (*addr.id == p_dht->m_id) {
                                 me = true;
                                 continue;
                         }
 
-                        int desc;
-                        desc = p_dht->m_rdp.connect(0, addr.id,
-                                                    dht::rdp_store_port,
-                                                    func);
-                        if (desc <= 0)
-                                continue;
-
-                        p_dht->m_rdp_store[desc] = time(NULL);
+                        p_dht->store_rdp(func, addr.id);
                 }
 
                 return me;
@@ -1627,6 +3017,8 @@ namespace libcage {
                         sdata.is_unique = is_unique;
                         sdata.src       = from;
 
+                        sdata.is_compressed = is_compressed;
+
 
                         int origin = p_dht->dec_origin_sdata(sdata);
 
@@ -1637,7 +3029,7 @@ namespace libcage {
         }
 
         void
-        dht::recv_store(void *msg, int len, sockaddr *from)
+        dht::recv_store(void *msg, int len, sockaddr *from, packetbuf_ptr pbuf)
         {
                 msg_dht_store *req;
                 cageaddr  addr;
@@ -1670,15 +3062,15 @@ namespace libcage {
 
                 
                 // store data
-                boost::shared_array<char> key(new char[keylen]);
-                boost::shared_array<char> value(new char[valuelen]);
+                boost::shared_array<char> key, value;
                 id_ptr id(new uint160_t);
                 id_ptr src(new uint160_t);
 
                 id->from_binary(req->id, sizeof(req->id));
                 src->from_binary(req->from, sizeof(req->from));
-                memcpy(key.get(), req->data, keylen);
-                memcpy(value.get(), (char*)req->data + keylen, valuelen);
+
+                key   = pbuf_slice(pbuf, req->data, keylen);
+                value = pbuf_slice(pbuf, (char*)req->data + keylen, valuelen);
 
 
                 stored_data data;
@@ -1696,6 +3088,9 @@ namespace libcage {
                 if (req->flags & dht_flag_unique)
                         data.is_unique = true;
 
+                if (req->flags & dht_flag_compressed)
+                        data.is_compressed = true;
+
                 if (ttl == 0) {
                         erase_sdata(data);
                         return;
@@ -1721,6 +3116,27 @@ namespace libcage {
                 find_nv(dst, func, true, key, keylen);
         }
 
+        void
+        dht::find_value(const uint160_t &dst, const void *key, uint16_t keylen,
+                        callback_find_value func, callback_value_chunk chunk)
+        {
+                node_state state = m_nat.get_state();
+                if (state == node_symmetric || state == node_undefined ||
+                    state == node_nat) {
+                        value_set_ptr p;
+                        func(false, p);
+                        return;
+                }
+
+
+                query_ptr q = find_nv(dst, func, true, key, keylen);
+
+                if (q) {
+                        q->chunk    = chunk;
+                        q->is_chunk = true;
+                }
+        }
+
         void
         dht::find_value_func::operator() (bool result, cageaddr &addr)
         {
@@ -1746,6 +3162,7 @@ namespace libcage {
 
                 msg->nonce  = htonl(nonce);
                 msg->domain = htons(addr.domain);
+                msg->accept = accept;
 
                 if (p_dht->m_is_use_rdp) {
                         msg->flag = get_by_rdp;
@@ -1764,52 +3181,62 @@ namespace libcage {
         void
         dht::send_find_value(cageaddr &dst, query_ptr q)
         {
-                try {
-                        if (m_is_dtun && ! dst.id->is_zero())
-                                m_peers.get_addr(dst.id);
+                cageaddr addr;
 
-                        msg_dht_find_value *msg;
-                        int  size;
-                        char buf[1024 * 2];
+                if (m_is_dtun && ! dst.id->is_zero() &&
+                    ! m_peers.find_addr(dst.id, addr)) {
+                        find_value_func func;
 
-                        size = sizeof(*msg) - sizeof(msg->key);
+                        func.key    = q->key;
+                        func.keylen = q->keylen;
+                        func.dst    = q->dst;
+                        func.nonce  = q->nonce;
+                        func.accept = dht_flag_packed;
+                        func.p_dht  = this;
 
-                        if (! m_is_use_rdp)
-                                size += q->keylen;
+                        if (! q->is_chunk)
+                                func.accept |= dht_flag_compressed;
 
-                        if (size > (int)sizeof(buf))
-                                return;
+                        m_dtun.request(*dst.id, func);
+                        return;
+                }
 
-                        msg = (msg_dht_find_value*)buf;
+                msg_dht_find_value *msg;
+                int  size;
+                char buf[1024 * 2];
 
-                        memset(msg, 0, size);
+                size = sizeof(*msg) - sizeof(msg->key);
 
-                        msg->nonce  = htonl(q->nonce);
-                        msg->domain = htons(dst.domain);
+                if (! m_is_use_rdp)
+                        size += q->keylen;
 
-                        if (m_is_use_rdp) {
-                                msg->flag = get_by_rdp;
-                        } else {
-                                msg->keylen = htons(q->keylen);
-                                msg->flag   = get_by_udp;
-                                memcpy(msg->key, q->key.get(), q->keylen);
-                        }
+                if (size > (int)sizeof(buf))
+                        return;
 
-                        q->dst->to_binary(msg->id, sizeof(msg->id));
+                msg = (msg_dht_find_value*)buf;
 
-                        send_msg(m_udp, &msg->hdr, size, type_dht_find_value,
-                                 dst, m_id);
-                } catch (std::out_of_range) {
-                        find_value_func func;
+                memset(msg, 0, size);
 
-                        func.key    = q->key;
-                        func.keylen = q->keylen;
-                        func.dst    = q->dst;
-                        func.nonce  = q->nonce;
-                        func.p_dht  = this;
+                msg->nonce  = htonl(q->nonce);
+                msg->domain = htons(dst.domain);
+                msg->accept = dht_flag_packed;
 
-                        m_dtun.request(*dst.id, func);
+                // chunks cannot be uncompressed
+                if (! q->is_chunk)
+                        msg->accept |= dht_flag_compressed;
+
+                if (m_is_use_rdp) {
+                        msg->flag = get_by_rdp;
+                } else {
+                        msg->keylen = htons(q->keylen);
+                        msg->flag   = get_by_udp;
+                        memcpy(msg->key, q->key.get(), q->keylen);
                 }
+
+                q->dst->to_binary(msg->id, sizeof(msg->id));
+
+                send_msg(m_udp, &msg->hdr, size, type_dht_find_value, dst,
+                         m_id);
         }
 
         void
@@ -1842,6 +3269,11 @@ namespace libcage {
                 add(addr);
                 m_peers.add_node(addr);
 
+                // streaming readers do not accept compressed values,
+                // even if the node does
+                if (req->accept & dht_flag_compressed)
+                        set_accept_compressed(addr.id, req->accept);
+
                 reply = (msg_dht_find_value_reply*)buf;
                 id->from_binary(req->id, sizeof(req->id));
 
@@ -1889,17 +3321,59 @@ namespace libcage {
                                 it2 = it1->second.find(k);
 
                                 if (it2 != it1->second.end()) {
-                                        sdata_set::iterator it3;
+                                        std::vector<stored_data> vals;
+                                        std::vector<stored_data>::iterator it3;
+                                        sdata_set::iterator it4;
                                         uint16_t i = 1;
-                                        for (it3 = it2->second.begin();
-                                             it3 != it2->second.end(); ++it3) {
-                                                msg_data *data;
+                                        int      hlen;
+                                        int      rmax;
 
-                                                size = sizeof(*reply) -
+                                        rmax = max_reply_len(addr,
+                                                             req->accept &
+                                                             dht_flag_packed);
+
+                                        if (req->accept & dht_flag_packed)
+                                                hlen = sizeof(*reply) -
+                                                        sizeof(reply->data) +
+                                                        sizeof(msg_data_packed) -
+                                                        sizeof(uint32_t) +
+                                                        sizeof(msg_value);
+                                        else
+                                                hlen = sizeof(*reply) -
                                                         sizeof(reply->data) +
-                                                        sizeof(*data) -
-                                                        sizeof(data->data) +
-                                                        it3->keylen +
+                                                        sizeof(msg_data) -
+                                                        sizeof(uint32_t);
+
+                                        for (it4 = it2->second.begin();
+                                             it4 != it2->second.end(); ++it4) {
+                                                stored_data sdata = *it4;
+
+                                                if (sdata.is_compressed &&
+                                                    ! (req->accept &
+                                                       dht_flag_compressed) &&
+                                                    ! uncompress_sdata(sdata))
+                                                        continue;
+
+                                                // large values are got by
+                                                // RDP only
+                                                if (hlen + sdata.keylen +
+                                                    (int)sdata.valuelen > rmax)
+                                                        continue;
+
+                                                vals.push_back(sdata);
+                                        }
+
+                                        if (req->accept & dht_flag_packed) {
+                                                send_packed_values(addr, req,
+                                                                   vals);
+                                                return;
+                                        }
+
+                                        for (it3 = vals.begin();
+                                             it3 != vals.end(); ++it3) {
+                                                msg_data *data;
+
+                                                size = hlen + it3->keylen +
                                                         it3->valuelen;
 
                                                 memset(reply, 0, size);
@@ -1907,7 +3381,10 @@ namespace libcage {
                                                 reply->nonce = req->nonce;
                                                 reply->flag  = data_are_values;
                                                 reply->index = htons(i);
-                                                reply->total = htons((uint16_t)it2->second.size());
+                                                reply->total = htons(vals.size());
+
+                                                if (it3->is_compressed)
+                                                        reply->vflags = dht_flag_compressed;
 
                                                 memcpy(reply->id, req->id, sizeof(reply->id));
 
@@ -1992,8 +3469,212 @@ namespace libcage {
                          type_dht_find_value_reply, addr, m_id);
         }
 
+        int
+        dht::max_reply_len(cageaddr &dst, bool is_packed)
+        {
+                // the requester reads a reply into a packetbuf. one which
+                // accepts packed values has PBUF_SIZE ones, and an older
+                // one has PBUF_LEGACY_SIZE ones. PBUF_SIZE less the
+                // offset is also the UDP payload of a 1500 bytes MTU
+                int len, mtu;
+
+                if (is_packed)
+                        len = PBUF_SIZE - PBUF_DEFAULT_OFFSET;
+                else
+                        len = PBUF_LEGACY_SIZE;
+
+                mtu = m_peers.get_mtu(dst.id);
+                if (mtu > 0 && mtu < len)
+                        len = mtu;
+
+                return len;
+        }
+
+        void
+        dht::send_packed_values(cageaddr &dst, msg_dht_find_value *req,
+                                std::vector<stored_data> &vals)
+        {
+                std::vector<stored_data>::iterator it;
+                msg_dht_find_value_reply *reply;
+                msg_data_packed          *data;
+                uint16_t keylen;
+                uint16_t index = 1;
+                uint16_t num   = 0;
+                char     buf[1024 * 2];
+                int      hlen;
+                int      size;
+                int      rmax;
+
+                rmax = max_reply_len(dst, true);
+
+                reply  = (msg_dht_find_value_reply*)buf;
+                data   = (msg_data_packed*)reply->data;
+                keylen = ntohs(req->keylen);
+
+                hlen = sizeof(*reply) - sizeof(reply->data) +
+                        sizeof(*data) - sizeof(data->data) + keylen;
+                size = hlen;
+
+                // as many values as possible are packed into a datagram
+                // of rmax bytes. the values are not bigger than it
+                for (it = vals.begin(); ; ++it) {
+                        int rlen = 0;
+
+                        if (it != vals.end())
+                                rlen = sizeof(msg_value) + it->valuelen;
+
+                        if (num > 0 && (it == vals.end() ||
+                                        size + rlen > rmax)) {
+                                reply->nonce = req->nonce;
+                                reply->flag  = data_are_packed;
+                                reply->index = htons(index);
+                                reply->total = htons(vals.size());
+
+                                memcpy(reply->id, req->id, sizeof(reply->id));
+
+                                data->keylen = htons(keylen);
+                                data->num    = htons(num);
+
+                                memcpy(data->data, req->key, keylen);
+
+                                send_msg(m_udp, &reply->hdr, size,
+                                         type_dht_find_value_reply, dst, m_id);
+
+                                index++;
+                                num  = 0;
+                                size = hlen;
+                        }
+
+                        if (it == vals.end())
+                                break;
+
+                        if (num == 0)
+                                memset(reply, 0, hlen);
+
+                        msg_value v;
+
+                        memset(&v, 0, sizeof(v));
+
+                        v.valuelen = htons(it->valuelen);
+
+                        if (it->is_compressed)
+                                v.flags = dht_flag_compressed;
+
+                        memcpy(&buf[size], &v, sizeof(v));
+                        memcpy(&buf[size + sizeof(v)], it->value.get(),
+                               it->valuelen);
+
+                        size += rlen;
+                        num++;
+                }
+        }
+
+        bool
+        dht::read_values(msg_dht_find_value_reply *reply, int len,
+                         query_ptr q, std::vector<value_t> &vals,
+                         packetbuf_ptr pbuf)
+        {
+                uint16_t  keylen;
+                uint16_t  num;
+                char     *key, *p;
+                int       size;
+
+                if (reply->flag == data_are_values) {
+                        msg_data *data;
+
+                        size = sizeof(*reply) - sizeof(reply->data) +
+                                sizeof(*data) - sizeof(data->data);
+
+                        if (len < size)
+                                return false;
+
+                        data = (msg_data*)reply->data;
+
+                        keylen = ntohs(data->keylen);
+                        key    = (char*)data->data;
+                        num    = 1;
+                } else {
+                        msg_data_packed *data;
+
+                        size = sizeof(*reply) - sizeof(reply->data) +
+                                sizeof(*data) - sizeof(data->data);
+
+                        if (len < size)
+                                return false;
+
+                        data = (msg_data_packed*)reply->data;
+
+                        keylen = ntohs(data->keylen);
+                        key    = (char*)data->data;
+                        num    = ntohs(data->num);
+                }
+
+                size += keylen;
+
+                if (len < size)
+                        return false;
+
+                if (keylen != q->keylen)
+                        return false;
+
+                if (memcmp(key, q->key.get(), keylen) != 0)
+                        return false;
+
+                for (uint16_t n = 0; n < num; n++) {
+                        boost::shared_array<char> v_ptr;
+                        uint16_t valuelen;
+                        uint8_t  flags;
+                        value_t  v;
+
+                        if (reply->flag == data_are_values) {
+                                msg_data *data = (msg_data*)reply->data;
+
+                                valuelen = ntohs(data->valuelen);
+                                flags    = reply->vflags;
+                        } else {
+                                msg_value mv;
+
+                                if (len < size + (int)sizeof(mv))
+                                        return false;
+
+                                memcpy(&mv, (char*)reply + size, sizeof(mv));
+
+                                size    += sizeof(mv);
+                                valuelen = ntohs(mv.valuelen);
+                                flags    = mv.flags;
+                        }
+
+                        p     = (char*)reply + size;
+                        size += valuelen;
+
+                        if (len < size)
+                                return false;
+
+                        if (flags & dht_flag_compressed) {
+                                uint32_t plainlen;
+
+                                if (! uncompress_value(p, valuelen, v_ptr,
+                                                       plainlen,
+                                                       max_value_len))
+                                        continue;
+
+                                v.len = plainlen;
+                        } else {
+                                v_ptr = pbuf_slice(pbuf, p, valuelen);
+                                v.len = valuelen;
+                        }
+
+                        v.value = v_ptr;
+
+                        vals.push_back(v);
+                }
+
+                return size == len;
+        }
+
         void
-        dht::recv_find_value_reply(void *msg, int len, sockaddr *from)
+        dht::recv_find_value_reply(void *msg, int len, sockaddr *from,
+                                   packetbuf_ptr pbuf)
         {
                 std::map<uint32_t, query_ptr>::iterator it;
                 msg_dht_find_value_reply *reply;
@@ -2052,46 +3733,17 @@ namespace libcage {
                                 return;
                         }
 
-                        rdp_get_func func(*this, q);
-
-                        q->is_rdp_con = true;
-                        q->rdp_time   = time(NULL);
-
-                        q->rdp_desc = m_rdp.connect(0, addr.id, rdp_get_port,
-                                                    func);
+                        get_rdp(q, addr.id);
 
                         return;
-                } else if (reply->flag == data_are_values && ! m_is_use_rdp) {
-                        msg_data *data;
-                        uint16_t  index;
-                        uint16_t  total;
-                        uint16_t  keylen;
-                        uint16_t  valuelen;
-                        char     *key, *value;
-
-                        size = sizeof(*reply) - sizeof(reply->data) +
-                                sizeof(*data) - sizeof(data->data);
-
-                        if (len < size)
-                                return;
-
-                        data = (msg_data*)reply->data;
-
-                        keylen   = ntohs(data->keylen);
-                        valuelen = ntohs(data->valuelen);
-
-                        size += keylen + valuelen;
-
-                        if (size != len)
-                                return;
-
-                        key   = (char*)data->data;
-                        value = key + keylen;
-
-                        if (keylen != q->keylen)
-                                return;
-
-                        if (memcmp(key, q->key.get(), keylen) != 0)
+                } else if ((reply->flag == data_are_values ||
+                            reply->flag == data_are_packed) &&
+                           ! m_is_use_rdp) {
+                        std::vector<value_t> vals;
+                        uint16_t index;
+                        uint16_t total;
+
+                        if (! read_values(reply, len, q, vals, pbuf))
                                 return;
 
                         index = ntohs(reply->index);
@@ -2109,15 +3761,10 @@ namespace libcage {
                         }
 
 
-                        boost::shared_array<char> v_ptr(new char[valuelen]);
-                        value_t v;
-
-                        memcpy(v_ptr.get(), value, valuelen);
-                        v.value = v_ptr;
-                        v.len   = valuelen;
-
-                        q->vset->insert(v);
-                        it_val->second.values.insert(v);
+                        BOOST_FOREACH(value_t &v, vals) {
+                                q->vset->insert(v);
+                                it_val->second.values.insert(v);
+                        }
                         it_val->second.indeces.insert(index);
 
 
@@ -2213,6 +3860,18 @@ namespace libcage {
                 // call callback function
                 callback_find_value func;
                 func = boost::get<callback_find_value>(q->func);
+
+                if (q->is_chunk) {
+                        // values got by UDP are passed at once
+                        value_set::iterator it;
+                        for (it = q->vset->begin(); it != q->vset->end();
+                             ++it) {
+                                q->chunk(it->value.get(), it->len, 0, it->len);
+                        }
+
+                        q->vset->clear();
+                }
+
                 func(true, q->vset);
 
                 remove_query(q);
@@ -2252,6 +3911,17 @@ namespace libcage {
                         else
                                 ++it1;
                 }
+
+
+                boost::unordered_map<_id, time_t>::iterator it4;
+
+                for (it4 = m_compress_nodes.begin();
+                     it4 != m_compress_nodes.end();) {
+                        if (now - it4->second > compress_node_ttl)
+                                m_compress_nodes.erase(it4++);
+                        else
+                                ++it4;
+                }
         }
 
         bool
@@ -2294,6 +3964,8 @@ namespace libcage {
                         sfunc.is_unique = it->is_unique;
                         sfunc.p_dht     = p_dht;
 
+                        sfunc.is_compressed = it->is_compressed;
+
                         p_dht->find_node(*it->id, sfunc);
 
                         return true;
@@ -2319,7 +3991,13 @@ namespace libcage {
                 memcpy(p_value, it->value.get(), it->valuelen);
 
                 if (it->is_unique)
-                        msg->flags = dht_flag_unique;
+                        msg->flags |= dht_flag_unique;
+
+                if (it->is_compressed)
+                        msg->flags |= dht_flag_compressed;
+
+                char plain[1024 * 2];
+                int  plain_size = -1;
 
                 BOOST_FOREACH(cageaddr &addr, nodes) {
                         if (p_dht->m_id == *addr.id) {
@@ -2333,6 +4011,24 @@ namespace libcage {
                         if (it->recvd.find(i) != it->recvd.end())
                                 continue;
 
+                        if (it->is_compressed &&
+                            ! p_dht->is_accept_compressed(addr.id)) {
+                                if (plain_size < 0)
+                                        plain_size = p_dht->plain_store(msg,
+                                                                        plain,
+                                                                        sizeof(plain));
+                                if (plain_size <= 0)
+                                        continue;
+
+                                it->recvd.insert(i);
+
+                                send_msg(p_dht->m_udp,
+                                         &((msg_dht_store*)plain)->hdr,
+                                         plain_size, type_dht_store, addr,
+                                         p_dht->m_id);
+                                continue;
+                        }
+
                         it->recvd.insert(i);
 
                         send_msg(p_dht->m_udp, &msg->hdr, size, type_dht_store,
@@ -2344,9 +4040,9 @@ namespace libcage {
 
         bool
         dht::restore_func::restore_by_rdp(std::vector<cageaddr> &nodes,
-                                          sdata_set::iterator &it)
+                                          sdata_set::iterator &it,
+                                          sync_map &syncs)
         {
-                rdp_store_func func;
                 time_t         now = time(NULL);
                 time_t         diff;
                 bool           me = false;
@@ -2368,41 +4064,38 @@ namespace libcage {
                         sfunc.is_unique = it->is_unique;
                         sfunc.p_dht     = p_dht;
 
+                        sfunc.is_compressed = it->is_compressed;
+
                         p_dht->find_node(*it->id, sfunc);
 
                         return true;
                 }
 
-                func.key       = it->key;
-                func.value     = it->value;
-                func.keylen    = it->keylen;
-                func.valuelen  = it->valuelen;
-                func.ttl       = it->ttl;
-                func.id        = it->id;
-                func.from      = it->src;
-                func.is_unique = it->is_unique;
-                func.p_dht     = p_dht;
-
+                // the entries are not stored directly,
+                // the digests are compared with the neighbors first
                 BOOST_FOREACH(cageaddr &addr, nodes) {
                         if (*addr.id == p_dht->m_id) {
                                 me = true;
                                 continue;
                         }
 
-                        _id    i;
+                        _id i;
 
                         i.id = addr.id;
-                        if (it->recvd.find(i) != it->recvd.end())
-                                continue;
 
-                        int desc;
-                        desc = p_dht->m_rdp.connect(0, addr.id,
-                                                    dht::rdp_store_port,
-                                                    func);
-                        if (desc <= 0)
-                                continue;
+                        rdp_sync_ptr &sync = syncs[i];
 
-                        p_dht->m_rdp_store[desc] = time(NULL);
+                        if (! sync)
+                                sync = rdp_sync_ptr(new rdp_sync(*p_dht,
+                                                                 addr.id));
+
+                        sync->m_data.push_back(*it);
+
+                        if (sync->m_data.size() >=
+                            (uint32_t)sync_max_entries) {
+                                p_dht->sync_replica(sync);
+                                sync.reset();
+                        }
                 }
 
                 return me;
@@ -2415,6 +4108,7 @@ namespace libcage {
                 sdata_map::iterator   it2;
                 sdata_set::iterator   it3;
                 std::vector<cageaddr> nodes;
+                sync_map              syncs;
 
                 for(it1 = p_dht->m_stored.begin();
                     it1 != p_dht->m_stored.end();) {
@@ -2433,7 +4127,8 @@ namespace libcage {
                                         bool me;
 
                                         if (p_dht->m_is_use_rdp) {
-                                                me = restore_by_rdp(nodes, it3);
+                                                me = restore_by_rdp(nodes, it3,
+                                                                    syncs);
                                         } else {
                                                 me = restore_by_udp(nodes, it3);
                                         }
@@ -2455,6 +4150,12 @@ namespace libcage {
                         else
                                 ++it1;
                 }
+
+                sync_map::iterator it;
+                for (it = syncs.begin(); it != syncs.end(); ++it) {
+                        if (it->second)
+                                p_dht->sync_replica(it->second);
+                }
         }
 
         void
@@ -2505,33 +4206,79 @@ namespace libcage {
                         }
                 }
 
-                std::map<uint32_t, query_ptr>::iterator it4, it4_tmp;
-                for (it4 = m_query.begin(); it4 != m_query.end(); ) {
-                        diff = now - it4->second->rdp_time;
-                        if (it4->second->is_rdp_con && diff > rdp_timeout) {
-                                m_rdp.close(it4->second->rdp_desc);
+                std::map<int, rdp_pool_ptr>::iterator it8;
+                for (it8 = m_rdp_pool_desc.begin();
+                     it8 != m_rdp_pool_desc.end(); ) {
+                        rdp_pool_ptr pool = it8->second;
+                        bool is_idle;
 
-                                if (it4->second->vset->size() > 0) {
-                                        it4_tmp = it4++;
-                                        recvd_value(it4_tmp->second);
-                                        continue;
-                                }
+                        ++it8;
 
-                                if (it4->second->ids.size() > 0) {
-                                        rdp_get_func func(*this, it4->second);
-                                        id_ptr id = it4->second->ids.front();
+                        diff    = now - pool->last_time;
+                        is_idle = pool->sent.empty() && pool->queued.empty();
 
-                                        it4->second->ids.pop();
-                                        it4->second->rdp_time = time(NULL);
-                                        it4->second->rdp_desc = m_rdp.connect(rdp_get_port,
-                                                                id, 0, func);
-                                } else {
-                                        it4->second->is_rdp_con = false;
-                                        send_find(it4->second);
-                                }
+                        if ((is_idle && diff > rdp_pool_idle) ||
+                            diff > rdp_timeout)
+                                close_pool(pool);
+                }
+
+                // values of closed connections
+                std::map<int, std::deque<rdp_sending> >::iterator it7;
+                for (it7 = m_rdp_sending.begin();
+                     it7 != m_rdp_sending.end(); ) {
+                        if (m_rdp.get_send_space(it7->first) < 0)
+                                m_rdp_sending.erase(it7++);
+                        else
+                                ++it7;
+                }
+
+                std::map<int, rdp_sync_ptr>::iterator it5;
+                for (it5 = m_rdp_sync.begin(); it5 != m_rdp_sync.end(); ) {
+                        diff = now - it5->second->m_time;
+                        if (diff > rdp_timeout) {
+                                // the neighbor accepted the connection,
+                                // but did not answer the digests
+                                if (it5->second->m_state !=
+                                    rdp_sync::SYNC_END)
+                                        it5->second->push_all();
+
+                                m_rdp.close(it5->first);
+                                m_rdp_sync.erase(it5++);
+                        } else {
+                                ++it5;
                         }
+                }
+
+                std::map<int, rdp_recv_sync_ptr>::iterator it6;
+                for (it6 = m_rdp_recv_sync.begin();
+                     it6 != m_rdp_recv_sync.end(); ) {
+                        diff = now - it6->second->m_time;
+                        if (diff > rdp_timeout) {
+                                m_rdp.close(it6->first);
+                                m_rdp_recv_sync.erase(it6++);
+                        } else {
+                                ++it6;
+                        }
+                }
+
+                std::map<int, rdp_get_pool_ptr>::iterator it4;
+                for (it4 = m_rdp_get_pool_desc.begin();
+                     it4 != m_rdp_get_pool_desc.end(); ) {
+                        rdp_get_pool_ptr pool = it4->second;
+                        bool is_idle;
 
                         ++it4;
+
+                        if (pool->current)
+                                diff = now - pool->current->rdp_time;
+                        else
+                                diff = now - pool->last_time;
+
+                        is_idle = ! pool->current && pool->queued.empty();
+
+                        if ((is_idle && diff > rdp_pool_idle) ||
+                            diff > rdp_timeout)
+                                close_get_pool(pool, false);
                 }
         }
 
@@ -2597,4 +4344,60 @@ namespace libcage {
 
                 m_dht.m_timer.set_timer(this, &tval);
         }
+
+#ifdef DEBUG
+        void
+        dht::test_sync_timeout()
+        {
+                // a neighbor which accepts the connection but never
+                // answers the digests. nobody listens on the port, so
+                // the connection stays in SYN-SENT
+                id_ptr       dst(new uint160_t);
+                rdp_sync_ptr sync(new rdp_sync(*this, dst));
+                stored_data  sdata;
+                bool         result = true;
+
+                dst->fill_zero();
+
+                sdata.key      = boost::shared_array<char>(new char[1]);
+                sdata.value    = boost::shared_array<char>(new char[1]);
+                sdata.keylen   = 1;
+                sdata.valuelen = 1;
+                sdata.id       = id_ptr(new uint160_t(*dst));
+                sdata.src      = id_ptr(new uint160_t(m_id));
+                sdata.ttl      = 300;
+                sdata.original = 0;
+
+                sdata.stored_time = time(NULL);
+                sdata.key[0]      = 'k';
+                sdata.value[0]    = 'v';
+
+                sync->m_data.push_back(sdata);
+
+                sync_replica(sync);
+
+                if (m_rdp_sync.size() != 1) {
+                        printf("test sync timeout: cannot connect\n");
+                        return;
+                }
+
+                sync->m_time -= rdp_timeout + 1;
+
+                sweep_rdp();
+
+                _id i;
+
+                i.id = dst;
+
+                // the entries are stored as before
+                if (! m_rdp_sync.empty())
+                        result = false;
+                else if (sync->m_state != rdp_sync::SYNC_END)
+                        result = false;
+                else if (m_rdp_pool.find(i) == m_rdp_pool.end())
+                        result = false;
+
+                printf("test sync timeout: %s\n", result ? "ok" : "NG");
+        }
+#endif // DEBUG
 }
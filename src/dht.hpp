@@ -42,6 +42,7 @@
 #include "rdp.hpp"
 #include "udphandler.hpp"
 
+#include <deque>
 #include <map>
 #include <set>
 #include <string>
@@ -70,7 +71,17 @@ namespace libcage {
                 static const int        recvd_value_timeout;
                 static const uint16_t   rdp_store_port;
                 static const uint16_t   rdp_get_port;
+                static const uint16_t   rdp_sync_port;
                 static const time_t     rdp_timeout;
+                static const time_t     rdp_pool_idle;
+                static const int        sync_max_entries;
+                static const uint32_t   value_chunk;
+                static const size_t     rdp_recv_mem_max;
+                static const time_t     compress_node_ttl;
+
+        public:
+                static const uint32_t   max_value_len;
+                static const uint32_t   compress_min_len;
 
         public:
                 class value_t {
@@ -100,6 +111,14 @@ namespace libcage {
                 typedef boost::function<void (std::vector<cageaddr>&)>
                 callback_find_node;
                 typedef boost::function<void (bool, value_set_ptr)> callback_find_value;
+
+                // called whenever a part of a value arrives.
+                // offset is 0 at the first part of each value,
+                // and the value is completed when offset + len == total
+                typedef boost::function<void (const void *buf, int len,
+                                              uint32_t offset,
+                                              uint32_t total)>
+                callback_value_chunk;
                 typedef boost::variant<callback_find_node,
                                        callback_find_value> callback_func;
 
@@ -118,8 +137,10 @@ namespace libcage {
                 void            recv_find_value(void *msg, int len,
                                                 sockaddr *from);
                 void            recv_find_value_reply(void *msg, int len,
-                                                      sockaddr *from);
-                void            recv_store(void *msg, int len, sockaddr *from);
+                                                      sockaddr *from,
+                                                      packetbuf_ptr pbuf);
+                void            recv_store(void *msg, int len, sockaddr *from,
+                                           packetbuf_ptr pbuf);
 
 
                 void            find_node(const uint160_t &dst,
@@ -131,44 +152,70 @@ namespace libcage {
                 void            find_value(const uint160_t &dst,
                                            const void *key, uint16_t keylen,
                                            callback_find_value func);
+                void            find_value(const uint160_t &dst,
+                                           const void *key, uint16_t keylen,
+                                           callback_find_value func,
+                                           callback_value_chunk chunk);
                 void            store(const uint160_t &id,
                                       const void *key, uint16_t keylen,
-                                      const void *value, uint16_t valuelen,
+                                      const void *value, uint32_t valuelen,
                                       uint16_t ttl, bool is_unique);
                 void            store(id_ptr id, boost::shared_array<char> key,
                                       uint16_t keylen,
                                       boost::shared_array<char> value,
-                                      uint16_t valuelen, uint16_t ttl,
-                                      id_ptr from, bool is_unique);
+                                      uint32_t valuelen, uint16_t ttl,
+                                      id_ptr from, bool is_unique,
+                                      bool is_compressed = false);
 
 
                 void            set_enabled_dtun(bool flag);
                 void            set_enabled_rdp(bool flag);
                 bool            is_use_rdp() { return m_is_use_rdp; }
 
+                // values put by this node or through its proxy are
+                // compressed when enabled. every node can read compressed
+                // values regardless of this, but they are stored only to
+                // the nodes which said they accept them in find_node or
+                // find_value. the others get the plain value
+                void            set_enabled_compress(bool flag);
+                bool            is_use_compress() { return m_is_use_compress; }
+
         private:
                 class rdp_recv_store {
                 public:
                         boost::shared_array<char>       key;
                         boost::shared_array<char>       value;
                         uint16_t        keylen;
-                        uint16_t        valuelen;
+                        uint32_t        valuelen;
                         uint16_t        key_read;
-                        uint16_t        val_read;
+                        uint32_t        val_read;
+                        uint32_t        val_cap; // allocated for value
                         uint16_t        ttl;
                         id_ptr          id;
                         id_ptr          src;
                         time_t          last_time;
                         dht            *p_dht;
                         bool            is_hdr_read;
+                        bool            is_len_read;
                         bool            is_unique;
+                        bool            is_compressed;
+                        bool            is_keep;
 
                         rdp_recv_store(dht *d, id_ptr from) :
                                 keylen(0), valuelen(0), key_read(0),
-                                val_read(0), src(from), last_time(time(NULL)),
-                                p_dht(d), is_hdr_read(false) { }
+                                val_read(0), val_cap(0), src(from),
+                                last_time(time(NULL)),
+                                p_dht(d), is_hdr_read(false),
+                                is_len_read(true), is_unique(false),
+                                is_compressed(false), is_keep(false) { }
+
+                        ~rdp_recv_store()
+                        {
+                                p_dht->m_rdp_recv_mem -= val_cap;
+                        }
 
                         void store2local();
+                        void next();
                 };
 
                 typedef boost::shared_ptr<rdp_recv_store> rdp_recv_store_ptr;
@@ -184,6 +231,7 @@ namespace libcage {
                                          rdp_event event);
                         
                         bool read_hdr(int desc, it_rcvs it);
+                        bool read_len(int desc, it_rcvs it);
                         bool read_body(int desc, it_rcvs it);
                 };
 
@@ -192,15 +240,57 @@ namespace libcage {
                         boost::shared_array<char>       key;
                         boost::shared_array<char>       value;
                         uint16_t        keylen;
-                        uint16_t        valuelen;
+                        uint32_t        valuelen;
                         uint16_t        ttl;
                         id_ptr          id;
                         id_ptr          from;
                         bool            is_unique;
+                        bool            is_compressed;
                         dht            *p_dht;
 
+                        // sent instead of value when the peer
+                        // does not accept compressed values
+                        boost::shared_array<char>       plain;
+                        uint32_t        plainlen;
+
+                        rdp_store_func() : plainlen(0) { }
+
+                        void operator() (int desc, rdp_addr addr,
+                                         rdp_event event);
+                        void send_store(int desc, uint8_t flags);
+                        void stored(id_ptr dst);
+                };
+
+                // a connection to store values, pooled for each peer.
+                // values are pipelined once the peer has acknowledged
+                // the first one, and older peers which close the
+                // connection after a value are served one by one
+                class rdp_pool {
+                public:
+                        int             desc;
+                        id_ptr          dst;
+                        time_t          last_time;
+                        bool            is_connected;
+                        bool            is_keep;
+
+                        std::deque<rdp_store_func>      sent; // not acked
+                        std::deque<rdp_store_func>      queued;
+
+                        rdp_pool() : desc(0), last_time(time(NULL)),
+                                     is_connected(false), is_keep(false) { }
+                };
+
+                typedef boost::shared_ptr<rdp_pool> rdp_pool_ptr;
+
+                class rdp_pool_func {
+                public:
+                        dht    &m_dht;
+
+                        rdp_pool_func(dht &d) : m_dht(d) { }
+
                         void operator() (int desc, rdp_addr addr,
                                          rdp_event event);
+                        void read_acks(int desc, rdp_pool_ptr pool);
                 };
 
                 class sync_node {
@@ -225,11 +315,12 @@ namespace libcage {
                         boost::shared_array<char>       key;
                         boost::shared_array<char>       value;
                         uint16_t        keylen;
-                        uint16_t        valuelen;
+                        uint32_t        valuelen;
                         uint16_t        ttl;
                         id_ptr          id;
                         id_ptr          from;
                         bool            is_unique;
+                        bool            is_compressed;
                         dht            *p_dht;
                 };
 
@@ -258,16 +349,19 @@ namespace libcage {
                         boost::shared_array<char>       key;
                         boost::shared_array<char>       value;
                         uint16_t        keylen;
-                        uint16_t        valuelen;
+                        uint32_t        valuelen;
                         id_ptr          id;
                         id_ptr          src;
                         bool            is_unique;
+                        bool            is_compressed;
 
                         mutable std::set<_id>   recvd;
                         mutable time_t          stored_time;
                         mutable int             original;
                         mutable uint16_t        ttl;
 
+                        stored_data() : is_unique(false),
+                                        is_compressed(false) { }
 
                         bool operator== (const stored_data &rhs) const
                         {
@@ -306,6 +400,7 @@ namespace libcage {
                         uint16_t        keylen;
                         id_ptr          dst;
                         uint32_t        nonce;
+                        uint8_t         accept;
                         dht            *p_dht;
                 };
 
@@ -358,17 +453,25 @@ namespace libcage {
                         // for RDP
                         enum query_state {
                                 QUERY_HDR,
+                                QUERY_LEN,
                                 QUERY_VAL,
                         };
                         std::queue<id_ptr>      ids;
                         bool            is_rdp_con;
-                        int             rdp_desc;
                         time_t          rdp_time;
                         query_state     rdp_state;
-                        uint16_t        vallen;
-                        uint16_t        val_read;
+                        uint32_t        vallen;
+                        uint32_t        val_read;
+                        uint32_t        val_cap;
+                        uint8_t         val_flags;
                         boost::shared_array<char>       val;
 
+                        // values are passed to chunk as they arrive
+                        // instead of being buffered in vset
+                        callback_value_chunk    chunk;
+                        bool            is_chunk;
+                        int             num_streamed;
+
                         timer_recvd_ptr       timer_recvd;
                         bool                  is_timer_recvd_started;
 
@@ -376,6 +479,9 @@ namespace libcage {
 
                         query() : vset(new value_set),
                                   is_rdp_con(false),
+                                  val_cap(0),
+                                  is_chunk(false),
+                                  num_streamed(0),
                                   is_timer_recvd_started(false) { } 
                 };
 
@@ -395,19 +501,41 @@ namespace libcage {
                         }
                 };
 
+                // a connection to get values, pooled for each peer.
+                // the queries are served one by one, and the connection
+                // is kept after a query when the peer sets dht_flag_keep.
+                // older peers close it, and the rest are queued again
+                class rdp_get_pool {
+                public:
+                        int             desc;
+                        id_ptr          dst;
+                        time_t          last_time;
+                        bool            is_connected;
+                        query_ptr       current;
+
+                        std::deque<query_ptr>   queued;
+
+                        rdp_get_pool() : desc(0), last_time(time(NULL)),
+                                         is_connected(false) { }
+                };
+
+                typedef boost::shared_ptr<rdp_get_pool> rdp_get_pool_ptr;
+
                 class rdp_get_func {
                 public:
-                        dht            &m_dht;
-                        query_ptr       m_query;
+                        dht              &m_dht;
+                        rdp_get_pool_ptr  m_pool;
+                        query_ptr         m_query; // current of m_pool
 
-                        rdp_get_func(dht &d, query_ptr q) : m_dht(d),
-                                                            m_query(q) { }
+                        rdp_get_func(dht &d) : m_dht(d) { }
 
                         void operator() (int desc, rdp_addr addr,
                                          rdp_event event);
 
                         bool read_hdr(int desc);
+                        bool read_len(int desc);
                         bool read_val(int desc);
+                        void alloc_val();
                         void close_rdp(int desc);
                 };
 
@@ -427,10 +555,14 @@ namespace libcage {
                         uint16_t        m_key_read;
                         boost::shared_array<char>      m_key;
                         std::queue<stored_data>        m_data;
+                        bool            m_is_accept_compressed;
+                        bool            m_is_keep;
 
                         rdp_recv_get(dht &d) : m_dht(d), m_time(time(NULL)),
                                                m_state(RGET_HDR),
-                                               m_key_read(0) { }
+                                               m_key_read(0),
+                                               m_is_accept_compressed(false),
+                                               m_is_keep(false) { }
                 };
 
                 typedef boost::shared_ptr<rdp_recv_get> rdp_recv_get_ptr;
@@ -446,19 +578,115 @@ namespace libcage {
                         bool read_hdr(int desc, rdp_recv_get_ptr rget);
                         bool read_key(int desc, rdp_recv_get_ptr rget);
                         void read_val(rdp_recv_get_ptr rget);
-                        void read_op(int desc, rdp_recv_get_ptr rget);
+                        bool read_op(int desc, rdp_recv_get_ptr rget);
 
                 };
 
+                // for anti-entropy
+                // the replica holder sends the digests of its entries,
+                // and the neighbor replies the indices of the entries
+                // it lacks. only the lacking entries are stored by RDP.
+                class rdp_sync {
+                public:
+                        enum sync_state {
+                                SYNC_HDR,
+                                SYNC_IDX,
+                                SYNC_END,
+                        };
+                        dht            &m_dht;
+                        id_ptr          m_dst;
+                        time_t          m_time;
+                        sync_state      m_state;
+                        uint32_t        m_num;
+                        uint32_t        m_read;
+                        boost::shared_array<uint32_t>  m_idx;
+                        std::vector<stored_data>       m_data;
+
+                        rdp_sync(dht &d, id_ptr dst) : m_dht(d), m_dst(dst),
+                                                       m_time(time(NULL)),
+                                                       m_state(SYNC_HDR),
+                                                       m_num(0),
+                                                       m_read(0) { }
+
+                        void send_digest(int desc);
+                        void push_lacking();
+                        void push_all();
+                };
+
+                typedef boost::shared_ptr<rdp_sync> rdp_sync_ptr;
+
+                class rdp_sync_func {
+                public:
+                        dht            &m_dht;
+                        rdp_sync_ptr    m_sync;
+
+                        rdp_sync_func(dht &d, rdp_sync_ptr s) : m_dht(d),
+                                                                m_sync(s) { }
+
+                        void operator() (int desc, rdp_addr addr,
+                                         rdp_event event);
+
+                        bool read_hdr(int desc);
+                        bool read_idx(int desc);
+                        void close_rdp(int desc);
+                };
+
+                class rdp_recv_sync {
+                public:
+                        enum rsync_state {
+                                RSYNC_HDR,
+                                RSYNC_BODY,
+                                RSYNC_END,
+                        };
+                        dht            &m_dht;
+                        time_t          m_time;
+                        rsync_state     m_state;
+                        uint32_t        m_len;
+                        uint32_t        m_num;
+                        uint32_t        m_read;
+                        boost::shared_array<char>      m_buf;
+
+                        rdp_recv_sync(dht &d) : m_dht(d), m_time(time(NULL)),
+                                                m_state(RSYNC_HDR), m_len(0),
+                                                m_num(0), m_read(0) { }
+                };
+
+                typedef boost::shared_ptr<rdp_recv_sync> rdp_recv_sync_ptr;
+
+                class rdp_recv_sync_func {
+                public:
+                        dht            &m_dht;
+
+                        rdp_recv_sync_func(dht &d) : m_dht(d) { }
+
+                        void operator() (int desc, rdp_addr addr,
+                                         rdp_event event);
+                        bool read_hdr(int desc, rdp_recv_sync_ptr rsync);
+                        bool read_body(int desc, rdp_recv_sync_ptr rsync);
+                        bool reply(int desc, rdp_recv_sync_ptr rsync);
+                        void close_rdp(int desc);
+                };
+
+                // for values which do not fit the send window of RDP
+                class rdp_sending {
+                public:
+                        boost::shared_array<char>       buf;
+                        uint32_t        len;
+                        uint32_t        sent;
+                };
+
                 // for restore
                 class restore_func {
                 public:
+                        typedef std::map<_id, rdp_sync_ptr> sync_map;
+
                         void operator() (std::vector<cageaddr> &n);
 
                         bool restore_by_udp(std::vector<cageaddr> &nodes,
                                             sdata_set::iterator &it);
                         bool restore_by_rdp(std::vector<cageaddr> &nodes,
-                                            sdata_set::iterator &it);
+                                            sdata_set::iterator &it,
+                                            sync_map &syncs);
 
                         dht    *p_dht;
                 };
@@ -554,12 +782,21 @@ namespace libcage {
 
                 virtual void    send_ping(cageaddr &dst, uint32_t nonce);
 
-                void            find_nv(const uint160_t &dst,
+                query_ptr       find_nv(const uint160_t &dst,
                                         callback_func func, bool is_find_value,
                                         const void *key, int keylen);
                 void            send_find(query_ptr q);
                 void            send_find_node(cageaddr &dst, query_ptr q);
                 void            send_find_value(cageaddr &dst, query_ptr q);
+                int             max_reply_len(cageaddr &dst,
+                                              bool is_packed);
+                void            send_packed_values(cageaddr &dst,
+                                                   msg_dht_find_value *req,
+                                                   std::vector<stored_data> &vals);
+                bool            read_values(msg_dht_find_value_reply *reply,
+                                            int len, query_ptr q,
+                                            std::vector<value_t> &vals,
+                                            packetbuf_ptr pbuf);
 
                 void            refresh();
                 void            restore();
@@ -574,6 +811,38 @@ namespace libcage {
                 void            insert2recvd_sdata(stored_data &sdata,
                                                    id_ptr id);
                 int             dec_origin_sdata(stored_data &sdata);
+                void            push_sdata(stored_data &sdata, id_ptr dst);
+                void            store_rdp(rdp_store_func &func, id_ptr dst);
+                void            connect_store(rdp_store_func &func,
+                                              id_ptr dst);
+                void            send_pool(rdp_pool_ptr pool);
+                void            close_pool(rdp_pool_ptr pool);
+                void            get_rdp(query_ptr q, id_ptr dst);
+                void            send_get(rdp_get_pool_ptr pool);
+                void            close_get_pool(rdp_get_pool_ptr pool,
+                                               bool is_retry);
+                void            next_get(query_ptr q);
+                bool            uncompress_sdata(stored_data &sdata);
+                void            set_accept_compressed(id_ptr id,
+                                                      uint8_t accept);
+                bool            is_accept_compressed(id_ptr id);
+                int             plain_store(const msg_dht_store *msg,
+                                            char *buf, int buflen);
+                static uint32_t next_value_cap(uint32_t cap, uint32_t need,
+                                               uint32_t total);
+                static void     grow_value(boost::shared_array<char> &buf,
+                                           uint32_t len, uint32_t cap);
+                void            sync_replica(rdp_sync_ptr sync);
+                void            get_digests(id_ptr id,
+                                            boost::unordered_set<uint64_t>
+                                            &digests);
+
+                static uint64_t get_digest(const stored_data &sdata);
+
+                void            send_rdp(int desc,
+                                         boost::shared_array<char> buf,
+                                         uint32_t len);
+                void            flush_rdp(int desc);
 
 
                 rand_uint               &m_rnd;
@@ -593,14 +862,30 @@ namespace libcage {
                 sync_node                m_sync;
                 int                      m_rdp_recv_listen;
                 int                      m_rdp_get_listen;
+                int                      m_rdp_sync_listen;
                 bool                     m_is_use_rdp;
+                bool                     m_is_use_compress;
                 int                      m_mask_bit;
 
                 boost::unordered_map<_id, sdata_map>    m_stored;
                 std::map<uint32_t, query_ptr>           m_query;
+                size_t                                  m_rdp_recv_mem;
                 std::map<int, rdp_recv_store_ptr>       m_rdp_recv_store;
                 std::map<int, time_t>                   m_rdp_store;
+                std::map<_id, rdp_pool_ptr>             m_rdp_pool;
+                std::map<int, rdp_pool_ptr>             m_rdp_pool_desc;
+                std::map<_id, rdp_get_pool_ptr>         m_rdp_get_pool;
+                std::map<int, rdp_get_pool_ptr>         m_rdp_get_pool_desc;
                 std::map<int, rdp_recv_get_ptr>         m_rdp_recv_get;
+                std::map<int, rdp_sync_ptr>             m_rdp_sync;
+                std::map<int, rdp_recv_sync_ptr>        m_rdp_recv_sync;
+                std::map<int, std::deque<rdp_sending> > m_rdp_sending;
+                boost::unordered_map<_id, time_t>       m_compress_nodes;
+
+#ifdef DEBUG
+        public:
+                void            test_sync_timeout();
+#endif // DEBUG
         };
 }
 
@@ -103,6 +103,7 @@ namespace libcage {
 
                 m_mask_bit = 1;
                 m_last_maintain = 0;
+                m_request_count = 0;
         }
 
         dtun::~dtun()
@@ -1196,6 +1197,7 @@ namespace libcage {
                 q->finished_find_value = false;
 
                 m_request[nonce] = q;
+                m_request_count++;
 
                 
                 fv.nonce  = nonce;
@@ -122,6 +122,9 @@ namespace libcage {
 
                 uint32_t        get_session() { return m_register_session; }
 
+                // the number of request() called
+                uint64_t        get_request_count() const { return m_request_count; }
+
         private:
                 class timer_refresh : public timer::callback {
                 public:
@@ -259,6 +262,7 @@ namespace libcage {
                 bool                    m_is_enabled;
                 int                     m_mask_bit;
                 time_t                  m_last_maintain;
+                uint64_t                m_request_count;
         };
 }
 
@@ -64,6 +64,8 @@ main(int argc, char* argv[])
 
         // libcage::cage::test_dtun();
 
+        // libcage::cage::test_sync_timeout();
+
         // event_dispatch();
 
         libcage::packetbuf pbuf;
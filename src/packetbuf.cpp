@@ -77,6 +77,12 @@ namespace libcage {
                 return m_len;
         }
 
+        int32_t
+        packetbuf::get_headroom()
+        {
+                return m_head - m_buf;
+        }
+
         void
         packetbuf::set_len(int32_t len)
         {
@@ -107,6 +113,35 @@ namespace libcage {
                 m_len  -= len;
         }
 
+        class pbuf_deleter {
+        public:
+                pbuf_deleter(packetbuf_ptr pbuf) : m_pbuf(pbuf) { }
+
+                void operator() (char *p)
+                {
+                        m_pbuf.reset();
+                }
+
+        private:
+                packetbuf_ptr   m_pbuf;
+        };
+
+        boost::shared_array<char>
+        pbuf_slice(packetbuf_ptr pbuf, const void *p, int len)
+        {
+                if (len < PBUF_SLICE_MIN) {
+                        boost::shared_array<char> buf(new char[len]);
+
+                        memcpy(buf.get(), p, len);
+
+                        return buf;
+                }
+
+                boost::shared_array<char> buf((char*)p, pbuf_deleter(pbuf));
+
+                return buf;
+        }
+
         void
         intrusive_ptr_add_ref(packetbuf *pbuf)
         {
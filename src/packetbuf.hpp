@@ -37,10 +37,15 @@
 #include <stdint.h>
 
 #include <boost/intrusive_ptr.hpp>
+#include <boost/shared_array.hpp>
 #include <boost/pool/object_pool.hpp>
 
-#define PBUF_SIZE           1024
+#define PBUF_SIZE           1600
 #define PBUF_DEFAULT_OFFSET 128
+#define PBUF_SLICE_MIN      256
+
+// PBUF_SIZE of older nodes. they cannot receive a datagram bigger than this
+#define PBUF_LEGACY_SIZE    1024
 
 namespace libcage {
         class packetbuf;
@@ -50,6 +55,13 @@ namespace libcage {
 
         typedef boost::intrusive_ptr<packetbuf> packetbuf_ptr;
 
+        // len bytes at p in pbuf.
+        // the bytes are referred without copying when len is
+        // PBUF_SLICE_MIN or more, and pbuf is kept while they are referred.
+        // small ones are copied not to hold the whole buffer
+        boost::shared_array<char> pbuf_slice(packetbuf_ptr pbuf, const void *p,
+                                             int len);
+
         class packetbuf {
         public:
                 packetbuf();
@@ -58,6 +70,7 @@ namespace libcage {
                 void*           prepend(int32_t len);
                 void*           get_data();
                 int32_t         get_len();
+                int32_t         get_headroom();
                 void            set_len(int32_t len);
                 void            use_whole();
                 void            rm_head(int32_t len);
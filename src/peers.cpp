@@ -29,6 +29,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+
 #include "peers.hpp"
 
 #include <boost/foreach.hpp>
@@ -36,156 +37,487 @@
 namespace libcage {
         const time_t    peers::timeout_ttl    = 30;
         const time_t    peers::map_ttl        = 300;
-        const time_t    peers::timer_interval = 30;
+        const time_t    peers::timer_interval = 10;
+        const uint32_t  peers::entries_max    = 1 << 16;
+        const uint32_t  peers::sweep_min      = 64;
+        const uint32_t  peers::npos           = ~(uint32_t)0;
+
+        bool
+        peers::_addr::operator== (const peers::_addr &rhs) const
+        {
+                return (domain == rhs.domain && port == rhs.port &&
+                        memcmp(addr, rhs.addr, sizeof(addr)) == 0);
+        }
+
+        peers::peers(rand_real &drnd, timer &t) :
+                m_drnd(drnd),
+                m_num(0),
+                m_num_addr(0),
+                m_hand(0),
+                m_timer(t),
+                m_timer_func(*this),
+                m_is_callback(false)
+        {
+
+        }
 
-        size_t
-        hash_value(const peers::__id &i)
+        void
+        peers::set_callback(callback func)
         {
-                return i.id->hash_value();
+                m_is_callback = true;
+                m_callback = func;
         }
 
         bool
-        peers::_addr::operator== (const peers::_addr &rhs) const
+        peers::to_addr(const cageaddr &caddr, _addr &addr)
         {
-                if (domain != rhs.domain) {
+                memset(&addr, 0, sizeof(addr));
+
+                addr.domain = caddr.domain;
+
+                if (caddr.domain == domain_inet) {
+                        in_ptr in = boost::get<in_ptr>(caddr.saddr);
+
+                        addr.port    = in->sin_port;
+                        addr.addr[0] = in->sin_addr.s_addr;
+                } else if (caddr.domain == domain_inet6) {
+                        in6_ptr in6 = boost::get<in6_ptr>(caddr.saddr);
+
+                        addr.port = in6->sin6_port;
+                        memcpy(addr.addr, in6->sin6_addr.s6_addr,
+                               sizeof(addr.addr));
+                } else {
                         return false;
-                } else if (domain == domain_inet) {
-                        in_ptr n1, n2;
+                }
+
+                return true;
+        }
+
+        void
+        peers::to_cageaddr(const entry &e, cageaddr &caddr)
+        {
+                if (! caddr.id || *caddr.id != e.id)
+                        caddr.id = id_ptr(new uint160_t(e.id));
+
+                caddr.domain = e.addr.domain;
+
+                if (e.addr.domain == domain_inet) {
+                        in_ptr in(new sockaddr_in);
+
+                        memset(in.get(), 0, sizeof(*in));
+
+                        in->sin_family      = PF_INET;
+                        in->sin_port        = e.addr.port;
+                        in->sin_addr.s_addr = e.addr.addr[0];
+
+                        caddr.saddr = in;
+                } else {
+                        in6_ptr in6(new sockaddr_in6);
+
+                        memset(in6.get(), 0, sizeof(*in6));
+
+                        in6->sin6_family = PF_INET6;
+                        in6->sin6_port   = e.addr.port;
+                        memcpy(in6->sin6_addr.s6_addr, e.addr.addr,
+                               sizeof(e.addr.addr));
+
+                        caddr.saddr = in6;
+                }
+        }
+
+        uint32_t
+        peers::hash_id(const uint160_t &id)
+        {
+                uint64_t h = id.hash_value();
+
+                // the indices are taken from the lower bits
+                h *= 0x9e3779b97f4a7c15ULL;
+
+                return (uint32_t)(h >> 32);
+        }
+
+        uint32_t
+        peers::hash_addr(const _addr &addr)
+        {
+                // FNV-1a
+                const uint8_t *p = (const uint8_t*)&addr;
+                uint32_t h = 2166136261U;
+
+                for (size_t i = 0; i < sizeof(addr); i++) {
+                        h ^= p[i];
+                        h *= 16777619U;
+                }
+
+                return h;
+        }
+
+        uint32_t
+        peers::lookup_id(const uint160_t &id)
+        {
+                uint32_t hash, mask, i;
+
+                if (m_id_index.empty())
+                        return npos;
+
+                hash = hash_id(id);
+                mask = m_id_index.size() - 1;
+
+                for (i = hash & mask;; i = (i + 1) & mask) {
+                        uint32_t idx = m_id_index[i];
+
+                        if (idx == npos)
+                                return npos;
+
+                        if (m_entries[idx].id_hash == hash &&
+                            m_entries[idx].id == id)
+                                return idx;
+                }
+        }
+
+        uint32_t
+        peers::lookup_addr(const _addr &addr, uint32_t hash)
+        {
+                uint32_t mask, i;
+
+                if (m_addr_index.empty())
+                        return npos;
 
-                        n1 = boost::get<in_ptr>(saddr);
-                        n2 = boost::get<in_ptr>(rhs.saddr);
+                mask = m_addr_index.size() - 1;
 
-                        return (n1->sin_port == n2->sin_port &&
-                                n1->sin_addr.s_addr == n2->sin_addr.s_addr);
-                } else if (domain == domain_inet6) {
-                        in6_ptr n1, n2;
+                for (i = hash & mask;; i = (i + 1) & mask) {
+                        uint32_t idx = m_addr_index[i];
 
-                        n1 = boost::get<in6_ptr>(saddr);
-                        n2 = boost::get<in6_ptr>(rhs.saddr);
+                        if (idx == npos)
+                                return npos;
 
-                        return (n1->sin6_port == n2->sin6_port &&
-                                memcmp(&n1->sin6_addr, &n2->sin6_addr,
-                                       sizeof(in6_addr)) == 0);
+                        if (m_entries[idx].addr_hash == hash &&
+                            m_entries[idx].addr == addr)
+                                return idx;
                 }
+        }
+
+        uint32_t
+        peers::find_id(const uint160_t &id)
+        {
+                uint32_t idx;
 
-                throw "must not reach";
+                idx = lookup_id(id);
+                if (idx != npos && expire(idx, time(NULL)))
+                        return npos;
 
-                return false;
+                return idx;
         }
 
         bool
-        peers::_addr::operator< (const peers::_addr &rhs) const
+        peers::expire(uint32_t idx, time_t now)
         {
-                if (domain != rhs.domain) {
-                        return domain < rhs.domain;
-                } else if (domain == domain_inet) {
-                        in_ptr n1, n2;
+                if (now - m_entries[idx].t <= map_ttl)
+                        return false;
+
+                remove_entry(idx);
+
+                return true;
+        }
+
+        void
+        peers::index_grow(std::vector<uint32_t> &index, bool is_id)
+        {
+                std::vector<uint32_t> old;
+                uint32_t mask;
+
+                old.swap(index);
+
+                index.resize(old.empty() ? 64 : old.size() * 2, npos);
+                mask = index.size() - 1;
+
+                BOOST_FOREACH(uint32_t idx, old) {
+                        uint32_t i;
 
-                        n1 = boost::get<in_ptr>(saddr);
-                        n2 = boost::get<in_ptr>(rhs.saddr);
+                        if (idx == npos)
+                                continue;
 
-                        if (n1->sin_addr.s_addr != n2->sin_addr.s_addr) {
-                                return n1->sin_addr.s_addr <
-                                        n2->sin_addr.s_addr;
-                        } else {
-                                return n1->sin_port < n2->sin_port;
+                        i = is_id ? m_entries[idx].id_hash :
+                                    m_entries[idx].addr_hash;
+
+                        for (i &= mask; index[i] != npos; i = (i + 1) & mask);
+
+                        index[i] = idx;
+                }
+        }
+
+        void
+        peers::index_insert(std::vector<uint32_t> &index, uint32_t hash,
+                            uint32_t idx, bool is_id)
+        {
+                uint32_t num = is_id ? m_num : m_num_addr;
+                uint32_t mask, i;
+
+                // keep the load factor at most 1/2
+                if ((num + 1) * 2 > index.size())
+                        index_grow(index, is_id);
+
+                mask = index.size() - 1;
+
+                for (i = hash & mask; index[i] != npos; i = (i + 1) & mask);
+
+                index[i] = idx;
+        }
+
+        void
+        peers::index_erase(std::vector<uint32_t> &index, uint32_t hash,
+                           uint32_t idx, bool is_id)
+        {
+                uint32_t mask = index.size() - 1;
+                uint32_t i, j;
+
+                for (i = hash & mask; index[i] != idx; i = (i + 1) & mask) {
+                        if (index[i] == npos)
+                                return;
+                }
+
+                // shift back the following entries instead of leaving
+                // a tombstone
+                for (j = (i + 1) & mask; index[j] != npos;
+                     j = (j + 1) & mask) {
+                        uint32_t k;
+
+                        k = is_id ? m_entries[index[j]].id_hash :
+                                    m_entries[index[j]].addr_hash;
+                        k &= mask;
+
+                        // skip if the home slot k is cyclically in (i, j]
+                        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                                continue;
+
+                        index[i] = index[j];
+                        i = j;
+                }
+
+                index[i] = npos;
+        }
+
+        void
+        peers::link_addr(uint32_t idx)
+        {
+                entry   &e = m_entries[idx];
+                uint32_t head;
+
+                e.addr_hash = hash_addr(e.addr);
+
+                head = lookup_addr(e.addr, e.addr_hash);
+                if (head == npos) {
+                        e.addr_next = npos;
+                        index_insert(m_addr_index, e.addr_hash, idx, false);
+                        m_num_addr++;
+                } else {
+                        e.addr_next = m_entries[head].addr_next;
+                        m_entries[head].addr_next = idx;
+                }
+        }
+
+        void
+        peers::unlink_addr(uint32_t idx)
+        {
+                entry   &e = m_entries[idx];
+                uint32_t head;
+
+                head = lookup_addr(e.addr, e.addr_hash);
+                if (head == npos)
+                        return;
+
+                if (head == idx) {
+                        index_erase(m_addr_index, e.addr_hash, idx, false);
+                        m_num_addr--;
+
+                        if (e.addr_next != npos) {
+                                index_insert(m_addr_index, e.addr_hash,
+                                             e.addr_next, false);
+                                m_num_addr++;
                         }
-                } else if (domain == domain_inet6) {
-                        in6_ptr n1, n2;
+                } else {
+                        uint32_t prev = head;
 
-                        n1 = boost::get<in6_ptr>(saddr);
-                        n2 = boost::get<in6_ptr>(rhs.saddr);
+                        while (m_entries[prev].addr_next != idx) {
+                                prev = m_entries[prev].addr_next;
+                                if (prev == npos)
+                                        return;
+                        }
 
-                        int r;
-                        r = memcmp(&n1->sin6_addr, &n2->sin6_addr,
-                                   sizeof(in6_addr));
+                        m_entries[prev].addr_next = e.addr_next;
+                }
 
-                        if (r < 0) {
-                                return true;
-                        } else if (r > 0) {
-                                return false;
-                        } else {
-                                return n1->sin6_port < n2->sin6_port;
+                e.addr_next = npos;
+        }
+
+        void
+        peers::set_entry_addr(uint32_t idx, const _addr &addr)
+        {
+                if (m_entries[idx].addr == addr)
+                        return;
+
+                unlink_addr(idx);
+                m_entries[idx].addr = addr;
+                m_entries[idx].mtu  = 0;
+                link_addr(idx);
+        }
+
+        uint32_t
+        peers::new_entry()
+        {
+                uint32_t idx;
+
+                // full. drop the entry under the clock hand
+                if (m_num >= entries_max) {
+                        for (;;) {
+                                m_hand = (m_hand + 1) % m_entries.size();
+                                if (m_entries[m_hand].is_used)
+                                        break;
                         }
+
+                        remove_entry(m_hand);
                 }
 
-                throw "must not reach";
+                if (m_free.empty()) {
+                        idx = m_entries.size();
+                        m_entries.push_back(entry());
+                } else {
+                        idx = m_free.back();
+                        m_free.pop_back();
+                }
 
-                return false;
+                return idx;
         }
 
-        peers::peers(rand_real &drnd, timer &t) :
-                m_drnd(drnd),
-                m_timer(t),
-                m_timer_func(*this),
-                m_is_callback(false)
+        uint32_t
+        peers::add_entry(const uint160_t &id, const _addr &addr,
+                         uint32_t session)
         {
+                uint32_t idx = new_entry();
+
+                entry &e = m_entries[idx];
+
+                e.id      = id;
+                e.id_hash = hash_id(e.id);
+                e.addr    = addr;
+                e.t       = time(NULL);
+                e.session = session;
+                e.mtu     = 0;
+                e.is_used = true;
 
+                index_insert(m_id_index, e.id_hash, idx, true);
+                m_num++;
+
+                link_addr(idx);
+
+                return idx;
         }
 
         void
-        peers::set_callback(callback func)
+        peers::remove_entry(uint32_t idx)
         {
-                m_is_callback = true;
-                m_callback = func;
+                entry &e = m_entries[idx];
+
+                unlink_addr(idx);
+                index_erase(m_id_index, e.id_hash, idx, true);
+
+                e.is_used = false;
+                m_num--;
+
+                m_free.push_back(idx);
         }
 
         cageaddr
         peers::get_addr(id_ptr id)
         {
                 cageaddr addr;
-                _addr    a;
-                __id     i;
 
-                i.id = id;
+                if (! find_addr(id, addr))
+                        throw std::out_of_range("no such ID");
 
-                // throws std::out_of_range
-                a = m_map.left.at(i);
+                return addr;
+        }
 
-                addr.domain = a.domain;
-                addr.saddr  = a.saddr;
-                addr.id     = id;
+        bool
+        peers::find_addr(id_ptr id, cageaddr &addr)
+        {
+                uint32_t idx;
 
-                return addr;
+                idx = find_id(*id);
+                if (idx == npos)
+                        return false;
+
+                addr.id = id;
+                to_cageaddr(m_entries[idx], addr);
+
+                return true;
+        }
+
+        uint16_t
+        peers::get_mtu(id_ptr id)
+        {
+                uint32_t idx;
+
+                idx = find_id(*id);
+                if (idx == npos)
+                        return 0;
+
+                return m_entries[idx].mtu;
+        }
+
+        void
+        peers::set_mtu(id_ptr id, uint16_t mtu)
+        {
+                uint32_t idx;
+
+                idx = find_id(*id);
+                if (idx != npos)
+                        m_entries[idx].mtu = mtu;
         }
 
         void
         peers::get_id(cageaddr &addr, std::vector<id_ptr> &id)
         {
-                // _bimap_its its;
-                _addr      a;
-                __id       i;
+                time_t   now = time(NULL);
+                _addr    a;
+                uint32_t idx, next;
+
+                if (! to_addr(addr, a))
+                        return;
 
-                a.domain = addr.domain;
-                a.saddr  = addr.saddr;
+                idx = lookup_addr(a, hash_addr(a));
+                for (; idx != npos; idx = next) {
+                        next = m_entries[idx].addr_next;
 
-                BOOST_FOREACH(_bimap::right_reference rp,
-                              m_map.right.equal_range(a)) {
-                        id.push_back(rp.second.id);
+                        if (! expire(idx, now))
+                                id.push_back(id_ptr(new uint160_t(
+                                        m_entries[idx].id)));
                 }
         }
 
         void
         peers::remove_id(id_ptr id)
         {
-                __id  i;
-
-                i.id = id;
-                i.t  = 0;
-                i.session = 0;
+                uint32_t idx;
 
-                m_map.left.erase(i);
+                idx = lookup_id(*id);
+                if (idx != npos)
+                        remove_entry(idx);
         }
 
         void
         peers::remove_addr(cageaddr &addr)
         {
-                _addr a;
-                
-                a.domain = addr.domain;
-                a.saddr  = addr.saddr;
+                _addr    a;
+                uint32_t hash;
+                uint32_t idx;
 
-                m_map.right.erase(a);
+                if (! to_addr(addr, a))
+                        return;
+
+                hash = hash_addr(a);
+
+                while ((idx = lookup_addr(a, hash)) != npos)
+                        remove_entry(idx);
         }
 
         void
@@ -197,77 +529,54 @@ namespace libcage {
         bool
         peers::add_node(cageaddr &addr, uint32_t session)
         {
-                __id  i;
+                uint32_t idx;
+                _addr    a;
 
-                if (addr.domain != domain_inet && addr.domain == domain_inet6)
+                if (! to_addr(addr, a))
                         return false;
 
-                i.id      = addr.id;
-                i.t       = time(NULL);
-                i.session = session;
+                idx = find_id(*addr.id);
 
-                _bimap::left_iterator it = m_map.left.find(i);
+                if (idx != npos) {
+                        entry &e = m_entries[idx];
 
-                if (it != m_map.left.end()) {
-                        if (it->first.session == session ||
-                            it->first.session == 0) {
-                                _addr a;
-                                a.domain = addr.domain;
-                                a.saddr  = addr.saddr;
-                                m_map.insert(value_t(i, a));
-                                m_timeout.erase(i);
-
-                                m_callback(addr);
-
-                                return true;
-                        } else {
-                                _addr a1, a2;
-                                a1 = m_map.left.at(i);
-                                a2.domain = addr.domain;
-                                a2.saddr  = addr.saddr;
-
-                                if (a1 == a2) {
-                                        // update time
-                                        it->first.t = i.t;
-                                        m_timeout.erase(i);
-
-                                        m_callback(addr);
-
-                                        return true;
-                                }
+                        if (e.session == session || e.session == 0) {
+                                e.session = session;
+                                set_entry_addr(idx, a);
+                        } else if (! (e.addr == a)) {
+                                return false;
                         }
+
+                        // update time
+                        e.t = time(NULL);
                 } else {
-                        _addr a;
-                        a.domain = addr.domain;
-                        a.saddr  = addr.saddr;
-                        m_map.insert(value_t(i, a));
-                        m_timeout.erase(i);
+                        add_entry(*addr.id, a, session);
+                }
 
-                        m_callback(addr);
+                m_timeout.erase(*addr.id);
 
-                        return true;
-                }
+                m_callback(addr);
 
-                return false;
+                return true;
         }
 
         void
         peers::add_node_force(cageaddr &addr)
         {
-                _addr a;
-                __id  i;
+                uint32_t idx;
+                _addr    a;
 
-                if (addr.domain != domain_inet && addr.domain != domain_inet6)
+                if (! to_addr(addr, a))
                         return;
 
-                a.domain = addr.domain;
-                a.saddr  = addr.saddr;
-
-                i.id      = addr.id;
-                i.t       = time(NULL);
-                i.session = 0;
-
-                m_map.insert(value_t(i, a));
+                idx = find_id(*addr.id);
+                if (idx != npos) {
+                        m_entries[idx].session = 0;
+                        set_entry_addr(idx, a);
+                        m_entries[idx].t = time(NULL);
+                } else {
+                        add_entry(*addr.id, a, 0);
+                }
 
                 m_callback(addr);
         }
@@ -275,103 +584,105 @@ namespace libcage {
         void
         peers::refresh()
         {
-                time_t now = time(NULL);
+                time_t   now = time(NULL);
+                uint32_t n;
 
-                boost::unordered_set<__id>::iterator it1;
-                for (it1 = m_timeout.begin(); it1 != m_timeout.end();) {
-                        time_t diff = now - it1->t;
+                while (! m_timeout_queue.empty()) {
+                        std::pair<time_t, uint160_t> &front =
+                                m_timeout_queue.front();
+                        boost::unordered_map<uint160_t, time_t>::iterator it;
 
-                        if (diff > timeout_ttl) {
-                                m_timeout.erase(it1++);
-                        } else {
-                                ++it1;
-                        }
+                        if (now - front.first <= timeout_ttl)
+                                break;
+
+                        it = m_timeout.find(front.second);
+                        if (it != m_timeout.end() && it->second == front.first)
+                                m_timeout.erase(it);
+
+                        m_timeout_queue.pop_front();
                 }
 
 
-                _bimap::left_iterator it2;
-                for (it2 = m_map.left.begin(); it2 != m_map.left.end();) {
-                        time_t diff = now - it2->first.t;
+                // visit all the entries once in map_ttl
+                n = m_entries.size() / (map_ttl / timer_interval) + sweep_min;
+                if (n > m_entries.size())
+                        n = m_entries.size();
 
-                        if (diff > map_ttl) {
-                                m_map.left.erase(it2++);
-                        } else {
-                                ++it2;
-                        }
+                for (; n > 0; n--) {
+                        m_hand = (m_hand + 1) % m_entries.size();
+
+                        if (m_entries[m_hand].is_used)
+                                expire(m_hand, now);
                 }
         }
 
         void
         peers::add_timeout(id_ptr id)
         {
-                __id i;
-
-                i.t  = time(NULL);
-                i.id = id;
+                time_t now = time(NULL);
 
-                if (m_timeout.find(i) == m_timeout.end())
+                if (m_timeout.find(*id) != m_timeout.end())
                         return;
 
-                m_timeout.insert(i);
-                m_map.left.erase(i);
+                m_timeout[*id] = now;
+                m_timeout_queue.push_back(std::make_pair(now, *id));
+
+                remove_id(id);
         }
 
         bool
         peers::is_timeout(id_ptr id)
         {
-                __id i;
-
-                i.id = id;
+                boost::unordered_map<uint160_t, time_t>::iterator it;
 
-                if (m_timeout.find(i) == m_timeout.end())
+                it = m_timeout.find(*id);
+                if (it == m_timeout.end())
                         return false;
 
-                return true;
+                return time(NULL) - it->second <= timeout_ttl;
         }
 
         cageaddr
         peers::get_first()
         {
-                if (m_map.size() == 0)
-                        throw std::out_of_range("no element");
+                time_t now = time(NULL);
 
-                cageaddr addr;
+                for (uint32_t i = 0; i < m_entries.size(); i++) {
+                        if (m_entries[i].is_used &&
+                            now - m_entries[i].t <= map_ttl) {
+                                cageaddr addr;
 
-                _bimap::left_iterator it;
-                it = m_map.left.begin();
+                                to_cageaddr(m_entries[i], addr);
 
-                addr.id     = it->first.id;
-                addr.domain = it->second.domain;
-                addr.saddr  = it->second.saddr;
+                                return addr;
+                        }
+                }
 
-                return addr;
+                throw std::out_of_range("no element");
         }
 
         cageaddr
         peers::get_next(id_ptr id)
         {
-                cageaddr addr;
-                __id     i;
+                time_t   now = time(NULL);
+                uint32_t idx;
 
-                i.id = id;
-                i.t  = 0;
-                i.session = 0;
-
-                _bimap::left_iterator it;
-                it = m_map.left.find(i);
-
-                if (it == m_map.left.end())
+                idx = lookup_id(*id);
+                if (idx == npos)
                         throw std::out_of_range("no element");
 
-                ++it;
-                if (it == m_map.left.end())
-                        throw std::out_of_range("no more element");
+                for (uint32_t i = idx + 1; i < m_entries.size(); i++) {
+                        if (m_entries[i].is_used &&
+                            now - m_entries[i].t <= map_ttl) {
+                                cageaddr addr;
 
-                addr.id     = it->first.id;
-                addr.domain = it->second.domain;
-                addr.saddr  = it->second.saddr;
+                                to_cageaddr(m_entries[i], addr);
 
-                return addr;
+                                return addr;
+                        }
+                }
+
+                throw std::out_of_range("no more element");
         }
 
 
@@ -37,21 +37,29 @@
 #include "cagetypes.hpp"
 #include "timer.hpp"
 
+#include <deque>
+#include <utility>
 #include <vector>
 
-#include <boost/bimap/bimap.hpp>
-#include <boost/bimap/multiset_of.hpp>
-#include <boost/bimap/unordered_set_of.hpp> 
 #include <boost/function.hpp>
 #include <boost/random.hpp>
-#include <boost/unordered_set.hpp> 
+#include <boost/unordered_map.hpp>
 
 namespace libcage {
+        // the table of IDs and addresses of the nodes recently seen.
+        //
+        // the entries hold IDs and addresses inline and are indexed by
+        // two open addressing tables, one by ID and one by address.
+        // entries are expired when looked up and by a clock hand
+        // which visits a part of them at each timer event
         class peers {
         private:
                 static const time_t     timeout_ttl;
                 static const time_t     map_ttl;
                 static const time_t     timer_interval;
+                static const uint32_t   entries_max;
+                static const uint32_t   sweep_min;
+                static const uint32_t   npos;
 
 
                 typedef boost::function<void (cageaddr &addr)> callback;
@@ -93,40 +101,37 @@ namespace libcage {
 
                 friend class    timer_func;
 
-                class __id {
-                public:
-                        id_ptr          id;
-                        mutable time_t  t;
-                        uint32_t        session;
-
-                        bool operator== (const __id &rhs) const
-                        {
-                                return *id == *rhs.id;
-                        }
-                };
-                
-                friend size_t hash_value(const __id &i);
-
-                class _addr : private boost::totally_ordered<_addr> {
+                class _addr {
                 public:
                         uint16_t        domain;
-                        boost::variant<in_ptr, in6_ptr> saddr;
+                        uint16_t        port;
+                        uint32_t        addr[4]; // addr[0] for IPv4
 
                         bool operator== (const _addr &rhs) const;
-                        bool operator< (const _addr &rhs) const;
                 };
 
-                typedef boost::bimaps::multiset_of<_addr>       _addr_set;
-                typedef boost::bimaps::unordered_set_of<__id>   __id_set;
-                typedef boost::bimaps::bimap<__id_set,
-                                             _addr_set>::value_type value_t;
-                typedef boost::bimaps::bimap<__id_set, _addr_set>       _bimap;
+                class entry {
+                public:
+                        uint160_t       id;
+                        _addr           addr;
+                        time_t          t;
+                        uint32_t        session;
+                        uint32_t        id_hash;
+                        uint32_t        addr_hash;
+                        uint32_t        addr_next; // the same address
+                        uint16_t        mtu;
+                        bool            is_used;
+                };
 
         public:
                 peers(rand_real &drnd, timer &t);
 
                 // throws std::out_of_range
                 cageaddr        get_addr(id_ptr id);
+
+                // same as get_addr() but returns false when id is unknown,
+                // which is the common case for the first contact
+                bool            find_addr(id_ptr id, cageaddr &addr);
                 cageaddr        get_first();
                 cageaddr        get_next(id_ptr id);
 
@@ -146,11 +151,58 @@ namespace libcage {
 
                 void            set_callback(callback func);
 
+                uint32_t        get_size() const { return m_num; }
+
+                // the largest UDP payload known to reach the node without
+                // fragmentation, or 0 if unknown. it is forgotten when the
+                // address of the node changes
+                uint16_t        get_mtu(id_ptr id);
+                void            set_mtu(id_ptr id, uint16_t mtu);
+
         private:
+                static bool     to_addr(const cageaddr &caddr, _addr &addr);
+                static uint32_t hash_id(const uint160_t &id);
+                static uint32_t hash_addr(const _addr &addr);
+
+                void            to_cageaddr(const entry &e, cageaddr &caddr);
+
+                uint32_t        lookup_id(const uint160_t &id);
+                uint32_t        lookup_addr(const _addr &addr, uint32_t hash);
+
+                // expired entries are removed and treated as misses
+                uint32_t        find_id(const uint160_t &id);
+                bool            expire(uint32_t idx, time_t now);
+
+                uint32_t        new_entry();
+                uint32_t        add_entry(const uint160_t &id,
+                                          const _addr &addr,
+                                          uint32_t session);
+                void            remove_entry(uint32_t idx);
+                void            link_addr(uint32_t idx);
+                void            unlink_addr(uint32_t idx);
+                void            set_entry_addr(uint32_t idx, const _addr &addr);
+
+                void            index_insert(std::vector<uint32_t> &index,
+                                             uint32_t hash, uint32_t idx,
+                                             bool is_id);
+                void            index_erase(std::vector<uint32_t> &index,
+                                            uint32_t hash, uint32_t idx,
+                                            bool is_id);
+                void            index_grow(std::vector<uint32_t> &index,
+                                           bool is_id);
+
                 rand_real      &m_drnd;
 
-                _bimap          m_map;
-                boost::unordered_set<__id>       m_timeout;
+                std::vector<entry>      m_entries;
+                std::vector<uint32_t>   m_free;
+                std::vector<uint32_t>   m_id_index;
+                std::vector<uint32_t>   m_addr_index; // the first entries
+                uint32_t                m_num;
+                uint32_t                m_num_addr;
+                uint32_t                m_hand;
+
+                boost::unordered_map<uint160_t, time_t>         m_timeout;
+                std::deque<std::pair<time_t, uint160_t> >       m_timeout_queue;
 
                 timer           m_timer;
                 timer_func      m_timer_func;
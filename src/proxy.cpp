@@ -43,6 +43,7 @@ namespace libcage {
         const time_t    proxy::get_timeout          = 10;
         const time_t    proxy::timer_interval       = 30;
         const time_t    proxy::rdp_timeout          = 30;
+        const time_t    proxy::rdp_pool_idle        = 20;
         const uint16_t  proxy::proxy_store_port     = 200;
         const uint16_t  proxy::proxy_get_port       = 201;
         const uint16_t  proxy::proxy_get_reply_port = 202;
@@ -122,6 +123,17 @@ namespace libcage {
                 for (it7 = m_rdp_get_reply.begin();
                      it7 != m_rdp_get_reply.end(); ++it7)
                         m_rdp.close(it7->first);
+
+                if (m_store_pool)
+                        m_rdp.close(m_store_pool->desc);
+
+                if (m_get_pool)
+                        m_rdp.close(m_get_pool->desc);
+
+                std::map<int, rdp_get_reply_pool_ptr>::iterator it8;
+                for (it8 = m_reply_pool_desc.begin();
+                     it8 != m_reply_pool_desc.end(); ++it8)
+                        m_rdp.close(it8->first);
         }
 
         void
@@ -180,7 +192,7 @@ namespace libcage {
                 std::map<int, rdp_recv_get_reply_ptr>::iterator it5;
                 for (it5 = m_rdp_recv_get_reply.begin();
                      it5 != m_rdp_recv_get_reply.end(); ) {
-                        diff = it5->second->m_time;
+                        diff = now - it5->second->m_time;
                         if (diff > rdp_timeout) {
                                 m_rdp.close(it5->first);
 
@@ -191,7 +203,7 @@ namespace libcage {
                                         std::map<uint32_t, gd_ptr>::iterator it;
 
                                         it = m_getdata.find(it5->second->m_nonce);
-                                        if (it == m_getdata.end()) {
+                                        if (it != m_getdata.end()) {
                                                 if (it->second->vset->size() > 0)
                                                         it->second->func(true, it->second->vset);
                                                 else
@@ -209,6 +221,43 @@ namespace libcage {
                         }
                         ++it5;
                 }
+
+                bool is_idle;
+
+                if (m_store_pool) {
+                        diff    = now - m_store_pool->last_time;
+                        is_idle = m_store_pool->sent.empty() &&
+                                  m_store_pool->queued.empty();
+
+                        if ((is_idle && diff > rdp_pool_idle) ||
+                            diff > rdp_timeout)
+                                close_store_pool();
+                }
+
+                if (m_get_pool) {
+                        diff    = now - m_get_pool->last_time;
+                        is_idle = m_get_pool->sent.empty() &&
+                                  m_get_pool->queued.empty();
+
+                        if ((is_idle && diff > rdp_pool_idle) ||
+                            diff > rdp_timeout)
+                                close_get_pool();
+                }
+
+                std::map<int, rdp_get_reply_pool_ptr>::iterator it6;
+                for (it6 = m_reply_pool_desc.begin();
+                     it6 != m_reply_pool_desc.end(); ) {
+                        rdp_get_reply_pool_ptr pool = it6->second;
+
+                        ++it6;
+
+                        diff    = now - pool->last_time;
+                        is_idle = ! pool->current && pool->queued.empty();
+
+                        if ((is_idle && diff > rdp_pool_idle) ||
+                            diff > rdp_timeout)
+                                close_reply_pool(pool);
+                }
         }
 
         void
@@ -369,13 +418,79 @@ namespace libcage {
                             uint16_t keylen, const void *value,
                             uint16_t valuelen, uint16_t ttl, bool is_unique)
         {
-                rdp_store_func func(*this);
-                int            desc;
+                rdp_store_func_ptr func(new rdp_store_func(*this));
 
-                create_store_func(func, id, key, keylen, value, valuelen, ttl,
+                create_store_func(*func, id, key, keylen, value, valuelen, ttl,
                                   is_unique);
 
-                desc = m_rdp.connect(0, m_server.id, proxy_store_port, func);
+                store_pool(func);
+        }
+
+        void
+        proxy::store_pool(rdp_store_func_ptr func)
+        {
+                // the proxy changes when this node registers again
+                if (m_store_pool && *m_store_pool->dst != *m_server.id)
+                        close_store_pool();
+
+                if (! m_store_pool) {
+                        rdp_store_pool_func pfunc(*this);
+                        int desc;
+
+                        desc = m_rdp.connect(0, m_server.id, proxy_store_port,
+                                             pfunc);
+                        if (desc <= 0)
+                                return;
+
+                        m_store_pool = rdp_store_pool_ptr(new rdp_store_pool);
+
+                        m_store_pool->desc = desc;
+                        m_store_pool->dst  = m_server.id;
+                }
+
+                m_store_pool->queued.push_back(func);
+
+                send_store_pool();
+        }
+
+        void
+        proxy::send_store_pool()
+        {
+                if (! m_store_pool->is_connected)
+                        return;
+
+                while (! m_store_pool->queued.empty()) {
+                        // wait for the first acknowledgement, since the
+                        // proxy may close the connection after a value
+                        if (! m_store_pool->is_keep &&
+                            ! m_store_pool->sent.empty())
+                                return;
+
+                        rdp_store_func_ptr func = m_store_pool->queued.front();
+
+                        func->send_store(m_store_pool->desc, dht_flag_keep);
+
+                        m_store_pool->sent.push_back(func);
+                        m_store_pool->queued.pop_front();
+                        m_store_pool->last_time = time(NULL);
+                }
+        }
+
+        void
+        proxy::close_store_pool()
+        {
+                m_rdp.close(m_store_pool->desc);
+                m_store_pool.reset();
+        }
+
+        void
+        proxy::connect_store(rdp_store_func_ptr func)
+        {
+                int desc;
+
+                desc = m_rdp.connect(0, m_server.id, proxy_store_port, *func);
+                if (desc <= 0)
+                        return;
 
                 m_rdp_store[desc] = time(NULL);
         }
@@ -410,6 +525,9 @@ namespace libcage {
                      const void *value, uint16_t valuelen, uint16_t ttl,
                      bool is_unique)
         {
+                // values are sent plain, since this node cannot tell
+                // whether the proxy accepts compressed ones. the proxy
+                // compresses them when it is configured to
                 if (! m_is_registered) {
                         if (m_nat.get_state() == node_symmetric) {
                                 register_node();
@@ -453,7 +571,7 @@ namespace libcage {
                 store->ttl      = htons(ttl);
 
                 if (is_unique)
-                        store->flags = dht_flag_unique;
+                        store->flags |= dht_flag_unique;
 
                 p_value = (char*)store->data;
                 p_value += keylen;
@@ -466,13 +584,15 @@ namespace libcage {
         }
 
         void
-        proxy::recv_store(void *msg, int len, sockaddr *from)
+        proxy::recv_store(void *msg, int len, sockaddr *from,
+                          packetbuf_ptr pbuf)
         {
                 msg_proxy_store *store;
                 uint160_t dst;
                 uint16_t  keylen;
                 uint16_t  valuelen;
                 bool      is_unique = false;
+                bool      is_compressed = false;
                 int       size;
 
                 store = (msg_proxy_store*)msg;
@@ -491,8 +611,7 @@ namespace libcage {
                         return;
 
 
-                boost::shared_array<char> key(new char[keylen]);
-                boost::shared_array<char> value(new char[valuelen]);
+                boost::shared_array<char> key, value;
                 id_ptr    id(new uint160_t);
                 id_ptr    src(new uint160_t);
                 char     *p_value;
@@ -507,20 +626,34 @@ namespace libcage {
                 if (store->flags & dht_flag_unique)
                         is_unique = true;
 
+                if (store->flags & dht_flag_compressed)
+                        is_compressed = true;
+
                 p_value  = (char*)store->data;
                 p_value += keylen;
 
-                memcpy(key.get(), store->data, keylen);
-                memcpy(value.get(), &store->data[keylen], valuelen);
+                key   = pbuf_slice(pbuf, store->data, keylen);
+                value = pbuf_slice(pbuf, p_value, valuelen);
 
                 m_dht.store(id, key, keylen, value, valuelen,
-                            ntohs(store->ttl), src, is_unique);
+                            ntohs(store->ttl), src, is_unique, is_compressed);
         }
 
 
         void
         proxy::rdp_recv_get_reply_func::close_rdp(int desc,
                                                   rdp_recv_get_reply_ptr ptr)
+        {
+                // a kept connection is closed between the replies
+                if (ptr->m_state != rdp_recv_get_reply::RGR_HDR)
+                        done(ptr);
+
+                m_proxy.m_rdp.close(desc);
+                m_proxy.m_rdp_recv_get_reply.erase(desc);
+        }
+
+        void
+        proxy::rdp_recv_get_reply_func::done(rdp_recv_get_reply_ptr ptr)
         {
                 std::map<uint32_t, gd_ptr>::iterator it;
 
@@ -534,9 +667,6 @@ namespace libcage {
                         m_proxy.m_timer.unset_timer(&it->second->timeout);
                         m_proxy.m_getdata.erase(ptr->m_nonce);
                 }
-
-                m_proxy.m_rdp.close(desc);
-                m_proxy.m_rdp_recv_get_reply.erase(desc);
         }
 
         bool
@@ -555,8 +685,12 @@ namespace libcage {
                 std::map<uint32_t, gd_ptr>::iterator it;
                 uint32_t nonce = ntohl(msg.nonce);
 
+                ptr->m_is_keep = (msg.flags & dht_flag_keep) != 0;
+
+                // the values of a timed out get are skipped on a kept
+                // connection
                 it = m_proxy.m_getdata.find(nonce);
-                if (it == m_proxy.m_getdata.end()) {
+                if (it == m_proxy.m_getdata.end() && ! ptr->m_is_keep) {
                         m_proxy.m_rdp.close(desc);
                         m_proxy.m_rdp_recv_get_reply.erase(desc);
                         return false;
@@ -567,6 +701,12 @@ namespace libcage {
                 ptr->m_state = rdp_recv_get_reply::RGR_VAL_HDR;
 
                 if (msg.flag == proxy_get_fail) {
+                        if (ptr->m_is_keep) {
+                                done(ptr);
+                                ptr->m_state = rdp_recv_get_reply::RGR_HDR;
+                                return true;
+                        }
+
                         close_rdp(desc, ptr);
                         return false;
                 }
@@ -584,7 +724,7 @@ namespace libcage {
                 std::map<uint32_t, gd_ptr>::iterator it;
 
                 it = m_proxy.m_getdata.find(ptr->m_nonce);
-                if (it == m_proxy.m_getdata.end()) {
+                if (it == m_proxy.m_getdata.end() && ! ptr->m_is_keep) {
                         m_proxy.m_rdp.close(desc);
                         m_proxy.m_rdp_recv_get_reply.erase(desc);
                         return false;
@@ -599,6 +739,14 @@ namespace libcage {
                 if (size == 0)
                         return false;
 
+                if (ptr->m_is_keep && (msg.flags & dht_flag_keep)) {
+                        // the end of the values
+                        done(ptr);
+                        ptr->m_state = rdp_recv_get_reply::RGR_HDR;
+                        ptr->m_time  = time(NULL);
+                        return true;
+                }
+
                 ptr->m_valuelen = ntohs(msg.valuelen);
                 ptr->m_val_read = 0;
                 ptr->m_state    = rdp_recv_get_reply::RGR_VAL;
@@ -617,7 +765,7 @@ namespace libcage {
                 std::map<uint32_t, gd_ptr>::iterator it;
 
                 it = m_proxy.m_getdata.find(ptr->m_nonce);
-                if (it == m_proxy.m_getdata.end()) {
+                if (it == m_proxy.m_getdata.end() && ! ptr->m_is_keep) {
                         m_proxy.m_rdp.close(desc);
                         m_proxy.m_rdp_recv_get_reply.erase(desc);
                         return false;
@@ -636,13 +784,14 @@ namespace libcage {
                         ptr->m_val_read += size;
                         ptr->m_time      = time(NULL);
 
-                        if (ptr->m_val_read += ptr->m_valuelen) {
+                        if (ptr->m_val_read == ptr->m_valuelen) {
                                 dht::value_t v;
 
                                 v.value = ptr->m_val;
                                 v.len   = ptr->m_valuelen;
 
-                                it->second->vset->insert(v);
+                                if (it != m_proxy.m_getdata.end())
+                                        it->second->vset->insert(v);
 
 
                                 ptr->m_val_read = 0;
@@ -793,6 +942,8 @@ namespace libcage {
 
                         break;
                 }
+                case WRITABLE:
+                        break;
                 default:
                         m_proxy.m_rdp.close(desc);
                         m_proxy.m_rdp_get_reply.erase(desc);
@@ -811,12 +962,177 @@ namespace libcage {
                 func.m_nonce  = nonce;
                 func.m_id     = id;
 
+                if (is_keep) {
+                        rdp_get_reply_func_ptr p(new rdp_get_reply_func(func));
+
+                        p_proxy->reply_pool(p, src);
+                        return;
+                }
+
                 desc = p_proxy->m_rdp.connect(0, src, proxy_get_reply_port,
                                               func);
 
                 p_proxy->m_rdp_get_reply[desc] = time(NULL);
         }
 
+        void
+        proxy::reply_pool(rdp_get_reply_func_ptr func, id_ptr dst)
+        {
+                std::map<_id, rdp_get_reply_pool_ptr>::iterator it;
+                rdp_get_reply_pool_ptr pool;
+                _id i;
+
+                i.id = dst;
+
+                it = m_reply_pool.find(i);
+                if (it == m_reply_pool.end()) {
+                        rdp_get_reply_pool_func pfunc(*this);
+                        int desc;
+
+                        desc = m_rdp.connect(0, dst, proxy_get_reply_port,
+                                             pfunc);
+                        if (desc <= 0)
+                                return;
+
+                        pool = rdp_get_reply_pool_ptr(new rdp_get_reply_pool);
+
+                        pool->desc = desc;
+                        pool->dst  = dst;
+
+                        m_reply_pool[i]         = pool;
+                        m_reply_pool_desc[desc] = pool;
+                } else {
+                        pool = it->second;
+                }
+
+                pool->queued.push_back(func);
+
+                send_reply_pool(pool);
+        }
+
+        void
+        proxy::send_reply_pool(rdp_get_reply_pool_ptr pool)
+        {
+                if (! pool->is_connected)
+                        return;
+
+                while (! pool->current && ! pool->queued.empty()) {
+                        rdp_get_reply_func_ptr func = pool->queued.front();
+                        msg_proxy_rdp_get_reply msg;
+
+                        pool->queued.pop_front();
+                        pool->last_time = time(NULL);
+
+                        memset(&msg, 0, sizeof(msg));
+
+                        msg.nonce = htonl(func->m_nonce);
+                        msg.flags = dht_flag_keep;
+
+                        if (func->m_result)
+                                msg.flag = proxy_get_success;
+                        else
+                                msg.flag = proxy_get_fail;
+
+                        func->m_id->to_binary(msg.id, sizeof(msg.id));
+
+                        m_rdp.send(pool->desc, &msg, sizeof(msg));
+
+                        // the node asks for the values one by one
+                        if (func->m_result)
+                                pool->current = func;
+                }
+        }
+
+        void
+        proxy::close_reply_pool(rdp_get_reply_pool_ptr pool)
+        {
+                _id i;
+
+                i.id = pool->dst;
+
+                m_rdp.close(pool->desc);
+                m_reply_pool.erase(i);
+                m_reply_pool_desc.erase(pool->desc);
+        }
+
+        void
+        proxy::rdp_get_reply_pool_func::operator() (int desc, rdp_addr addr,
+                                                    rdp_event event)
+        {
+                std::map<int, rdp_get_reply_pool_ptr>::iterator it;
+
+                it = m_proxy.m_reply_pool_desc.find(desc);
+                if (it == m_proxy.m_reply_pool_desc.end()) {
+                        m_proxy.m_rdp.close(desc);
+                        return;
+                }
+
+                rdp_get_reply_pool_ptr pool = it->second;
+
+                switch (event) {
+                case CONNECTED:
+                        pool->is_connected = true;
+                        m_proxy.send_reply_pool(pool);
+                        break;
+                case READY2READ:
+                        read_op(desc, pool);
+                        break;
+                case WRITABLE:
+                        break;
+                default:
+                        // the gets of the rest time out on the node
+                        m_proxy.close_reply_pool(pool);
+                }
+        }
+
+        void
+        proxy::rdp_get_reply_pool_func::read_op(int desc,
+                                                rdp_get_reply_pool_ptr pool)
+        {
+                for (;;) {
+                        uint8_t op;
+                        int     size = sizeof(op);
+
+                        m_proxy.m_rdp.receive(desc, &op, &size);
+
+                        if (size == 0)
+                                break;
+
+                        if (op != proxy_get_next || ! pool->current) {
+                                m_proxy.close_reply_pool(pool);
+                                return;
+                        }
+
+                        msg_proxy_rdp_get_reply_val msg;
+                        dht::value_set_ptr vset = pool->current->m_vset;
+
+                        memset(&msg, 0, sizeof(msg));
+
+                        pool->last_time = time(NULL);
+
+                        if (vset->size() == 0) {
+                                // the end of the values
+                                msg.flags = dht_flag_keep;
+
+                                m_proxy.m_rdp.send(desc, &msg, sizeof(msg));
+
+                                pool->current.reset();
+                                continue;
+                        }
+
+                        dht::value_set::iterator it = vset->begin();
+
+                        msg.valuelen = htons(it->len);
+
+                        m_proxy.m_rdp.send(desc, &msg, sizeof(msg));
+                        m_proxy.m_rdp.send(desc, it->value.get(), it->len);
+
+                        vset->erase(it);
+                }
+
+                m_proxy.send_reply_pool(pool);
+        }
+
         void
         proxy::get_reply_func::send_reply(bool result, dht::value_set_ptr vset)
         {
@@ -891,6 +1207,17 @@ namespace libcage {
         void
         proxy::get_reply_func::operator() (bool result, dht::value_set_ptr vset)
         {
+                if (result) {
+                        // the proxy protocol carries 16 bits lengths
+                        dht::value_set::iterator it;
+                        for (it = vset->begin(); it != vset->end(); ) {
+                                if (it->len > 0xffff)
+                                        vset->erase(it++);
+                                else
+                                        ++it;
+                        }
+                }
+
                 if (is_rdp) {
                         send_reply_by_rdp(result, vset);
                 } else {
@@ -972,11 +1299,7 @@ namespace libcage {
 
 
                 BOOST_FOREACH(rdp_store_func_ptr func, m_store_data) {
-                        int desc;
-
-                        desc = m_rdp.connect(0, m_server.id, proxy_store_port,
-                                             *func);
-                        m_rdp_store[desc] = time(NULL);
+                        store_pool(func);
                 }
 
                 m_store_data.clear();
@@ -989,9 +1312,7 @@ namespace libcage {
                 boost::shared_array<char> p_key(new char[keylen]);
                 proxy::gd_ptr gdp(new proxy::getdata);
                 rdp_get_ptr   p_get(new rdp_get);
-                rdp_get_func  getfunc(*this);
                 id_ptr        p_id(new uint160_t);
-                int           desc;
                 uint32_t      nonce;
 
                 for (;;) {
@@ -1013,14 +1334,11 @@ namespace libcage {
                 p_get->m_data   = gdp;
 
 
-                desc = m_rdp.connect(0, m_server.id, proxy_get_port, getfunc);
-
-
                 gdp->key    = p_key;
                 gdp->keylen = keylen;
                 gdp->func   = func;
                 gdp->is_rdp = true;
-                gdp->desc   = desc;
+                gdp->desc   = 0;
 
                 gdp->timeout.p_proxy = this;
                 gdp->timeout.nonce   = nonce;
@@ -1037,9 +1355,183 @@ namespace libcage {
 
 
                 m_getdata[nonce] = gdp;
+
+                get_pool(p_get);
+        }
+
+        void
+        proxy::get_pool(rdp_get_ptr p_get)
+        {
+                // the proxy changes when this node registers again
+                if (m_get_pool && *m_get_pool->dst != *m_server.id)
+                        close_get_pool();
+
+                if (! m_get_pool) {
+                        rdp_get_pool_func pfunc(*this);
+                        int desc;
+
+                        desc = m_rdp.connect(0, m_server.id, proxy_get_port,
+                                             pfunc);
+                        if (desc <= 0)
+                                return;
+
+                        m_get_pool = rdp_get_pool_ptr(new rdp_get_pool);
+
+                        m_get_pool->desc = desc;
+                        m_get_pool->dst  = m_server.id;
+                }
+
+                m_get_pool->queued.push_back(p_get);
+
+                send_get_pool();
+        }
+
+        void
+        proxy::send_get_pool()
+        {
+                if (! m_get_pool->is_connected)
+                        return;
+
+                while (! m_get_pool->queued.empty()) {
+                        // wait for the first acknowledgement, since the
+                        // proxy may close the connection after a get
+                        if (! m_get_pool->is_keep &&
+                            ! m_get_pool->sent.empty())
+                                return;
+
+                        rdp_get_ptr p_get = m_get_pool->queued.front();
+
+                        m_get_pool->queued.pop_front();
+
+                        // timed out while queued
+                        if (m_getdata.find(p_get->m_nonce) == m_getdata.end())
+                                continue;
+
+                        send_get(m_get_pool->desc, p_get, dht_flag_keep);
+
+                        m_get_pool->sent.push_back(p_get);
+                        m_get_pool->last_time = time(NULL);
+                }
+        }
+
+        void
+        proxy::close_get_pool()
+        {
+                m_rdp.close(m_get_pool->desc);
+                m_get_pool.reset();
+        }
+
+        void
+        proxy::connect_get(rdp_get_ptr p_get)
+        {
+                std::map<uint32_t, gd_ptr>::iterator it;
+                rdp_get_func func(*this);
+                int desc;
+
+                it = m_getdata.find(p_get->m_nonce);
+                if (it == m_getdata.end())
+                        return;
+
+                desc = m_rdp.connect(0, m_server.id, proxy_get_port, func);
+                if (desc <= 0)
+                        return;
+
+                it->second->desc = desc;
                 m_rdp_get[desc]  = p_get;
         }
 
+        void
+        proxy::send_get(int desc, rdp_get_ptr p_get, uint8_t flags)
+        {
+                msg_proxy_rdp_get msg;
+
+                memset(&msg, 0, sizeof(msg));
+
+                p_get->m_id->to_binary(msg.id, sizeof(msg.id));
+
+                msg.keylen = htons(p_get->m_keylen);
+                msg.nonce  = htonl(p_get->m_nonce);
+                msg.flags  = flags;
+
+                m_rdp.send(desc, &msg, sizeof(msg));
+                m_rdp.send(desc, p_get->m_key.get(), p_get->m_keylen);
+        }
+
+        void
+        proxy::rdp_get_pool_func::operator() (int desc, rdp_addr addr,
+                                              rdp_event event)
+        {
+                rdp_get_pool_ptr pool = m_proxy.m_get_pool;
+
+                if (! pool || pool->desc != desc) {
+                        m_proxy.m_rdp.close(desc);
+                        return;
+                }
+
+                switch (event) {
+                case CONNECTED:
+                        pool->is_connected = true;
+                        m_proxy.send_get_pool();
+                        break;
+                case READY2READ:
+                        read_acks(desc);
+                        break;
+                case WRITABLE:
+                        break;
+                case RESET:
+                {
+                        // a proxy which does not understand dht_flag_keep
+                        // resets the connection after reading a get
+                        if (! pool->is_keep && ! pool->sent.empty())
+                                pool->sent.pop_front();
+
+                        m_proxy.close_get_pool();
+
+                        // the rest is sent by a connection for each
+                        BOOST_FOREACH(rdp_get_ptr p_get, pool->sent) {
+                                m_proxy.connect_get(p_get);
+                        }
+
+                        BOOST_FOREACH(rdp_get_ptr p_get, pool->queued) {
+                                m_proxy.connect_get(p_get);
+                        }
+
+                        break;
+                }
+                default:
+                        // the gets in the pool time out
+                        m_proxy.close_get_pool();
+                }
+        }
+
+        void
+        proxy::rdp_get_pool_func::read_acks(int desc)
+        {
+                rdp_get_pool_ptr pool = m_proxy.m_get_pool;
+
+                for (;;) {
+                        uint8_t op;
+                        int     size = sizeof(op);
+
+                        m_proxy.m_rdp.receive(desc, &op, &size);
+
+                        if (size == 0)
+                                break;
+
+                        if (op != proxy_get_ack || pool->sent.empty()) {
+                                m_proxy.close_get_pool();
+                                return;
+                        }
+
+                        pool->sent.pop_front();
+
+                        pool->is_keep   = true;
+                        pool->last_time = time(NULL);
+                }
+
+                m_proxy.send_get_pool();
+        }
+
         void
         proxy::get(const uint160_t &id, const void *key, uint16_t keylen,
                    dht::callback_find_value func)
@@ -1115,7 +1607,7 @@ namespace libcage {
         }
 
         void
-        proxy::recv_get_reply(void *msg, int len)
+        proxy::recv_get_reply(void *msg, int len, packetbuf_ptr pbuf)
         {
                 msg_proxy_get_reply *reply;
                 uint160_t dst;
@@ -1145,11 +1637,9 @@ namespace libcage {
                 if (reply->flag > 0) {
                         dht::value_t value;
 
-                        value.value = boost::shared_array<char>(new char[valuelen]);
+                        value.value = pbuf_slice(pbuf, reply->data, valuelen);
                         value.len   = valuelen;
 
-                        memcpy(value.value.get(), reply->data, valuelen);
-
                         it->second->vset->insert(value);
                         it->second->indeces.insert((int)ntohs(reply->index));
 
@@ -1191,9 +1681,7 @@ namespace libcage {
         proxy::send_dgram(const void *msg, int len, id_ptr id)
         {
                 cageaddr addr;
-                try {
-                        addr = m_peers.get_addr(id);
-                } catch (std::out_of_range) {
+                if (! m_peers.find_addr(id, addr)) {
                         if (! m_is_registered) {
                                 if (m_nat.get_state() == node_symmetric)
                                         register_node();
@@ -1227,9 +1715,7 @@ namespace libcage {
         proxy::send_dgram(packetbuf_ptr pbuf, id_ptr id, uint8_t type)
         {
                 cageaddr addr;
-                try {
-                        addr = m_peers.get_addr(id);
-                } catch (std::out_of_range) {
+                if (! m_peers.find_addr(id, addr)) {
                         if (! m_is_registered) {
                                 if (m_nat.get_state() == node_symmetric)
                                         register_node();
@@ -1363,18 +1849,7 @@ namespace libcage {
                         }
 
 
-                        msg_proxy_rdp_get msg;
-
-                        memset(&msg, 0, sizeof(msg));
-
-                        it->second->m_id->to_binary(msg.id, sizeof(msg.id));
-
-                        msg.keylen = htons(it->second->m_keylen);
-                        msg.nonce  = htonl(it->second->m_nonce);
-
-                        m_proxy.m_rdp.send(desc, &msg, sizeof(msg));
-                        m_proxy.m_rdp.send(desc, it->second->m_key.get(),
-                                           it->second->m_keylen);
+                        m_proxy.send_get(desc, it->second, 0);
 
                         break;
                 }
@@ -1431,16 +1906,22 @@ namespace libcage {
 
                 m_proxy.m_rdp.receive(desc, &msg, &size);
 
+                // a kept connection waits for the next get
+                if (size == 0 && ptr->m_is_keep)
+                        return false;
+
                 if (size != sizeof(msg)) {
                         m_proxy.m_rdp.close(desc);
                         m_proxy.m_rdp_recv_get.erase(desc);
                         return false;
                 }
 
-                ptr->m_keylen = ntohs(msg.keylen);
-                ptr->m_nonce  = ntohl(msg.nonce);
-                ptr->m_time   = time(NULL);
-                ptr->m_state  = rdp_recv_get::RG_KEY;
+                ptr->m_keylen   = ntohs(msg.keylen);
+                ptr->m_key_read = 0;
+                ptr->m_nonce    = ntohl(msg.nonce);
+                ptr->m_time     = time(NULL);
+                ptr->m_state    = rdp_recv_get::RG_KEY;
+                ptr->m_is_keep  = (msg.flags & dht_flag_keep) != 0;
 
                 boost::shared_array<char> key(new char[ptr->m_keylen]);
                 ptr->m_key = key;
@@ -1453,7 +1934,7 @@ namespace libcage {
                 return true;
         }
 
-        void
+        bool
         proxy::rdp_recv_get_func::read_key(int desc, rdp_recv_get_ptr ptr)
         {
                 for (;;) {
@@ -1463,7 +1944,7 @@ namespace libcage {
                         m_proxy.m_rdp.receive(desc, buf, &size);
 
                         if (size == 0)
-                                return;
+                                return false;
 
                         ptr->m_key_read += size;
                         if (ptr->m_key_read == ptr->m_keylen) {
@@ -1474,14 +1955,25 @@ namespace libcage {
                                 func.nonce   = ptr->m_nonce;
                                 func.p_proxy = &m_proxy;
                                 func.is_rdp  = true;
+                                func.is_keep = ptr->m_is_keep;
 
                                 m_proxy.m_dht.find_value(*ptr->m_id,
                                                          ptr->m_key.get(),
                                                          ptr->m_keylen, func);
 
+                                if (ptr->m_is_keep) {
+                                        uint8_t op = proxy_get_ack;
+
+                                        m_proxy.m_rdp.send(desc, &op,
+                                                           sizeof(op));
+
+                                        ptr->m_state = rdp_recv_get::RG_HDR;
+                                        return true;
+                                }
+
                                 m_proxy.m_rdp.close(desc);
                                 m_proxy.m_rdp_recv_get.erase(desc);
-                                return;
+                                return false;
                         }
                 }
         }
@@ -1523,8 +2015,9 @@ namespace libcage {
                                                 return;
                                         break;
                                 case rdp_recv_get::RG_KEY:
-                                        read_key(desc, it->second);
-                                        return;
+                                        if (! read_key(desc, it->second))
+                                                return;
+                                        break;
                                 }
                         }
 
@@ -1537,36 +2030,116 @@ namespace libcage {
                 }
         }
 
+        void
+        proxy::rdp_store_func::send_store(int desc, uint8_t flags)
+        {
+                msg_dht_rdp_store msg;
+
+                memset(&msg, 0, sizeof(msg));
+
+                m_id->to_binary(msg.id, sizeof(msg.id));
+
+                msg.keylen   = htons(m_keylen);
+                msg.valuelen = htons(m_valuelen);
+                msg.ttl      = htons(m_ttl);
+                msg.flags    = flags;
+
+                if (m_is_unique)
+                        msg.flags |= dht_flag_unique;
+
+                m_proxy.m_rdp.send(desc, &msg, sizeof(msg));
+                m_proxy.m_rdp.send(desc, m_key.get(), m_keylen);
+                m_proxy.m_rdp.send(desc, m_val.get(), m_valuelen);
+        }
+
         void
         proxy::rdp_store_func::operator() (int desc, rdp_addr addr,
                                            rdp_event event)
         {
                 switch (event) {
                 case CONNECTED:
-                {
-                        msg_dht_rdp_store msg;
+                        send_store(desc, 0);
+                        break;
+                case WRITABLE:
+                        break;
+                default:
+                        m_proxy.m_rdp.close(desc);
+                        m_proxy.m_rdp_store.erase(desc);
+                }
+        }
 
-                        memset(&msg, 0, sizeof(msg));
+        void
+        proxy::rdp_store_pool_func::operator() (int desc, rdp_addr addr,
+                                                rdp_event event)
+        {
+                rdp_store_pool_ptr pool = m_proxy.m_store_pool;
 
-                        m_id->to_binary(msg.id, sizeof(msg.id));
+                if (! pool || pool->desc != desc) {
+                        m_proxy.m_rdp.close(desc);
+                        return;
+                }
+
+                switch (event) {
+                case CONNECTED:
+                        pool->is_connected = true;
+                        m_proxy.send_store_pool();
+                        break;
+                case READY2READ:
+                        read_acks(desc);
+                        break;
+                case WRITABLE:
+                        break;
+                case RESET:
+                {
+                        // a proxy which does not understand dht_flag_keep
+                        // resets the connection after storing a value
+                        if (! pool->is_keep && ! pool->sent.empty())
+                                pool->sent.pop_front();
 
-                        msg.keylen   = htons(m_keylen);
-                        msg.valuelen = htons(m_valuelen);
-                        msg.ttl      = htons(m_ttl);
+                        m_proxy.close_store_pool();
 
-                        if (m_is_unique)
-                                msg.flags = dht_flag_unique;
+                        // the rest is stored by a connection for each
+                        BOOST_FOREACH(rdp_store_func_ptr func, pool->sent) {
+                                m_proxy.connect_store(func);
+                        }
 
-                        m_proxy.m_rdp.send(desc, &msg, sizeof(msg));
-                        m_proxy.m_rdp.send(desc, m_key.get(), m_keylen);
-                        m_proxy.m_rdp.send(desc, m_val.get(), m_valuelen);
+                        BOOST_FOREACH(rdp_store_func_ptr func, pool->queued) {
+                                m_proxy.connect_store(func);
+                        }
 
                         break;
                 }
                 default:
-                        m_proxy.m_rdp.close(desc);
-                        m_proxy.m_rdp_store.erase(desc);
+                        m_proxy.close_store_pool();
+                }
+        }
+
+        void
+        proxy::rdp_store_pool_func::read_acks(int desc)
+        {
+                rdp_store_pool_ptr pool = m_proxy.m_store_pool;
+
+                for (;;) {
+                        uint8_t op;
+                        int     size = sizeof(op);
+
+                        m_proxy.m_rdp.receive(desc, &op, &size);
+
+                        if (size == 0)
+                                break;
+
+                        if (op != dht_store_done || pool->sent.empty()) {
+                                m_proxy.close_store_pool();
+                                return;
+                        }
+
+                        pool->sent.pop_front();
+
+                        pool->is_keep   = true;
+                        pool->last_time = time(NULL);
                 }
+
+                m_proxy.send_store_pool();
         }
 
         bool
@@ -1577,6 +2150,10 @@ namespace libcage {
 
                 m_proxy.m_rdp.receive(desc, &msg, &size);
 
+                // a kept connection waits for the next value
+                if (size == 0 && ptr->m_is_keep)
+                        return false;
+
                 if (size != sizeof(msg)) {
                         m_proxy.m_rdp.close(desc);
                         m_proxy.m_rdp_recv_store.erase(desc);
@@ -1594,9 +2171,12 @@ namespace libcage {
                 ptr->m_id       = id;
                 ptr->m_time     = time(NULL);
                 ptr->m_state    = rdp_recv_store::RS_KEY;
+                ptr->m_key_read = 0;
+                ptr->m_val_read = 0;
 
-                if (msg.flags & dht_flag_unique)
-                        ptr->m_is_unique = true;
+                ptr->m_is_unique     = (msg.flags & dht_flag_unique) != 0;
+                ptr->m_is_compressed = (msg.flags & dht_flag_compressed) != 0;
+                ptr->m_is_keep       = (msg.flags & dht_flag_keep) != 0;
 
 
                 boost::shared_array<char> key(new char[ptr->m_keylen]);
@@ -1632,7 +2212,7 @@ namespace libcage {
                 return true;
         }
 
-        void
+        bool
         proxy::rdp_recv_store_func::read_val(int desc, rdp_recv_store_ptr ptr)
         {
                 for (;;) {
@@ -1642,13 +2222,15 @@ namespace libcage {
                         m_proxy.m_rdp.receive(desc, buf, &size);
 
                         if (size == 0)
-                                return;
+                                return false;
 
                         ptr->m_val_read += size;
                         ptr->m_time      = time(NULL);
 
                         if (ptr->m_valuelen == ptr->m_val_read) {
-                                m_proxy.m_rdp.close(desc);
+                                if (! ptr->m_is_keep)
+                                        m_proxy.m_rdp.close(desc);
+
                                 m_proxy.m_dht.store(ptr->m_id,
                                                     ptr->m_key,
                                                     ptr->m_keylen,
@@ -1656,9 +2238,21 @@ namespace libcage {
                                                     ptr->m_valuelen,
                                                     ptr->m_ttl,
                                                     ptr->m_src,
-                                                    ptr->m_is_unique);
+                                                    ptr->m_is_unique,
+                                                    ptr->m_is_compressed);
+
+                                if (ptr->m_is_keep) {
+                                        uint8_t op = dht_store_done;
+
+                                        m_proxy.m_rdp.send(desc, &op,
+                                                           sizeof(op));
+
+                                        ptr->m_state = rdp_recv_store::RS_HDR;
+                                        return true;
+                                }
+
                                 m_proxy.m_rdp_recv_store.erase(desc);
-                                return;
+                                return false;
                         }
                 }
         }
@@ -1705,8 +2299,9 @@ namespace libcage {
                                                 return;
                                         break;
                                 case rdp_recv_store::RS_VAL:
-                                        read_val(desc, it->second);
-                                        return;
+                                        if (! read_val(desc, it->second))
+                                                return;
+                                        break;
                                 }
                         }
 
@@ -42,6 +42,7 @@
 #include "peers.hpp"
 #include "timer.hpp"
 
+#include <deque>
 #include <map>
 #include <set>
 #include <vector>
@@ -56,6 +57,7 @@ namespace libcage {
                 static const time_t     get_timeout;
                 static const time_t     timer_interval;
                 static const time_t     rdp_timeout;
+                static const time_t     rdp_pool_idle;
                 static const uint16_t   proxy_store_port;
                 static const uint16_t   proxy_get_port;
                 static const uint16_t   proxy_get_reply_port;
@@ -72,9 +74,10 @@ namespace libcage {
                 void            recv_register(void *msg, sockaddr *from);
                 void            recv_register_reply(void *msg, sockaddr *from);
                 void            recv_store(void *msg, int len,
-                                           sockaddr *from);
+                                           sockaddr *from, packetbuf_ptr pbuf);
                 void            recv_get(void *msg, int len);
-                void            recv_get_reply(void *msg, int len);
+                void            recv_get_reply(void *msg, int len,
+                                               packetbuf_ptr pbuf);
                 void            recv_dgram(packetbuf_ptr pbuf);
                 void            recv_forwarded(packetbuf_ptr pbuf);
 
@@ -115,12 +118,46 @@ namespace libcage {
 
                         void operator() (int desc, rdp_addr addr,
                                          rdp_event event);
+                        void send_store(int desc, uint8_t flags);
 
                         rdp_store_func(proxy &p) : m_proxy(p) { }
                 };
 
                 typedef boost::shared_ptr<rdp_store_func> rdp_store_func_ptr;
 
+                // the connection to store values to the proxy. values
+                // are pipelined once the proxy has acknowledged the
+                // first one, as dht::rdp_pool does
+                class rdp_store_pool {
+                public:
+                        int             desc;
+                        id_ptr          dst;
+                        time_t          last_time;
+                        bool            is_connected;
+                        bool            is_keep;
+
+                        std::deque<rdp_store_func_ptr>  sent; // not acked
+                        std::deque<rdp_store_func_ptr>  queued;
+
+                        rdp_store_pool() : desc(0), last_time(time(NULL)),
+                                           is_connected(false),
+                                           is_keep(false) { }
+                };
+
+                typedef boost::shared_ptr<rdp_store_pool> rdp_store_pool_ptr;
+
+                class rdp_store_pool_func {
+                public:
+                        proxy  &m_proxy;
+
+                        void operator() (int desc, rdp_addr addr,
+                                         rdp_event event);
+
+                        rdp_store_pool_func(proxy &p) : m_proxy(p) { }
+
+                        void read_acks(int desc);
+                };
+
                 class rdp_recv_store {
                 public:
                         enum recv_store_state {
@@ -138,12 +175,16 @@ namespace libcage {
                         uint16_t        m_val_read;
                         uint16_t        m_ttl;
                         bool            m_is_unique;
+                        bool            m_is_compressed;
+                        bool            m_is_keep;
                         id_ptr          m_id;
                         id_ptr          m_src;
                         time_t          m_time;
 
                         rdp_recv_store() : m_state(RS_HDR), m_key_read(0),
-                                           m_val_read(0) { }
+                                           m_val_read(0), m_is_unique(false),
+                                           m_is_compressed(false),
+                                           m_is_keep(false) { }
                 };
 
                 typedef boost::shared_ptr<rdp_recv_store> rdp_recv_store_ptr;
@@ -159,7 +200,7 @@ namespace libcage {
 
                         bool read_hdr(int desc, rdp_recv_store_ptr ptr);
                         bool read_key(int desc, rdp_recv_store_ptr ptr);
-                        void read_val(int desc, rdp_recv_store_ptr ptr);
+                        bool read_val(int desc, rdp_recv_store_ptr ptr);
                 };
 
                 class timer_get : public timer::callback {
@@ -215,6 +256,40 @@ namespace libcage {
                         rdp_get_func(proxy &p) : m_proxy(p) { }
                 };
 
+                // the connection to send gets to the proxy. the requests
+                // are pipelined once the proxy has acknowledged the
+                // first one, and the replies come back by the connection
+                // which the proxy keeps to this node
+                class rdp_get_pool {
+                public:
+                        int             desc;
+                        id_ptr          dst;
+                        time_t          last_time;
+                        bool            is_connected;
+                        bool            is_keep;
+
+                        std::deque<rdp_get_ptr> sent; // not acked
+                        std::deque<rdp_get_ptr> queued;
+
+                        rdp_get_pool() : desc(0), last_time(time(NULL)),
+                                         is_connected(false),
+                                         is_keep(false) { }
+                };
+
+                typedef boost::shared_ptr<rdp_get_pool> rdp_get_pool_ptr;
+
+                class rdp_get_pool_func {
+                public:
+                        proxy  &m_proxy;
+
+                        void operator() (int desc, rdp_addr addr,
+                                         rdp_event event);
+
+                        rdp_get_pool_func(proxy &p) : m_proxy(p) { }
+
+                        void read_acks(int desc);
+                };
+
                 class rdp_recv_get {
                 public:
                         enum recv_get_state {
@@ -231,10 +306,12 @@ namespace libcage {
                         uint32_t        m_nonce;
                         time_t          m_time;
                         recv_get_state  m_state;
+                        bool            m_is_keep;
 
                         rdp_recv_get(proxy &p) : m_proxy(p), m_key_read(0),
                                                  m_time(time(NULL)),
-                                                 m_state(RG_HDR) { }
+                                                 m_state(RG_HDR),
+                                                 m_is_keep(false) { }
                 };
 
                 typedef boost::shared_ptr<rdp_recv_get> rdp_recv_get_ptr;
@@ -249,7 +326,7 @@ namespace libcage {
                         rdp_recv_get_func(proxy &p) : m_proxy(p) { }
 
                         bool read_hdr(int desc, rdp_recv_get_ptr ptr);
-                        void read_key(int desc, rdp_recv_get_ptr ptr);
+                        bool read_key(int desc, rdp_recv_get_ptr ptr);
                 };
 
                 class _addr {
@@ -296,6 +373,41 @@ namespace libcage {
                         void read_op(int desc);
                 };
 
+                typedef boost::shared_ptr<rdp_get_reply_func> rdp_get_reply_func_ptr;
+
+                // the connection to send the replies of gets to a node,
+                // pooled for each node which sets dht_flag_keep in its
+                // gets. the replies are sent one by one, and a value
+                // header with dht_flag_keep ends the values of a reply
+                class rdp_get_reply_pool {
+                public:
+                        int             desc;
+                        id_ptr          dst;
+                        time_t          last_time;
+                        bool            is_connected;
+
+                        rdp_get_reply_func_ptr                  current;
+                        std::deque<rdp_get_reply_func_ptr>      queued;
+
+                        rdp_get_reply_pool() : desc(0),
+                                               last_time(time(NULL)),
+                                               is_connected(false) { }
+                };
+
+                typedef boost::shared_ptr<rdp_get_reply_pool> rdp_get_reply_pool_ptr;
+
+                class rdp_get_reply_pool_func {
+                public:
+                        proxy  &m_proxy;
+
+                        void operator() (int desc, rdp_addr addr,
+                                         rdp_event event);
+
+                        rdp_get_reply_pool_func(proxy &p) : m_proxy(p) { }
+
+                        void read_op(int desc, rdp_get_reply_pool_ptr pool);
+                };
+
                 class get_reply_func {
                 public:
                         void operator() (bool result, dht::value_set_ptr vset);
@@ -309,6 +421,9 @@ namespace libcage {
                         uint32_t        nonce;
                         proxy          *p_proxy;
                         bool            is_rdp;
+                        bool            is_keep;
+
+                        get_reply_func() : is_rdp(false), is_keep(false) { }
                 };
 
                 class rdp_recv_get_reply {
@@ -326,9 +441,11 @@ namespace libcage {
                         recv_get_reply_state    m_state;
                         uint32_t        m_nonce;
                         time_t          m_time;
+                        bool            m_is_keep;
 
                         rdp_recv_get_reply() : m_state(RGR_HDR),
-                                               m_time(time(NULL)) { }
+                                               m_time(time(NULL)),
+                                               m_is_keep(false) { }
                 };
 
                 typedef boost::shared_ptr<rdp_recv_get_reply> rdp_recv_get_reply_ptr;
@@ -347,6 +464,7 @@ namespace libcage {
                         bool read_val(int desc, rdp_recv_get_reply_ptr ptr);
 
                         void close_rdp(int desc, rdp_recv_get_reply_ptr ptr);
+                        void done(rdp_recv_get_reply_ptr ptr);
                 };
 
                 class timer_proxy : public timer::callback {
@@ -358,10 +476,12 @@ namespace libcage {
                                 if (m_proxy.m_nat.get_state() ==
                                     node_symmetric) {
                                         m_proxy.register_node();
-                                        m_proxy.sweep_rdp();
                                         m_proxy.retry_storing();
                                 }
 
+                                // a proxy keeps connections to the nodes
+                                m_proxy.sweep_rdp();
+
                                 timeval tval;
                                 time_t  t;
 
@@ -417,6 +537,20 @@ namespace libcage {
                                                   uint16_t ttl,
                                                   bool is_unique);
                 void            retry_storing();
+                void            store_pool(rdp_store_func_ptr func);
+                void            send_store_pool();
+                void            close_store_pool();
+                void            connect_store(rdp_store_func_ptr func);
+                void            get_pool(rdp_get_ptr p_get);
+                void            send_get_pool();
+                void            close_get_pool();
+                void            connect_get(rdp_get_ptr p_get);
+                void            send_get(int desc, rdp_get_ptr p_get,
+                                         uint8_t flags);
+                void            reply_pool(rdp_get_reply_func_ptr func,
+                                           id_ptr dst);
+                void            send_reply_pool(rdp_get_reply_pool_ptr pool);
+                void            close_reply_pool(rdp_get_reply_pool_ptr pool);
 
                 rand_uint      &m_rnd;
                 rand_real      &m_drnd;
@@ -451,6 +585,10 @@ namespace libcage {
                 std::map<int, rdp_recv_get_ptr>         m_rdp_recv_get;
                 std::map<int, time_t>           m_rdp_get_reply;
                 std::map<int, rdp_recv_get_reply_ptr>   m_rdp_recv_get_reply;
+                rdp_store_pool_ptr              m_store_pool;
+                rdp_get_pool_ptr                m_get_pool;
+                std::map<_id, rdp_get_reply_pool_ptr>   m_reply_pool;
+                std::map<int, rdp_get_reply_pool_ptr>   m_reply_pool_desc;
         };
 }
 
@@ -31,6 +31,8 @@
 
 #include "rdp.hpp"
 
+#include <math.h>
+
 #include <boost/foreach.hpp>
 
 namespace libcage {
@@ -40,14 +42,52 @@ namespace libcage {
         const uint8_t rdp::flag_rst = 0x10;
         const uint8_t rdp::flag_nul = 0x08;
         const uint8_t rdp::flag_fin = 0x04;
+        const uint8_t rdp::flag_fec = 0x02;
         const uint8_t rdp::flag_ver = 0;
 
-        const uint32_t rdp::rbuf_max_default    = 1012 - 128;
-        const uint32_t rdp::rcv_max_default     = 1024;
+        // a segment and the headers of dgram and proxy fit in a datagram
+        // of 1472 bytes, which is the largest UDP payload on Ethernet
         const uint16_t rdp::well_known_port_max = 1024;
-        const uint16_t rdp::sbuf_limit          = 1012 - 128;
-        const uint32_t rdp::timer_rdp_usec      = 300 * 1000;
-        const double   rdp::ack_interval        = 0.3;
+        const uint16_t rdp::sbuf_limit          = PBUF_SIZE -
+                                                  PBUF_DEFAULT_OFFSET -
+                                                  sizeof(msg_hdr) * 2;
+        const uint8_t  rdp::wnd_shift_max       = 14;
+        const double   rdp::timer_granularity   = 0.001;
+        const double   rdp::ack_interval        = 0.04;
+        const uint32_t rdp::ack_segs            = 2;
+        const double   rdp::rto_init            = 1.0;
+        const double   rdp::rto_min             = 0.2;
+        const double   rdp::rto_max             = 60.0;
+        const uint32_t rdp::dupthresh           = 3;
+        const double   rdp::swnd_lowat          = 0.5;
+        const uint8_t  rdp::syn_opt_stream      = 0x01;
+        const uint8_t  rdp::syn_opt_data        = 0x02;
+        const uint8_t  rdp::syn_opt_sack        = 0x04;
+        const uint8_t  rdp::syn_opt_fec         = 0x08;
+        const double   rdp::fec_delay           = 0.01;
+        const uint8_t  rdp::fec_block_max       = 64;
+        const double   rdp::pace_slot           = 0.002;
+        const double   rdp::pace_gain           = 1.25;
+        const double   rdp::pace_gain_ss        = 2.0;
+        const int      rdp::eacks_max           = 64;
+        const uint16_t rdp::stream_max          = 256;
+        const uint16_t rdp::syn_data_max        = 512;
+
+        const uint32_t rdp_config::rcv_max_default  = 1024;
+        const uint32_t rdp_config::rbuf_max_default = PBUF_SIZE -
+                                                      PBUF_DEFAULT_OFFSET -
+                                                      sizeof(msg_hdr) * 2;
+        const uint32_t rdp_config::sbuf_len_default = 4096;
+
+        const double rdp_cc::cwnd_init = 10.0;
+        const double rdp_cc::cwnd_min  = 2.0;
+
+        const double rdp_cc_cubic::beta = 0.7;
+        const double rdp_cc_cubic::c    = 0.4;
+
+        const double rdp_cc_delay::alpha = 2.0;
+        const double rdp_cc_delay::beta  = 4.0;
+        const double rdp_cc_delay::gamma = 1.0;
 
         size_t
         hash_value(const rdp_addr &addr)
@@ -63,181 +103,390 @@ namespace libcage {
         void
         rdp::timer_rdp::operator() ()
         {
-                timeval tval;
+                m_rdp.m_is_timer_set = false;
+
+                double now = m_rdp.get_clock();
+
+                while (! m_rdp.m_deadlines.empty()) {
+                        deadlines_t::iterator it = m_rdp.m_deadlines.begin();
+
+                        if (it->first > now)
+                                break;
+
+                        std::map<int, rdp_con_ptr>::iterator it_con;
+                        int desc = it->second;
+
+                        it_con = m_rdp.m_desc2conn.find(desc);
+                        if (it_con != m_rdp.m_desc2conn.end() &&
+                            it_con->second->is_scheduled &&
+                            it_con->second->sched_it == it) {
+                                rdp_con_ptr p_con = it_con->second;
+
+                                m_rdp.m_deadlines.erase(it);
+                                p_con->is_scheduled = false;
+
+                                m_rdp.expire(p_con);
+                        } else {
+                                // the connection was deallocated
+                                m_rdp.m_deadlines.erase(it);
+                        }
+                }
+
+                m_rdp.set_timer_rdp();
+        }
+
+        double
+        rdp::get_clock()
+        {
+                cagetime now;
+
+                return now - m_epoch;
+        }
+
+        void
+        rdp::schedule(rdp_con &con, double at)
+        {
+                if (con.is_scheduled) {
+                        if (con.sched_it->first <= at)
+                                return;
 
-                tval.tv_sec  = 0;
-                tval.tv_usec = rdp::timer_rdp_usec;
+                        m_deadlines.erase(con.sched_it);
+                }
 
-                get_timer()->set_timer(this, &tval);
+                con.sched_it     = m_deadlines.insert(std::make_pair(at,
+                                                                     con.desc));
+                con.is_scheduled = true;
 
+                if (con.sched_it == m_deadlines.begin())
+                        set_timer_rdp();
+        }
 
-                if (m_rdp.m_desc2conn.size() == 0)
+        void
+        rdp::set_timer_rdp()
+        {
+                if (m_deadlines.empty()) {
+                        if (m_is_timer_set) {
+                                m_timer.unset_timer(&m_timer_rdp);
+                                m_is_timer_set = false;
+                        }
                         return;
-                
-                std::map<int, rdp_con_ptr>::iterator it;
-                
-                for (it = m_rdp.m_desc2conn.begin();
-                     it != m_rdp.m_desc2conn.end();) {
-                        time_t now = time(NULL);
-                        time_t diff;
-                        switch (it->second->state) {
-                        case SYN_SENT:
-                        case SYN_RCVD:
-                        {
-                                if (it->second->syn_tout >=
-                                    m_rdp.m_max_retrans) {
-                                        if (it->second->is_pasv) {
-                                                // delete connection
-                                                m_rdp.m_desc_set.erase(it->first);
-                                                m_rdp.m_desc2event.erase(it->first);
-                                                m_rdp.m_addr2conn.erase(it->second->addr);
-                                                m_rdp.m_desc2conn.erase(it++);
-                                        } else {
-                                                // invoke the signal of
-                                                // "Connection Failed"
-                                                rdp_addr addr = it->second->addr;
-                                                int desc      = it->first;
+                }
 
-                                                it->second->state = CLOSED;
+                double at = m_deadlines.begin()->first;
 
-                                                ++it;
-                                                m_rdp.invoke_event(desc, 0,
-                                                                   addr,
-                                                                   FAILED);
-                                        }
-                                        break;
-                                }
+                if (m_is_timer_set && m_timer_at <= at)
+                        return;
 
-                                diff = now - it->second->syn_time;
-                                if (diff > it->second->syn_tout) {
-                                        packetbuf_ptr  pbuf = packetbuf::construct();
-                                        rdp_syn       *syn;
-                
-                                        syn = (rdp_syn*)pbuf->append(sizeof(*syn));
-                                        memset(syn, 0, sizeof(*syn));
+                double  diff = at - get_clock();
+                timeval tval;
 
-                                        syn->head.flags  = flag_syn | flag_ver;
-                                        syn->head.hlen   = (uint8_t)(sizeof(*syn) / 2);
-                                        syn->head.sport  = htons(it->second->addr.sport);
-                                        syn->head.dport  = htons(it->second->addr.dport);
-                                        syn->head.seqnum = htonl(it->second->snd_iss);
+                if (diff < 0.0)
+                        diff = 0.0;
 
-                                        syn->out_segs_max = htons(it->second->rcv_max);
-                                        syn->seg_size_max = htons(it->second->rbuf_max);
+                tval.tv_sec  = (time_t)diff;
+                tval.tv_usec = (suseconds_t)((diff - tval.tv_sec) * 1000000.0);
 
-                                        if (it->second->state == SYN_RCVD) {
-                                                syn->head.flags |= flag_ack;
-                                                syn->head.acknum = htonl(it->second->rcv_cur);
-                                        }
-                                        
-                                        // retry sending syn
-                                        m_rdp.output(it->second->addr.did,
-                                                     pbuf);
+                m_timer.set_timer(&m_timer_rdp, &tval);
 
-                                        it->second->syn_tout *= 2;
-                                        it->second->syn_time  = now;
-                                }
+                m_is_timer_set = true;
+                m_timer_at     = at;
+        }
+
+        void
+        rdp::expire(rdp_con_ptr p_con)
+        {
+                double now = get_clock();
+                double diff;
+
+                switch (p_con->state) {
+                case SYN_SENT:
+                case SYN_RCVD:
+                {
+                        if (p_con->syn_tout >= m_max_retrans) {
+                                if (p_con->is_pasv && ! p_con->is_accepted) {
+                                        // delete connection
+                                        m_desc_set.erase(p_con->desc);
+                                        m_desc2event.erase(p_con->desc);
+                                        m_addr2conn.erase(p_con->addr);
+                                        m_desc2conn.erase(p_con->desc);
+                                } else {
+                                        // invoke the signal of
+                                        // "Connection Failed"
+                                        p_con->state = CLOSED;
 
-                                ++it;
+                                        invoke_event(p_con->desc, 0,
+                                                     p_con->addr, FAILED);
+                                }
                                 break;
                         }
-                        case CLOSE_WAIT_ACTIVE:
-                        case CLOSE_WAIT_PASV:
-                        {
-                                if (it->second->rst_tout >=
-                                    m_rdp.m_max_retrans) {
-                                        if (it->second->is_closed) {
-                                                // deallocate
-                                                m_rdp.m_desc_set.erase(it->first);
-                                                m_rdp.m_desc2event.erase(it->first);
-                                                m_rdp.m_addr2conn.erase(it->second->addr);
-                                                m_rdp.m_desc2conn.erase(it++);
-                                        } else {
-                                                it->second->state = CLOSED;
-                                                ++it;
-                                        }
-                                        break;
-                                }
 
-                                diff = now - it->second->rst_time;
-                                if (diff > it->second->rst_tout) {
-                                        it->second->rst_tout *= 2;
-                                        it->second->rst_time  = now;
+                        diff = now - p_con->syn_time;
+                        if (diff >= p_con->syn_tout) {
+                                packetbuf_ptr pbuf;
+
+                                pbuf = make_syn(*p_con,
+                                                p_con->state == SYN_RCVD);
+
+                                // retry sending syn
+                                output(p_con->addr.did, pbuf);
 
-                                        if (it->second->is_retry_rst) {
-                                                packetbuf_ptr  pbuf;
-                                                rdp_head      *rst;
+                                p_con->syn_tout *= 2;
+                                p_con->syn_time  = now;
+                        }
+
+                        schedule(*p_con, p_con->syn_time + p_con->syn_tout);
+                        break;
+                }
+                case CLOSE_WAIT_ACTIVE:
+                case CLOSE_WAIT_PASV:
+                {
+                        if (p_con->rst_tout >= m_max_retrans) {
+                                if (p_con->is_closed) {
+                                        // deallocate
+                                        m_desc_set.erase(p_con->desc);
+                                        m_desc2event.erase(p_con->desc);
+                                        m_addr2conn.erase(p_con->addr);
+                                        m_desc2conn.erase(p_con->desc);
+                                } else {
+                                        p_con->state = CLOSED;
+                                }
+                                break;
+                        }
 
-                                                pbuf = packetbuf::construct();
+                        diff = now - p_con->rst_time;
+                        if (diff >= p_con->rst_tout) {
+                                p_con->rst_tout *= 2;
+                                p_con->rst_time  = now;
 
-                                                rst = (rdp_head*)pbuf->append(sizeof(*rst));
+                                if (p_con->is_retry_rst) {
+                                        packetbuf_ptr  pbuf;
+                                        rdp_head      *rst;
 
-                                                memset(rst, 0, sizeof(*rst));
+                                        pbuf = packetbuf::construct();
 
-                                                rst->hlen   = (uint8_t)(sizeof(*rst) / 2);
-                                                rst->sport  = htons(it->second->addr.sport);
-                                                rst->dport  = htons(it->second->addr.dport);
-                                                rst->seqnum = htonl(it->second->snd_nxt);
-                                                if (it->second->state ==
-                                                    CLOSE_WAIT_ACTIVE) {
-                                                        rst->flags = flag_rst |
-                                                                flag_ver;
-                                                } else {
-                                                        rst->flags = flag_rst |
-                                                                flag_fin |
-                                                                flag_ver;
-                                                }
+                                        rst = (rdp_head*)pbuf->append(sizeof(*rst));
 
-                                                m_rdp.output(it->second->addr.did,
-                                                             pbuf);
+                                        memset(rst, 0, sizeof(*rst));
+
+                                        rst->hlen   = (uint8_t)(sizeof(*rst) / 2);
+                                        rst->sport  = htons(p_con->addr.sport);
+                                        rst->dport  = htons(p_con->addr.dport);
+                                        rst->seqnum = htonl(p_con->snd_nxt);
+                                        if (p_con->state == CLOSE_WAIT_ACTIVE) {
+                                                rst->flags = flag_rst |
+                                                        flag_ver;
+                                        } else {
+                                                rst->flags = flag_rst |
+                                                        flag_fin |
+                                                        flag_ver;
                                         }
+
+                                        output(p_con->addr.did, pbuf);
                                 }
-                                ++it;
-                                break;
                         }
-                        case OPEN:
-                        {
-                                rdp_con_ptr p_con = it->second;
 
-                                ++it;
+                        schedule(*p_con, p_con->rst_time + p_con->rst_tout);
+                        break;
+                }
+                case OPEN:
+                {
+                        // retransmission
+                        if (! p_con->retransmit())
+                                break;
 
-                                // retransmission
-                                if (! p_con->retransmit())
-                                        break;
+                        // parity of a partial block
+                        if (p_con->snd_fec > 0)
+                                p_con->send_fec(true);
 
+                        // the next batch of paced segments
+                        if (p_con->pace_burst > 0)
+                                p_con->send_ostand_swnd();
 
-                                // delayed ack;
+                        // delayed ack
+                        if (p_con->rcv_cur != p_con->rcv_ack) {
                                 cagetime now;
-                                double   diff;
 
-                                diff = now - p_con->acked_time;
-                                if (diff > ack_interval)
+                                if (now - p_con->acked_time >= ack_interval)
                                         p_con->delayed_ack();
-
-                                break;
+                                else
+                                        p_con->schedule_ack();
                         }
-                        default:
-                                ++it;
+
+                        break;
+                }
+                default:
+                        ;
+                }
+        }
+
+        void
+        rdp_cc_newreno::on_ack(uint32_t num, double rtt)
+        {
+                if (cwnd < ssthresh)
+                        cwnd += num;
+                else
+                        cwnd += num / cwnd;
+        }
+
+        void
+        rdp_cc_newreno::on_loss()
+        {
+                ssthresh = cwnd / 2.0;
+                if (ssthresh < cwnd_min)
+                        ssthresh = cwnd_min;
+
+                cwnd = ssthresh;
+        }
+
+        void
+        rdp_cc_newreno::on_timeout()
+        {
+                ssthresh = cwnd / 2.0;
+                if (ssthresh < cwnd_min)
+                        ssthresh = cwnd_min;
+
+                cwnd = 1.0;
+        }
+
+        void
+        rdp_cc_cubic::on_ack(uint32_t num, double rtt)
+        {
+                if (cwnd < ssthresh) {
+                        cwnd += num;
+                        return;
+                }
+
+                if (! m_is_epoch) {
+                        m_is_epoch = true;
+                        m_epoch.update();
+
+                        if (cwnd < m_w_max) {
+                                m_k = cbrt((m_w_max - cwnd) / c);
+                        } else {
+                                m_k     = 0.0;
+                                m_w_max = cwnd;
                         }
+
+                        m_w_est = cwnd;
+                }
+
+                cagetime now;
+                double   t = now - m_epoch;
+                double   target;
+
+                if (rtt > 0.0)
+                        t += rtt;
+
+                target = c * (t - m_k) * (t - m_k) * (t - m_k) + m_w_max;
+                if (target > cwnd * 1.5)
+                        target = cwnd * 1.5;
+
+                if (target > cwnd)
+                        cwnd += (target - cwnd) / cwnd * num;
+                else
+                        cwnd += 0.01 * num / cwnd;
+
+                // TCP friendly region
+                m_w_est += 3.0 * (1.0 - beta) / (1.0 + beta) * num / cwnd;
+                if (m_w_est > cwnd)
+                        cwnd = m_w_est;
+        }
+
+        void
+        rdp_cc_cubic::on_loss()
+        {
+                m_is_epoch = false;
+
+                // fast convergence
+                if (cwnd < m_w_max)
+                        m_w_max = cwnd * (1.0 + beta) / 2.0;
+                else
+                        m_w_max = cwnd;
+
+                ssthresh = cwnd * beta;
+                if (ssthresh < cwnd_min)
+                        ssthresh = cwnd_min;
+
+                cwnd = ssthresh;
+        }
+
+        void
+        rdp_cc_cubic::on_timeout()
+        {
+                on_loss();
+                cwnd = 1.0;
+        }
+
+        void
+        rdp_cc_delay::on_ack(uint32_t num, double rtt)
+        {
+                if (rtt > 0.0 && (m_base_rtt < 0.0 || rtt < m_base_rtt))
+                        m_base_rtt = rtt;
+
+                if (rtt <= 0.0 || m_base_rtt <= 0.0) {
+                        if (cwnd < ssthresh)
+                                cwnd += num;
+                        else
+                                cwnd += num / cwnd;
+                        return;
+                }
+
+                // the number of segments queued in the path
+                double diff = cwnd * (1.0 - m_base_rtt / rtt);
+
+                if (cwnd < ssthresh) {
+                        if (diff > gamma)
+                                ssthresh = cwnd;
+                        else
+                                cwnd += num;
+                        return;
+                }
+
+                if (diff < alpha) {
+                        cwnd += num / cwnd;
+                } else if (diff > beta) {
+                        cwnd -= num / cwnd;
+                        if (cwnd < cwnd_min)
+                                cwnd = cwnd_min;
                 }
         }
 
+        void
+        rdp_cc_delay::on_loss()
+        {
+                ssthresh = cwnd * 0.75;
+                if (ssthresh < cwnd_min)
+                        ssthresh = cwnd_min;
+
+                cwnd = ssthresh;
+        }
+
+        void
+        rdp_cc_delay::on_timeout()
+        {
+                ssthresh = cwnd / 2.0;
+                if (ssthresh < cwnd_min)
+                        ssthresh = cwnd_min;
+
+                cwnd = 1.0;
+        }
+
         rdp::rdp(rand_uint &rnd, timer &tm) : m_rnd(rnd), m_max_retrans(32),
+                                              m_cc_algo(CC_NEWRENO),
                                               m_timer(tm), m_timer_rdp(*this),
-                                              m_is_invoke(false)
+                                              m_is_timer_set(false),
+                                              m_timer_at(0.0),
+                                              m_is_invoke(false),
+                                              m_retrans_timeout(0),
+                                              m_retrans_fast(0)
         {
-                timeval   tval;
 
-                // start timer for retransmission and delayed ack
-                tval.tv_sec  = 0;
-                tval.tv_usec = timer_rdp_usec;
-
-                m_timer.set_timer(&m_timer_rdp, &tval);
         }
 
         rdp::~rdp()
         {
-                m_timer.unset_timer(&m_timer_rdp);
+                if (m_is_timer_set)
+                        m_timer.unset_timer(&m_timer_rdp);
         }
 
         void
@@ -304,19 +553,32 @@ namespace libcage {
 
         void
         rdp::receive(int desc, void *buf, int *len)
+        {
+                receive(desc, 0, buf, len);
+        }
+
+        void
+        rdp::receive(int desc, uint16_t stream, void *buf, int *len)
         {
                 std::map<int, rdp_con_ptr>::iterator it;
+                std::queue<packetbuf_ptr> *rqueue;
 
                 it = m_desc2conn.find(desc);
                 if (it == m_desc2conn.end()) {
                         *len = 0;
                         return;
                 }
+
+                rqueue = it->second->get_rqueue(stream);
+                if (rqueue == NULL) {
+                        *len = 0;
+                        return;
+                }
                 
                 int   total = 0;
                 char *dst = (char*)buf;
-                while (! it->second->rqueue.empty()) {
-                        packetbuf_ptr  pbuf = it->second->rqueue.front();
+                while (! rqueue->empty()) {
+                        packetbuf_ptr  pbuf = rqueue->front();
 
                         if (total + pbuf->get_len() > *len) {
                                 *len = total;
@@ -328,6 +590,34 @@ namespace libcage {
                         total += pbuf->get_len();
                         dst   += pbuf->get_len();
 
+                        rqueue->pop();
+                }
+
+                *len = total;
+        }
+
+        void
+        rdp::receive(int desc, std::vector<packetbuf_ptr> &bufs, int *len)
+        {
+                std::map<int, rdp_con_ptr>::iterator it;
+
+                it = m_desc2conn.find(desc);
+                if (it == m_desc2conn.end()) {
+                        *len = 0;
+                        return;
+                }
+
+                int total = 0;
+                while (! it->second->rqueue.empty()) {
+                        packetbuf_ptr  pbuf = it->second->rqueue.front();
+
+                        if (total + pbuf->get_len() > *len)
+                                break;
+
+                        bufs.push_back(pbuf);
+
+                        total += pbuf->get_len();
+
                         it->second->rqueue.pop();
                 }
 
@@ -366,11 +656,21 @@ namespace libcage {
 
         int
         rdp::send(int desc, const void *buf, int len)
+        {
+                return send(desc, 0, buf, len);
+        }
+
+        int
+        rdp::send(int desc, uint16_t stream, const void *buf, int len)
         {
                 std::map<int, rdp_con_ptr>::iterator it;
 
                 it = m_desc2conn.find(desc);
-                if (it == m_desc2conn.end() || it->second->state != OPEN)
+                if (it == m_desc2conn.end() || ! it->second->is_sendable())
+                        return -1;
+
+                if (stream >= stream_max ||
+                    (stream > 0 && ! it->second->is_stream))
                         return -1;
 
                 if (len <= 0)
@@ -380,14 +680,14 @@ namespace libcage {
 
                 for (;;) {
                         packetbuf_ptr pbuf = packetbuf::construct();
-                        int   dmax = it->second->sbuf_max - sizeof(rdp_head);
+                        int   dmax = it->second->get_dmax();
                         int   size = (len < dmax) ? len : dmax;
                         void *data;
 
                         data = pbuf->append(size);
                         memcpy(data, buf, size);
 
-                        if (! it->second->enqueue_swnd(pbuf))
+                        if (! it->second->enqueue_swnd(pbuf, stream))
                                 return total;
 
                         total += size;
@@ -402,6 +702,31 @@ namespace libcage {
                 return -1;
         }
 
+        int
+        rdp::send(int desc, packetbuf_ptr pbuf)
+        {
+                std::map<int, rdp_con_ptr>::iterator it;
+
+                it = m_desc2conn.find(desc);
+                if (it == m_desc2conn.end() || ! it->second->is_sendable())
+                        return -1;
+
+                int len  = pbuf->get_len();
+                int dmax = it->second->get_dmax();
+
+                if (len <= 0)
+                        return 0;
+
+                // headers of RDP and lower layers are prepended
+                if (len > dmax || pbuf->get_headroom() < PBUF_DEFAULT_OFFSET)
+                        return send(desc, pbuf->get_data(), len);
+
+                if (! it->second->enqueue_swnd(pbuf, 0))
+                        return 0;
+
+                return len;
+        }
+
         void
         rdp::close(int desc)
         {
@@ -410,6 +735,7 @@ namespace libcage {
                 it_ls = m_listening.right.find(desc);
                 if (it_ls != m_listening.right.end()) {
                         m_listening.right.erase(it_ls);
+                        m_listening_conf.erase(desc);
                         return;
                 }
 
@@ -444,10 +770,13 @@ namespace libcage {
                         rst->dport  = htons(it->second->addr.dport);
                         rst->seqnum = htonl(it->second->snd_nxt);
 
-                        it->second->rst_time     = time(NULL);
+                        it->second->rst_time     = get_clock();
                         it->second->rst_tout     = 1;
                         it->second->is_retry_rst = true;
 
+                        schedule(*it->second, it->second->rst_time +
+                                 it->second->rst_tout);
+
                         output(it->second->addr.did, pbuf);
                         break;
                 }
@@ -506,6 +835,19 @@ namespace libcage {
                 }
         }
 
+        rdp_cc_ptr
+        rdp::create_cc()
+        {
+                switch (m_cc_algo) {
+                case CC_CUBIC:
+                        return rdp_cc_ptr(new rdp_cc_cubic);
+                case CC_DELAY:
+                        return rdp_cc_ptr(new rdp_cc_delay);
+                default:
+                        return rdp_cc_ptr(new rdp_cc_newreno);
+                }
+        }
+
         int
         rdp::generate_desc()
         {
@@ -519,44 +861,234 @@ namespace libcage {
                 return desc;
         }
 
-        // passive open
-        int
-        rdp::listen(uint16_t sport, callback_rdp_event func)
+        void
+        rdp::set_config(rdp_con &con, const rdp_config &conf)
         {
-                if (m_listening.left.find(sport) == m_listening.left.end()) {
-                        int desc = generate_desc();
+                con.rcv_max  = conf.rcv_max;
+                con.rbuf_max = conf.rbuf_max;
+                con.sbuf_len = conf.sbuf_len;
 
-                        m_desc_set.insert(desc);
-                        m_listening.insert(listening_val(sport, desc));
-                        m_desc2event[desc] = func;
+                con.is_stream = conf.is_stream;
+                con.is_sack   = true;
+                con.snd_fec   = conf.fec_block;
+                con.rcv_fec   = 0;
 
-                        return desc;
-                }
+                con.pace_burst = conf.pace_burst;
 
-                return -1;
+                if (con.snd_fec > fec_block_max)
+                        con.snd_fec = fec_block_max;
+
+                if (con.rcv_max == 0)
+                        con.rcv_max = 1;
+
+                if (con.rbuf_max > sbuf_limit)
+                        con.rbuf_max = sbuf_limit;
+                else if (con.rbuf_max <= sizeof(rdp_head))
+                        con.rbuf_max = sizeof(rdp_head) + 1;
+
+                if (con.sbuf_len == 0)
+                        con.sbuf_len = 1;
         }
 
-        // active open
-        int
-        rdp::connect(uint16_t sport, id_ptr did, uint16_t dport,
-                     callback_rdp_event func)
+        packetbuf_ptr
+        rdp::make_syn(rdp_con &con, bool is_ack)
         {
-                // If remote port not specified
-                //   Return "Error - remote port not specified"
-                // Endif
-                // Generate SND.ISS
-                // Set SND.NXT = SND.ISS + 1
-                //     SND.UNA = SND.ISS
-                // Fill in RCV.MAX, RBUF.MAX from Open parameters
-                // If local port not specified
-                //   Allocate a local port
-                // Endif
-                // Send <SEQ=SND.ISS><MAX=RCV.MAX><BUFMAX=RBUF.MAX><SYN>
-                // Set State = SYN-SENT
-                // Return (local port, connection identifier)
+                packetbuf_ptr  pbuf = packetbuf::construct();
+                rdp_syn_opt   *opt;
+                uint32_t       segs  = con.rcv_max;
+                uint8_t        shift = 0;
+
+                // window scaling
+                while (segs > 0xffff && shift < wnd_shift_max) {
+                        segs >>= 1;
+                        shift++;
+                }
 
-                rdp_con_ptr p_con(new rdp_con(*this));
-                rdp_addr    addr;
+                if (segs > 0xffff)
+                        segs = 0xffff;
+
+                opt = (rdp_syn_opt*)pbuf->append(sizeof(*opt));
+                memset(opt, 0, sizeof(*opt));
+
+                opt->syn.head.flags  = flag_syn | flag_ver;
+                opt->syn.head.hlen   = (uint8_t)(sizeof(*opt) / 2);
+                opt->syn.head.sport  = htons(con.addr.sport);
+                opt->syn.head.dport  = htons(con.addr.dport);
+                opt->syn.head.seqnum = htonl(con.snd_iss);
+
+                if (is_ack) {
+                        opt->syn.head.flags |= flag_ack;
+                        opt->syn.head.acknum = htonl(con.rcv_cur);
+                }
+
+                opt->syn.out_segs_max = htons(segs);
+                opt->syn.seg_size_max = htons(con.rbuf_max);
+                opt->wnd_shift        = shift;
+
+                if (con.is_stream)
+                        opt->options |= syn_opt_stream;
+
+                if (con.is_sack)
+                        opt->options |= syn_opt_sack;
+
+                // parity segments can be always decoded
+                opt->options  |= syn_opt_fec;
+                opt->fec_block = con.snd_fec;
+
+                if (is_ack) {
+                        if (con.is_accepted)
+                                opt->options |= syn_opt_data;
+                } else if (con.syn_data.get() != NULL) {
+                        int   len = con.syn_data->get_len();
+                        void *data;
+
+                        opt->options      |= syn_opt_data;
+                        opt->syn.head.dlen = htons(len);
+
+                        data = pbuf->append(len);
+                        memcpy(data, con.syn_data->get_data(), len);
+                }
+
+                return pbuf;
+        }
+
+        uint8_t
+        rdp::read_syn(rdp_con &con, packetbuf_ptr pbuf)
+        {
+                rdp_syn *syn     = (rdp_syn*)pbuf->get_data();
+                uint8_t  shift   = 0;
+                uint8_t  options = 0;
+                uint8_t  fec     = 0;
+
+                if (syn->head.hlen * 2 >= (int)sizeof(rdp_syn_opt) &&
+                    pbuf->get_len() >= (int)sizeof(rdp_syn_opt)) {
+                        shift   = ((rdp_syn_opt*)syn)->wnd_shift;
+                        options = ((rdp_syn_opt*)syn)->options;
+                        fec     = ((rdp_syn_opt*)syn)->fec_block;
+
+                        if (shift > wnd_shift_max)
+                                shift = wnd_shift_max;
+                }
+
+                // substreams are used when both ends want them
+                if (! (options & syn_opt_stream))
+                        con.is_stream = false;
+
+                if (! (options & syn_opt_sack))
+                        con.is_sack = false;
+
+                if (! (options & syn_opt_fec))
+                        con.snd_fec = 0;
+
+                con.rcv_fec = (fec > fec_block_max) ? 0 : fec;
+
+                con.rcv_cur  = ntohl(syn->head.seqnum);
+                con.rcv_irs  = con.rcv_cur;
+                con.rcv_ack  = con.rcv_cur;
+                con.snd_max   = (uint32_t)ntohs(syn->out_segs_max) << shift;
+                con.sbuf_peer = ntohs(syn->seg_size_max);
+
+                if (con.snd_max == 0)
+                        con.snd_max = 1;
+
+                set_sbuf_max(con);
+
+                return options;
+        }
+
+        void
+        rdp::set_sbuf_max(rdp_con &con)
+        {
+                con.sbuf_max = con.sbuf_peer;
+
+                if (con.sbuf_max > sbuf_limit)
+                        con.sbuf_max = sbuf_limit;
+
+                if (m_path_mtu_func) {
+                        // leave room for the headers of dgram and proxy
+                        int mtu = m_path_mtu_func(con.addr.did) -
+                                  (int)sizeof(msg_hdr) * 2;
+
+                        if (mtu > 0 && (uint32_t)mtu < con.sbuf_max)
+                                con.sbuf_max = mtu;
+                }
+
+                if (con.sbuf_max <= sizeof(rdp_head))
+                        con.sbuf_max = sizeof(rdp_head) + 1;
+        }
+
+        void
+        rdp::set_callback_path_mtu(callback_path_mtu func)
+        {
+                m_path_mtu_func = func;
+        }
+
+        void
+        rdp::update_path_mtu(id_ptr id)
+        {
+                boost::unordered_map<rdp_addr, rdp_con_ptr>::iterator it;
+
+                for (it = m_addr2conn.begin(); it != m_addr2conn.end(); ++it) {
+                        // the SYN of the foreign host is not received yet
+                        if (it->second->sbuf_peer == 0)
+                                continue;
+
+                        if (*it->first.did == *id)
+                                set_sbuf_max(*it->second);
+                }
+        }
+
+        // passive open
+        int
+        rdp::listen(uint16_t sport, callback_rdp_event func,
+                    const rdp_config &conf)
+        {
+                if (m_listening.left.find(sport) == m_listening.left.end()) {
+                        int desc = generate_desc();
+
+                        m_desc_set.insert(desc);
+                        m_listening.insert(listening_val(sport, desc));
+                        m_listening_conf[desc] = conf;
+                        m_desc2event[desc] = func;
+
+                        return desc;
+                }
+
+                return -1;
+        }
+
+        // active open
+        int
+        rdp::connect(uint16_t sport, id_ptr did, uint16_t dport,
+                     callback_rdp_event func, const rdp_config &conf)
+        {
+                return connect(sport, did, dport, func, NULL, 0, conf);
+        }
+
+        int
+        rdp::connect(uint16_t sport, id_ptr did, uint16_t dport,
+                     callback_rdp_event func, const void *buf, int len,
+                     const rdp_config &conf)
+        {
+                // If remote port not specified
+                //   Return "Error - remote port not specified"
+                // Endif
+                // Generate SND.ISS
+                // Set SND.NXT = SND.ISS + 1
+                //     SND.UNA = SND.ISS
+                // Fill in RCV.MAX, RBUF.MAX from Open parameters
+                // If local port not specified
+                //   Allocate a local port
+                // Endif
+                // Send <SEQ=SND.ISS><MAX=RCV.MAX><BUFMAX=RBUF.MAX><SYN>
+                // Set State = SYN-SENT
+                // Return (local port, connection identifier)
+
+                if (len < 0 || len > syn_data_max)
+                        return -1;
+
+                rdp_con_ptr p_con(new rdp_con(*this));
+                rdp_addr    addr;
 
 
                 // check whether resouces are avilable
@@ -582,28 +1114,26 @@ namespace libcage {
                 p_con->snd_iss   = m_rnd();
                 p_con->snd_nxt   = p_con->snd_iss + 1;
                 p_con->snd_una   = p_con->snd_iss;
-                p_con->rcv_max   = rcv_max_default;
-                p_con->rbuf_max  = rbuf_max_default;
                 p_con->is_closed = false;
 
+                p_con->is_accepted = false;
 
-                // create syn packet
-                packetbuf_ptr  pbuf = packetbuf::construct();
-                rdp_syn       *syn;
-                
-                syn = (rdp_syn*)pbuf->append(sizeof(*syn));
-                memset(syn, 0, sizeof(*syn));
+                if (len > 0) {
+                        void *data;
+
+                        p_con->syn_data = packetbuf::construct();
+
+                        data = p_con->syn_data->append(len);
+                        memcpy(data, buf, len);
+                }
 
-                syn->head.flags  = flag_syn | flag_ver;
-                syn->head.hlen   = (uint8_t)(sizeof(*syn) / 2);
-                syn->head.sport  = htons(addr.sport);
-                syn->head.dport  = htons(dport);
-                syn->head.seqnum = htonl(p_con->snd_iss);
+                set_config(*p_con, conf);
 
-                syn->out_segs_max = htons(p_con->rcv_max);
-                syn->seg_size_max = htons(p_con->rbuf_max);
 
-                p_con->syn_time = time(NULL);
+                // create syn packet
+                packetbuf_ptr pbuf = make_syn(*p_con, false);
+
+                p_con->syn_time = get_clock();
                 p_con->syn_tout = 1;
 
 
@@ -617,6 +1147,8 @@ namespace libcage {
                 m_desc2conn[desc]  = p_con;
                 m_desc2event[desc] = func;
 
+                schedule(*p_con, p_con->syn_time + p_con->syn_tout);
+
 
                 // send syn
                 output(addr.did, pbuf);
@@ -787,7 +1319,7 @@ namespace libcage {
                         rst->dport  = htons(addr.dport);
                         rst->seqnum = htonl(p_con->snd_nxt);
 
-                        p_con->rst_time = time(NULL);
+                        p_con->rst_time = get_clock();
                         output(addr.did, pbuf);
                 }
         }
@@ -823,7 +1355,7 @@ namespace libcage {
                         rst->dport  = htons(addr.dport);
                         rst->seqnum = htonl(p_con->snd_nxt);
 
-                        p_con->rst_time = time(NULL);
+                        p_con->rst_time = get_clock();
                         output(p_con->addr.did, pbuf_rst);
                 }
         }
@@ -936,10 +1468,7 @@ namespace libcage {
                                 return;
 
                         // create connection
-                        rdp_con_ptr  p_con(new rdp_con(*this));
-                        rdp_syn     *syn_in;
-
-                        syn_in = (rdp_syn*)head;
+                        rdp_con_ptr p_con(new rdp_con(*this));
 
                         p_con->addr      = addr;
                         p_con->is_pasv   = true;
@@ -947,17 +1476,20 @@ namespace libcage {
                         p_con->snd_iss   = m_rnd();
                         p_con->snd_nxt   = p_con->snd_iss + 1;
                         p_con->snd_una   = p_con->snd_iss;
-                        p_con->rcv_max   = rcv_max_default;
-                        p_con->rbuf_max  = rbuf_max_default;
-                        p_con->rcv_cur   = ntohl(syn_in->head.seqnum);
-                        p_con->rcv_irs   = p_con->rcv_cur;
-                        p_con->rcv_ack   = p_con->rcv_cur;
-                        p_con->snd_max   = ntohs(syn_in->out_segs_max);
-                        p_con->sbuf_max  = ntohs(syn_in->seg_size_max);
                         p_con->is_closed = false;
 
-                        if (p_con->sbuf_max > sbuf_limit)
-                                p_con->sbuf_max = sbuf_limit;
+                        int ldesc = m_listening.left.find(addr.sport)->second;
+                        int hlen  = head->hlen * 2;
+                        int dlen  = ntohs(head->dlen);
+
+                        uint8_t options;
+
+                        set_config(*p_con, m_listening_conf[ldesc]);
+                        options = read_syn(*p_con, pbuf);
+
+                        p_con->is_accepted = ((options & syn_opt_data) &&
+                                              dlen > 0 &&
+                                              hlen + dlen == pbuf->get_len());
 
                         p_con->init_swnd();
                         p_con->init_rwnd();
@@ -965,24 +1497,9 @@ namespace libcage {
 
                         // create syn ack packet
                         // enqueue
-                        packetbuf_ptr  pbuf_syn = packetbuf::construct();
-                        rdp_syn       *syn_out;
-
-                        syn_out = (rdp_syn*)pbuf_syn->append(sizeof(*syn_out));
+                        packetbuf_ptr pbuf_syn = make_syn(*p_con, true);
 
-                        memset(syn_out, 0, sizeof(*syn_out));
-
-                        syn_out->head.flags  = flag_syn | flag_ack | flag_ver;
-                        syn_out->head.hlen   = (uint8_t)(sizeof(*syn_out) / 2);
-                        syn_out->head.sport  = htons(addr.sport);
-                        syn_out->head.dport  = htons(addr.dport);
-                        syn_out->head.seqnum = htonl(p_con->snd_iss);
-                        syn_out->head.acknum = htonl(p_con->rcv_cur);
-
-                        syn_out->out_segs_max = htons(p_con->rcv_max);
-                        syn_out->seg_size_max = htons(p_con->rbuf_max);
-
-                        p_con->syn_time = time(NULL);
+                        p_con->syn_time = get_clock();
                         p_con->syn_tout = 1;
 
                         p_con->acked_time.update();
@@ -996,9 +1513,24 @@ namespace libcage {
                         m_addr2conn[addr] = p_con;
                         m_desc2conn[desc] = p_con;
 
+                        schedule(*p_con, p_con->syn_time + p_con->syn_tout);
+
 
                         // send syn ack
                         output(addr.did, pbuf_syn);
+
+                        if (! p_con->is_accepted)
+                                return;
+
+                        // the data in the SYN is given to the listener
+                        // without waiting for the handshake
+                        pbuf->rm_head(hlen);
+                        p_con->rqueue.push(pbuf);
+
+                        invoke_event(ldesc, desc, addr, ACCEPTED);
+
+                        if (m_desc2conn.find(desc) != m_desc2conn.end())
+                                invoke_event(desc, 0, addr, READY2READ);
                 }
 
                 // If anything else (should never get here)
@@ -1086,15 +1618,9 @@ namespace libcage {
                                 return;
 
                         rdp_syn *syn = (rdp_syn*)head;
+                        uint8_t  options;
 
-                        p_con->rcv_cur  = ntohl(syn->head.seqnum);
-                        p_con->rcv_irs  = p_con->rcv_cur;
-                        p_con->rcv_ack  = p_con->rcv_cur;
-                        p_con->snd_max  = ntohs(syn->out_segs_max);
-                        p_con->sbuf_max = ntohs(syn->seg_size_max);
-
-                        if (p_con->sbuf_max > sbuf_limit)
-                                p_con->sbuf_max = sbuf_limit;
+                        options = read_syn(*p_con, pbuf);
 
                         p_con->init_swnd();
                         p_con->init_rwnd();
@@ -1121,32 +1647,28 @@ namespace libcage {
 
                                 output(addr.did, pbuf_ack);
 
+                                // the peer didn't take the data in the SYN
+                                if (p_con->syn_data.get() != NULL &&
+                                    ! (options & syn_opt_data))
+                                        p_con->enqueue_swnd(p_con->syn_data,
+                                                            0);
+
+                                p_con->syn_data.reset();
+
                                 // invoke the signal of "Connection Established"
                                 invoke_event(p_con->desc, 0, addr, CONNECTED);
                         } else {
                                 p_con->state = SYN_RCVD;
 
                                 // send syn ack
-                                packetbuf_ptr  pbuf_syn = packetbuf::construct();
-                                rdp_syn       *syn_out;
-
-                                syn_out = (rdp_syn*)pbuf_syn->append(sizeof(*syn_out));
-
-                                memset(syn_out, 0, sizeof(*syn_out));
-
-                                syn_out->head.flags  = flag_syn | flag_ack | flag_ver;
-                                syn_out->head.hlen   = (uint8_t)(sizeof(*syn_out) / 2);
-                                syn_out->head.sport  = htons(addr.sport);
-                                syn_out->head.dport  = htons(addr.dport);
-                                syn_out->head.seqnum = htonl(p_con->snd_iss);
-                                syn_out->head.acknum = htonl(p_con->rcv_cur);
+                                packetbuf_ptr pbuf_syn = make_syn(*p_con, true);
 
-                                syn_out->out_segs_max = htons(p_con->rcv_max);
-                                syn_out->seg_size_max = htons(p_con->rbuf_max);
-
-                                p_con->syn_time = time(NULL);
+                                p_con->syn_time = get_clock();
                                 p_con->syn_tout = 1;
 
+                                schedule(*p_con, p_con->syn_time +
+                                         p_con->syn_tout);
+
                                 output(addr.did, pbuf_syn);
                         }
                 }
@@ -1177,23 +1699,9 @@ namespace libcage {
                         //        <BUFMAX=RBUF.MAX><ACK><SYN>
                         //   Return
                         // Endif
-                        packetbuf_ptr  pbuf = packetbuf::construct();
-                        rdp_syn       *syn;
-                
-                        syn = (rdp_syn*)pbuf->append(sizeof(*syn));
-                        memset(syn, 0, sizeof(*syn));
+                        packetbuf_ptr pbuf = make_syn(*p_con, true);
 
-                        syn->head.flags  = flag_ack | flag_syn | flag_ver;
-                        syn->head.hlen   = (uint8_t)(sizeof(*syn) / 2);
-                        syn->head.sport  = htons(addr.sport);
-                        syn->head.dport  = htons(addr.dport);
-                        syn->head.seqnum = htonl(p_con->snd_iss);
-
-                        syn->out_segs_max = htons(p_con->rcv_max);
-                        syn->seg_size_max = htons(p_con->rbuf_max);
-
-
-                        p_con->syn_time = time(NULL);
+                        p_con->syn_time = get_clock();
 
                         output(addr.did, pbuf);
 
@@ -1241,7 +1749,7 @@ namespace libcage {
                         //   Return
                         // Endif
 
-                        if (p_con->is_pasv) {
+                        if (p_con->is_pasv && ! p_con->is_accepted) {
                                 m_desc_set.erase(p_con->desc);
                                 m_desc2event.erase(p_con->desc);
                                 m_addr2conn.erase(p_con->addr);
@@ -1278,7 +1786,7 @@ namespace libcage {
                         rst->dport  = htons(addr.dport);
                         rst->seqnum = htonl(acknum + 1);
 
-                        if (p_con->is_pasv) {
+                        if (p_con->is_pasv && ! p_con->is_accepted) {
                                 m_desc_set.erase(p_con->desc);
                                 m_desc2event.erase(p_con->desc);
                                 m_addr2conn.erase(p_con->addr);
@@ -1291,7 +1799,7 @@ namespace libcage {
                         }
 
                         output(addr.did, pbuf_rst);
-                } else if (head->flags & flag_eak) {
+                } else if (head->flags & flag_eak && ! p_con->is_accepted) {
                         // If EACK set
                         //   Send <SEQ=SEG.ACK + 1><RST>
                         //   Discard segment
@@ -1333,6 +1841,17 @@ namespace libcage {
 
                         acknum = ntohl(head->acknum);
 
+                        if (p_con->is_accepted &&
+                            acknum - p_con->snd_iss <
+                            p_con->snd_nxt - p_con->snd_iss) {
+                                // the segments sent before the handshake
+                                // completed may be acknowledged as well
+                                p_con->state = OPEN;
+
+                                in_state_open(p_con, addr, pbuf);
+                                return;
+                        }
+
                         if (acknum == p_con->snd_iss) {
                                 p_con->state = OPEN;
 
@@ -1351,6 +1870,10 @@ namespace libcage {
                                                 this->close(p_con->desc);
                                                 return;
                                         }
+                                } else if (p_con->syn_data.get() != NULL) {
+                                        p_con->enqueue_swnd(p_con->syn_data,
+                                                            0);
+                                        p_con->syn_data.reset();
                                 }
                                 // If Data in segment or NUL set
                                 //   If the received segment is in sequence
@@ -1384,7 +1907,7 @@ namespace libcage {
                                         
                                         p_con->rwnd_recv_data(pbuf, seq);
 
-                                        if (p_con->rqueue.size() > 0) {
+                                        if (p_con->is_readable()) {
                                                 // invoke the signal of
                                                 // "Ready to Read"
                                                 invoke_event(p_con->desc, 0,
@@ -1417,6 +1940,20 @@ namespace libcage {
                 rdp_head *head = (rdp_head*)pbuf->get_data();
                 uint32_t  seq = ntohl(head->seqnum);
 
+                if (head->flags & flag_fec) {
+                        if (p_con->rcv_fec == 0)
+                                return;
+
+                        p_con->recv_fec(pbuf);
+
+                        if (p_con->is_readable()) {
+                                // invoke the signal of "Ready to Read"
+                                invoke_event(p_con->desc, 0, addr, READY2READ);
+                        }
+
+                        return;
+                }
+
                 if (seq - p_con->rcv_cur - 1 >= p_con->rcv_max * 2) {
                         // If RCV.CUR < SEG.SEQ =< RCV.CUR + (RCV.MAX * 2)
                         //   Segment sequence number acceptable
@@ -1473,10 +2010,11 @@ namespace libcage {
                         rst->dport  = htons(addr.dport);
                         rst->seqnum = htonl(p_con->snd_nxt);
 
-                        p_con->rst_time     = time(NULL);
+                        p_con->rst_time     = get_clock();
                         p_con->rst_tout     = 1;
                         p_con->is_retry_rst = true;
 
+                        schedule(*p_con, p_con->rst_time + p_con->rst_tout);
 
                         output(addr.did, pbuf_rst);
 
@@ -1553,9 +2091,18 @@ namespace libcage {
                         len /= 2;
 
                         eacks = (uint32_t*)&head[1];
-                        for (i = 0; i < len; i++) {
-                                p_con->recv_eack(ntohl(eacks[i]));
+                        if (p_con->is_sack) {
+                                for (i = 0; i + 1 < len; i += 2) {
+                                        p_con->recv_sack(ntohl(eacks[i]),
+                                                         ntohl(eacks[i + 1]));
+                                }
+                        } else {
+                                for (i = 0; i < len; i++) {
+                                        p_con->recv_eack(ntohl(eacks[i]));
+                                }
                         }
+
+                        p_con->detect_loss();
                 }
 
                 // If Data in segment
@@ -1583,11 +2130,18 @@ namespace libcage {
 
                         p_con->rwnd_recv_data(pbuf, seq);
 
-                        if (p_con->rqueue.size() > 0) {
+                        if (p_con->is_readable()) {
                                 // invoke the signal of "Ready to Read"
                                 invoke_event(p_con->desc, 0, addr, READY2READ);
                         }
                 }
+
+                if (p_con->state == OPEN && p_con->is_writable()) {
+                        p_con->is_blocked = false;
+
+                        // invoke the signal of "Writable"
+                        invoke_event(p_con->desc, 0, addr, WRITABLE);
+                }
         }
 
         void
@@ -1606,166 +2160,804 @@ namespace libcage {
         }
 
         void
-        rdp_con::init_rwnd()
+        rdp_bitmap::resize(int len)
         {
-                m_rwnd_len  = rcv_max * 2;
-                m_rwnd_head = 0;
-                m_rwnd_used = 0;
+                m_len = len;
+                m_bits.assign((len + 63) / 64, 0);
+        }
 
-                m_rwnd = boost::shared_array<rwnd>(new rwnd[m_rwnd_len]);
+        bool
+        rdp_bitmap::test(int idx) const
+        {
+                return (m_bits[idx >> 6] >> (idx & 63)) & 1;
         }
 
         void
-        rdp_con::init_swnd()
+        rdp_bitmap::set(int idx)
         {
-                m_swnd_len    = snd_max * 4;
-                m_swnd_head   = 0;
-                m_swnd_used   = 0;
-                m_swnd_ostand = 0;
-
-                m_swnd = boost::shared_array<swnd>(new swnd[m_swnd_len]);
+                m_bits[idx >> 6] |= (uint64_t)1 << (idx & 63);
         }
 
-        bool
-        rdp_con::retransmit()
+        void
+        rdp_bitmap::reset(int idx)
         {
-                if (m_swnd_used == 0)
-                        return true;
-
-                int i = m_swnd_head;
-                for (int n = 0; n < m_swnd_used; n++) {
-                        swnd *p_wnd = &m_swnd[i];
-
-                        i++;
-                        if (i >= m_swnd_len)
-                                i %= m_swnd_len;
-                        
-
-                        if (! p_wnd->is_sent)
-                                break;
+                m_bits[idx >> 6] &= ~((uint64_t)1 << (idx & 63));
+        }
 
-                        if (p_wnd->is_acked)
-                                continue;
+        int
+        rdp_bitmap::find(int idx, int n, bool val) const
+        {
+                int off = 0;
 
-                        if (p_wnd->rt_sec > ref_rdp.m_max_retrans) {
-                                // broken pipe
-                                state = CLOSED;
-                                ref_rdp.invoke_event(desc, 0, addr, BROKEN);
+                // a word at a time
+                while (off < n) {
+                        int      pos  = (idx + off) % m_len;
+                        int      bit  = pos & 63;
+                        int      span = 64 - bit;
+                        uint64_t w    = m_bits[pos >> 6];
 
-                                return false;
-                        }
+                        if (! val)
+                                w = ~w;
 
-                        time_t now  = time(NULL);
-                        time_t diff = now - p_wnd->sent_time;
+                        if (span > m_len - pos)
+                                span = m_len - pos;
 
-                        if (diff > p_wnd->rt_sec) {
-                                // retransmit
-                                rdp_head *head = (rdp_head*)p_wnd->pbuf->get_data();
+                        if (span > n - off)
+                                span = n - off;
 
-                                head->acknum = htonl(rcv_cur);
+                        w >>= bit;
+                        if (span < 64)
+                                w &= ((uint64_t)1 << span) - 1;
 
-                                p_wnd->sent_time  = now;
-                                p_wnd->rt_sec    *= 2;
+                        if (w != 0) {
+                                while (! (w & 1)) {
+                                        w >>= 1;
+                                        off++;
+                                }
 
-                                ref_rdp.output(addr.did, p_wnd->pbuf);
+                                return off;
                         }
+
+                        off += span;
                 }
 
-                return true;
+                return n;
         }
 
-        bool
-        rdp_con::enqueue_swnd(packetbuf_ptr pbuf)
+        void
+        rdp_fec::add(int off, const void *buf, int size)
         {
-                if (m_swnd_used >= m_swnd_len || state != OPEN)
-                        return false;
-
-                swnd *p_wnd;
-                int   pos = (m_swnd_head + m_swnd_used) % m_swnd_len;
+                const uint8_t *p = (const uint8_t*)buf;
 
-                p_wnd = &m_swnd[pos];
+                if (data.size() < (size_t)size)
+                        data.resize(size, 0);
 
-                p_wnd->pbuf      = pbuf;
-                p_wnd->sent_time = 0;
-                p_wnd->is_acked  = false;
-                p_wnd->is_sent   = false;
-                p_wnd->rt_sec    = 1;
+                for (int i = 0; i < size; i++)
+                        data[i] ^= p[i];
 
-                m_swnd_used++;
+                len  ^= (uint16_t)size;
+                mask |= (uint64_t)1 << off;
+        }
 
-                send_ostand_swnd();
+        void
+        rdp_fec::clear()
+        {
+                data.clear();
+                len  = 0;
+                mask = 0;
+        }
 
-                return true;
+        void
+        rdp_con::schedule_fec()
+        {
+                ref_rdp.schedule(*this, m_fec_time + rdp::fec_delay);
         }
 
         void
-        rdp_con::send_ostand_swnd()
+        rdp_con::send_fec(bool is_flush)
         {
-                int i   = m_swnd_ostand;
-                int end = (m_swnd_head + m_swnd_used) % m_swnd_len;
+                int count = 0;
 
-                while (i != end) {
-                        if (snd_nxt - snd_una < snd_max) {
-                                swnd *p_wnd = &m_swnd[i];
+                while (count < 64 && (m_fec.mask >> count) & 1)
+                        count++;
 
-                                p_wnd->sent_time = time(NULL);
-                                p_wnd->is_sent   = true;
-                                p_wnd->seqnum    = snd_nxt;
+                if (count <= m_fec_sent)
+                        return;
 
-                                
-                                rdp_head *head;
-                                uint16_t  len = p_wnd->pbuf->get_len();
+                // a partial block waits for more segments for a while
+                if (is_flush &&
+                    ref_rdp.get_clock() < m_fec_time + rdp::fec_delay) {
+                        schedule_fec();
+                        return;
+                }
 
-                                head = (rdp_head*)p_wnd->pbuf->prepend(sizeof(*head));
+                packetbuf_ptr  pbuf = packetbuf::construct();
+                rdp_fec_head  *head;
+                int            dlen = m_fec.data.size();
 
-                                memset(head, 0, sizeof(*head));
+                head = (rdp_fec_head*)pbuf->append(sizeof(*head));
 
-                                head->flags  = rdp::flag_ack | rdp::flag_ver;
-                                head->hlen   = (uint8_t)sizeof(*head) / 2;
-                                head->sport  = htons(addr.sport);
-                                head->dport  = htons(addr.dport);
-                                head->dlen   = htons(len);
-                                head->seqnum = htonl(snd_nxt);
-                                head->acknum = htonl(rcv_cur);
+                memset(head, 0, sizeof(*head));
 
-                                ref_rdp.output(addr.did, p_wnd->pbuf);
+                head->head.flags  = rdp::flag_fec | rdp::flag_ver;
+                head->head.hlen   = (uint8_t)(sizeof(*head) / 2);
+                head->head.sport  = htons(addr.sport);
+                head->head.dport  = htons(addr.dport);
+                head->head.dlen   = htons(dlen);
+                head->head.seqnum = htonl(m_fec_first);
+                head->count       = htons(count);
+                head->len         = htons(m_fec.len);
 
+                if (dlen > 0)
+                        memcpy(pbuf->append(dlen), &m_fec.data[0], dlen);
 
-                                snd_nxt++;
+                ref_rdp.output(addr.did, pbuf);
 
-                                i++;
-                                if (i >= m_swnd_len)
-                                        i %= m_swnd_len;
+                m_fec_sent = count;
+        }
 
-                        } else {
-                                break;
-                        }
-                }
+        void
+        rdp_con::add_fec(packetbuf_ptr pbuf, uint32_t seqnum)
+        {
+                uint32_t off = seqnum - rcv_irs - 1;
 
-                m_swnd_ostand = i;
+                m_fec_blocks[off / rcv_fec].add(off % rcv_fec,
+                                                pbuf->get_data(),
+                                                pbuf->get_len());
         }
 
         void
-        rdp_con::recv_ack(uint32_t acknum)
+        rdp_con::recv_fec(packetbuf_ptr pbuf)
         {
-                // If ACK set
-                //   If SND.UNA =< SEG.ACK < SND.NXT
-                //     Set SND.UNA = SEG.ACK
-                //     Flush acknowledged segments
-                //   Endif
-                // Endif
+                rdp_fec_head *head = (rdp_fec_head*)pbuf->get_data();
+                int           hlen;
+                int           dlen;
 
-                if (acknum - snd_una < snd_nxt - snd_una) {
-                        int i = m_swnd_head;
+                if (pbuf->get_len() < (int)sizeof(*head))
+                        return;
 
-                        while (i != m_swnd_ostand) {
+                hlen = head->head.hlen * 2;
+                dlen = ntohs(head->head.dlen);
+
+                if (hlen < (int)sizeof(*head) || hlen + dlen != pbuf->get_len())
+                        return;
+
+                uint32_t first = ntohl(head->head.seqnum);
+                uint32_t off   = first - rcv_irs - 1;
+                int      count = ntohs(head->count);
+
+                if (count == 0 || count > rcv_fec || off % rcv_fec != 0)
+                        return;
+
+                std::map<uint32_t, rdp_fec>::iterator it;
+                rdp_fec   none;
+                rdp_fec  *p_fec = &none;
+                uint64_t  all;
+                uint64_t  missing;
+
+                it = m_fec_blocks.find(off / rcv_fec);
+                if (it != m_fec_blocks.end())
+                        p_fec = &it->second;
+
+                all     = (count < 64) ? ((uint64_t)1 << count) - 1 : ~0ULL;
+                missing = all & ~p_fec->mask;
+
+                // a segment can be rebuilt when it is the only one lost
+                // among those covered
+                if (missing == 0 || (missing & (missing - 1)) != 0 ||
+                    (p_fec->mask & ~all) != 0)
+                        return;
+
+                int m = 0;
+
+                while (! ((missing >> m) & 1))
+                        m++;
+
+                uint32_t seqnum = first + m;
+                int      size   = p_fec->len ^ ntohs(head->len);
+
+                if (seqnum - rcv_cur - 1 >= (uint32_t)m_rwnd_len ||
+                    size > dlen)
+                        return;
+
+                pbuf->rm_head(hlen);
+                pbuf->set_len(size);
+
+                uint8_t *data = (uint8_t*)pbuf->get_data();
+                int      n    = p_fec->data.size();
+
+                for (int i = 0; i < size && i < n; i++)
+                        data[i] ^= p_fec->data[i];
+
+                fec_recovered++;
+
+                rwnd_recv_data(pbuf, seqnum);
+        }
+
+        void
+        rdp_con::init_rwnd()
+        {
+                m_rwnd_len  = rcv_max * 2;
+                m_rwnd_head = 0;
+                m_rwnd_used = 0;
+
+                m_rwnd = boost::shared_array<packetbuf_ptr>(
+                        new packetbuf_ptr[m_rwnd_len]);
+
+                m_rwnd_used_map.resize(m_rwnd_len);
+                m_rwnd_delivered.resize(m_rwnd_len);
+
+                m_fec_blocks.clear();
+                fec_recovered = 0;
+        }
+
+        void
+        rdp_con::init_swnd()
+        {
+                m_swnd_len    = snd_max * 4;
+
+                if (m_swnd_len > (int)sbuf_len)
+                        m_swnd_len = sbuf_len;
+
+                m_swnd_head   = 0;
+                m_swnd_used   = 0;
+                m_swnd_ostand = 0;
+                m_swnd_eacked = 0;
+                is_blocked    = false;
+
+                m_swnd = boost::shared_array<swnd>(new swnd[m_swnd_len]);
+                m_swnd_acked.resize(m_swnd_len);
+
+                m_fec.clear();
+                m_fec_sent = 0;
+
+                m_pace_next = 0.0;
+
+                cc            = ref_rdp.create_cc();
+                cc->ssthresh  = snd_max;
+                recover       = snd_nxt;
+                is_recovering = false;
+                is_timedout   = false;
+
+                srtt   = -1.0;
+                rttvar = 0.0;
+                rto    = rdp::rto_init;
+
+                eack_max        = snd_una;
+                retrans_timeout = 0;
+                retrans_fast    = 0;
+        }
+
+        void
+        rdp_con::update_rtt(double r)
+        {
+                // RFC 6298
+                if (srtt < 0.0) {
+                        srtt   = r;
+                        rttvar = r / 2.0;
+                } else {
+                        double d = srtt - r;
+
+                        if (d < 0.0)
+                                d = -d;
+
+                        rttvar = 0.75 * rttvar + 0.25 * d;
+                        srtt   = 0.875 * srtt + 0.125 * r;
+                }
+
+                double g = rdp::timer_granularity;
+
+                rto = srtt + (4.0 * rttvar > g ? 4.0 * rttvar : g);
+
+                if (rto < rdp::rto_min)
+                        rto = rdp::rto_min;
+                else if (rto > rdp::rto_max)
+                        rto = rdp::rto_max;
+        }
+
+        uint32_t
+        rdp_con::get_cwnd()
+        {
+                if (cc->cwnd < 1.0)
+                        return 1;
+
+                return (uint32_t)cc->cwnd;
+        }
+
+        uint32_t
+        rdp_con::get_flight()
+        {
+                // segments acked out of sequence have left the network
+                return snd_nxt - snd_una - m_swnd_eacked;
+        }
+
+        void
+        rdp_con::cc_ack(uint32_t num, double rtt)
+        {
+                cc->on_ack(num, rtt);
+
+                // the window never exceeds the one of the receiver
+                if (cc->cwnd > snd_max)
+                        cc->cwnd = snd_max;
+        }
+
+        void
+        rdp_con::cc_loss()
+        {
+                // reduce the window only once per window of data
+                if (is_recovering)
+                        return;
+
+                cc->on_loss();
+
+                recover       = snd_nxt - 1;
+                is_recovering = true;
+                is_timedout   = false;
+        }
+
+        void
+        rdp_con::cc_timeout()
+        {
+                // the window was already collapsed for this window of data
+                if (is_recovering && is_timedout)
+                        return;
+
+                if (is_recovering)
+                        cc->cwnd = 1.0;
+                else
+                        cc->on_timeout();
+
+                recover       = snd_nxt - 1;
+                is_recovering = true;
+                is_timedout   = true;
+        }
+
+        bool
+        rdp_con::retransmit()
+        {
+                if (m_swnd_used == 0)
+                        return true;
+
+                cagetime now;
+                double   next = -1.0;
+                bool     is_timeout = false;
+                int      i = m_swnd_head;
+                for (int n = 0; n < m_swnd_used; n++) {
+                        swnd *p_wnd    = &m_swnd[i];
+                        bool  is_acked = m_swnd_acked.test(i);
+
+                        i++;
+                        if (i >= m_swnd_len)
+                                i %= m_swnd_len;
+                        
+
+                        if (! p_wnd->is_sent)
+                                break;
+
+                        if (is_acked)
+                                continue;
+
+                        if (now - p_wnd->stamp >= p_wnd->rto) {
+                                if (p_wnd->rto * 2.0 > ref_rdp.m_max_retrans) {
+                                        // broken pipe
+                                        state = CLOSED;
+                                        ref_rdp.invoke_event(desc, 0, addr,
+                                                             BROKEN);
+
+                                        return false;
+                                }
+
+                                // retransmit
+                                rdp_head *head = (rdp_head*)p_wnd->pbuf->get_data();
+
+                                head->acknum = htonl(rcv_cur);
+
+                                // exponential backoff
+                                p_wnd->rto       *= 2.0;
+                                p_wnd->is_retrans = true;
+                                p_wnd->stamp      = now;
+
+                                ref_rdp.output(addr.did, p_wnd->pbuf);
+
+                                retrans_timeout++;
+                                ref_rdp.m_retrans_timeout++;
+
+                                is_timeout = true;
+                        }
+
+                        double at = (p_wnd->stamp - ref_rdp.m_epoch) +
+                                p_wnd->rto;
+
+                        if (next < 0.0 || at < next)
+                                next = at;
+                }
+
+                if (is_timeout) {
+                        rto *= 2.0;
+                        if (rto > rdp::rto_max)
+                                rto = rdp::rto_max;
+
+                        cc_timeout();
+                }
+
+                if (next >= 0.0)
+                        ref_rdp.schedule(*this, next);
+
+                return true;
+        }
+
+        void
+        rdp_con::fast_retransmit(swnd *p_wnd)
+        {
+                rdp_head *head = (rdp_head*)p_wnd->pbuf->get_data();
+
+                head->acknum = htonl(rcv_cur);
+
+                p_wnd->is_retrans = true;
+                p_wnd->is_fast    = true;
+                p_wnd->stamp.update();
+
+                ref_rdp.output(addr.did, p_wnd->pbuf);
+
+                retrans_fast++;
+                ref_rdp.m_retrans_fast++;
+        }
+
+        void
+        rdp_con::detect_loss()
+        {
+                // a segment is regarded as lost when dupthresh segments
+                // sent after it were acked out of sequence
+                if (m_swnd_eacked == 0)
+                        return;
+
+                int n = 0;
+
+                while (n < m_swnd_used) {
+                        int i = (m_swnd_head + n) % m_swnd_len;
+
+                        // segments acked out of sequence are skipped
+                        n += m_swnd_acked.find(i, m_swnd_used - n, false);
+                        if (n >= m_swnd_used)
+                                break;
+
+                        i = (m_swnd_head + n) % m_swnd_len;
+
+                        swnd *p_wnd = &m_swnd[i];
+
+                        if (! p_wnd->is_sent ||
+                            eack_max - p_wnd->seqnum < rdp::dupthresh ||
+                            eack_max - p_wnd->seqnum >= 0x80000000)
+                                break;
+
+                        if (! p_wnd->is_fast) {
+                                cc_loss();
+                                fast_retransmit(p_wnd);
+                        }
+
+                        n++;
+                }
+        }
+
+        bool
+        rdp_con::enqueue_swnd(packetbuf_ptr pbuf, uint16_t stream)
+        {
+                if (! is_sendable())
+                        return false;
+
+                if (m_swnd_used >= m_swnd_len) {
+                        is_blocked = true;
+                        return false;
+                }
+
+                if (is_stream) {
+                        rdp_stream_head *head;
+
+                        head = (rdp_stream_head*)pbuf->prepend(sizeof(*head));
+                        if (head == NULL)
+                                return false;
+
+                        head->id  = htons(stream);
+                        head->seq = htons(streams[stream].snd_seq++);
+                }
+
+                swnd *p_wnd;
+                int   pos = (m_swnd_head + m_swnd_used) % m_swnd_len;
+
+                p_wnd = &m_swnd[pos];
+
+                p_wnd->pbuf       = pbuf;
+                p_wnd->is_sent    = false;
+                p_wnd->is_retrans = false;
+                p_wnd->is_fast    = false;
+
+                m_swnd_acked.reset(pos);
+
+                m_swnd_used++;
+
+                send_ostand_swnd();
+
+                return true;
+        }
+
+        int
+        rdp_con::get_swnd_space()
+        {
+                return (m_swnd_len - m_swnd_used) * get_dmax();
+        }
+
+        int
+        rdp_con::get_dmax()
+        {
+                int dmax = sbuf_max - sizeof(rdp_head);
+
+                if (is_stream)
+                        dmax -= sizeof(rdp_stream_head);
+
+                return dmax;
+        }
+
+        std::queue<packetbuf_ptr>*
+        rdp_con::get_rqueue(uint16_t id)
+        {
+                if (id == 0)
+                        return &rqueue;
+
+                std::map<uint16_t, stream>::iterator it;
+
+                it = streams.find(id);
+                if (it == streams.end())
+                        return NULL;
+
+                return &it->second.rqueue;
+        }
+
+        bool
+        rdp_con::is_readable()
+        {
+                if (! rqueue.empty())
+                        return true;
+
+                std::map<uint16_t, stream>::iterator it;
+
+                for (it = streams.begin(); it != streams.end(); ++it) {
+                        if (! it->second.rqueue.empty())
+                                return true;
+                }
+
+                return false;
+        }
+
+        bool
+        rdp_con::deliver(packetbuf_ptr pbuf)
+        {
+                rdp_stream_head *head;
+                uint16_t         id;
+
+                // broken segments are discarded
+                if (pbuf->get_len() < (int)sizeof(*head))
+                        return true;
+
+                head = (rdp_stream_head*)pbuf->get_data();
+                id   = ntohs(head->id);
+
+                if (id >= rdp::stream_max)
+                        return true;
+
+                stream &s = streams[id];
+
+                if (ntohs(head->seq) != s.rcv_seq)
+                        return false;
+
+                s.rcv_seq++;
+
+                pbuf->rm_head(sizeof(*head));
+
+                if (pbuf->get_len() > 0)
+                        get_rqueue(id)->push(pbuf);
+
+                return true;
+        }
+
+        void
+        rdp_con::deliver_rwnd()
+        {
+                // the segments of a substream are in order of the
+                // sequence numbers, so one pass is enough
+                int off  = 0;
+                int used = 0;
+
+                while (used < m_rwnd_used) {
+                        int idx = (m_rwnd_head + off) % m_rwnd_len;
+
+                        off += m_rwnd_used_map.find(idx, m_rwnd_len - off,
+                                                    true);
+                        if (off >= m_rwnd_len)
+                                break;
+
+                        idx = (m_rwnd_head + off) % m_rwnd_len;
+
+                        if (! m_rwnd_delivered.test(idx) &&
+                            deliver(m_rwnd[idx]))
+                                m_rwnd_delivered.set(idx);
+
+                        off++;
+                        used++;
+                }
+        }
+
+        bool
+        rdp_con::is_writable()
+        {
+                // hysteresis. writers are not woken up for every
+                // acknowledged segment
+                if (! is_blocked)
+                        return false;
+
+                return m_swnd_used <= m_swnd_len * rdp::swnd_lowat;
+        }
+
+        bool
+        rdp_con::is_sendable()
+        {
+                // the listener may reply to the data in the SYN before
+                // the handshake completes
+                return state == OPEN || (state == SYN_RCVD && is_accepted);
+        }
+
+        double
+        rdp_con::get_pace_gap()
+        {
+                // a little faster than cwnd / srtt, so that the window
+                // can grow
+                double gain = (cc->cwnd < cc->ssthresh) ? rdp::pace_gain_ss :
+                                                          rdp::pace_gain;
+
+                return srtt / (get_cwnd() * gain);
+        }
+
+        int
+        rdp_con::get_pace_budget()
+        {
+                // -1 means no limit. there is no estimate of the
+                // bandwidth until the first round trip
+                if (pace_burst == 0 || srtt <= 0.0)
+                        return -1;
+
+                if (ref_rdp.get_clock() < m_pace_next)
+                        return 0;
+
+                // a batch lasts a timer slot at least
+                double slot = rdp::pace_slot / get_pace_gap();
+
+                if (slot > pace_burst)
+                        return (int)slot;
+
+                return pace_burst;
+        }
+
+        void
+        rdp_con::send_ostand_swnd()
+        {
+                int i      = m_swnd_ostand;
+                int end    = (m_swnd_head + m_swnd_used) % m_swnd_len;
+                int budget = get_pace_budget();
+                int sent   = 0;
+
+                while (i != end) {
+                        if (budget == 0)
+                                break;
+
+                        if (snd_nxt - snd_una < snd_max &&
+                            get_flight() < get_cwnd()) {
+                                swnd *p_wnd = &m_swnd[i];
+
+                                p_wnd->is_sent   = true;
+                                p_wnd->seqnum    = snd_nxt;
+                                p_wnd->rto       = rto;
+                                p_wnd->stamp.update();
+
+                                
+                                rdp_head *head;
+                                uint16_t  len = p_wnd->pbuf->get_len();
+                                uint32_t  off = 0;
+
+                                if (snd_fec > 0) {
+                                        off = (snd_nxt - snd_iss - 1) % snd_fec;
+
+                                        if (off == 0) {
+                                                m_fec.clear();
+                                                m_fec_first = snd_nxt;
+                                                m_fec_sent  = 0;
+                                                m_fec_time  =
+                                                        ref_rdp.get_clock();
+
+                                                schedule_fec();
+                                        }
+
+                                        m_fec.add(off, p_wnd->pbuf->get_data(),
+                                                  len);
+                                }
+
+                                head = (rdp_head*)p_wnd->pbuf->prepend(sizeof(*head));
+
+                                memset(head, 0, sizeof(*head));
+
+                                head->flags  = rdp::flag_ack | rdp::flag_ver;
+                                head->hlen   = (uint8_t)sizeof(*head) / 2;
+                                head->sport  = htons(addr.sport);
+                                head->dport  = htons(addr.dport);
+                                head->dlen   = htons(len);
+                                head->seqnum = htonl(snd_nxt);
+                                head->acknum = htonl(rcv_cur);
+
+                                ref_rdp.output(addr.did, p_wnd->pbuf);
+
+                                if (snd_fec > 0 && off == snd_fec - 1u)
+                                        send_fec(false);
+
+
+                                snd_nxt++;
+
+                                i++;
+                                if (i >= m_swnd_len)
+                                        i %= m_swnd_len;
+
+                                if (budget > 0) {
+                                        budget--;
+                                        sent++;
+                                }
+                        } else {
+                                break;
+                        }
+                }
+
+                if (sent > 0)
+                        m_pace_next = ref_rdp.get_clock() +
+                                sent * get_pace_gap();
+
+                // the rest is released by the timer
+                if (budget == 0 && i != end)
+                        ref_rdp.schedule(*this, m_pace_next);
+
+                if (m_swnd_ostand != i)
+                        ref_rdp.schedule(*this, ref_rdp.get_clock() + rto);
+
+                m_swnd_ostand = i;
+        }
+
+        void
+        rdp_con::recv_ack(uint32_t acknum)
+        {
+                // If ACK set
+                //   If SND.UNA =< SEG.ACK < SND.NXT
+                //     Set SND.UNA = SEG.ACK
+                //     Flush acknowledged segments
+                //   Endif
+                // Endif
+
+                if (acknum - snd_una < snd_nxt - snd_una) {
+                        cagetime now;
+                        uint32_t num = 0;
+                        double   rtt = -1.0;
+                        int      i = m_swnd_head;
+
+                        while (i != m_swnd_ostand) {
                                 swnd *p_wnd = &m_swnd[i];
 
                                 if (p_wnd->seqnum - snd_una <=
                                     acknum - snd_una) {
                                         if (p_wnd->is_sent) {
-                                                if (! p_wnd->is_acked)
+                                                if (! m_swnd_acked.test(i)) {
                                                         p_wnd->pbuf.reset();
+                                                        num++;
+
+                                                        // Karn's algorithm
+                                                        if (! p_wnd->is_retrans)
+                                                                rtt = now - p_wnd->stamp;
+                                                } else {
+                                                        m_swnd_eacked--;
+                                                }
                                                 m_swnd_used--;
                                         }
                                 } else {
@@ -1779,6 +2971,25 @@ namespace libcage {
 
                         m_swnd_head = i;
                         snd_una     = acknum;
+
+                        if (is_recovering) {
+                                if (acknum - recover < 0x80000000) {
+                                        is_recovering = false;
+                                } else if (! is_timedout &&
+                                           m_swnd_used > 0 &&
+                                           m_swnd[m_swnd_head].is_sent &&
+                                           ! m_swnd[m_swnd_head].is_fast) {
+                                        // partial ack: the next hole is
+                                        // also lost
+                                        fast_retransmit(&m_swnd[m_swnd_head]);
+                                }
+                        }
+
+                        if (rtt >= 0.0)
+                                update_rtt(rtt);
+
+                        if (num > 0)
+                                cc_ack(num, rtt);
                 }
 
                 send_ostand_swnd();
@@ -1787,32 +2998,74 @@ namespace libcage {
         void
         rdp_con::recv_eack(uint32_t eacknum)
         {
-                if (m_swnd_used == 0)
-                        return;
+                recv_sack(eacknum, eacknum);
+        }
 
-                uint32_t pos = eacknum - m_swnd[m_swnd_head].seqnum;
+        void
+        rdp_con::recv_sack(uint32_t start, uint32_t end)
+        {
+                // the segment at the head of the sending window is
+                // SND.UNA + 1 when it was sent
+                uint32_t sent = snd_nxt - snd_una - 1;
+                uint32_t from = start - snd_una - 1;
+                uint32_t to   = end - snd_una;
 
-                if (pos >= (uint32_t)m_swnd_len)
+                if (end - start >= 0x80000000 || to == 0 || to >= 0x80000000)
                         return;
 
-                pos += m_swnd_head;
-                if (pos >= (uint32_t)m_swnd_len)
-                        pos %= m_swnd_len;
+                if (from >= 0x80000000)
+                        from = 0;
 
-                
-                swnd *p_wnd = &m_swnd[pos];
+                if (to > sent)
+                        to = sent;
+
+                int n   = (int)(to - from);
+                int pos = (m_swnd_head + from) % m_swnd_len;
+
+                while (n > 0) {
+                        int skip = m_swnd_acked.find(pos, n, false);
+
+                        if (skip >= n)
+                                break;
+
+                        pos = (pos + skip) % m_swnd_len;
+                        n  -= skip;
+
+                        swnd    *p_wnd   = &m_swnd[pos];
+                        uint32_t eacknum = p_wnd->seqnum;
+                        double   rtt     = -1.0;
+
+                        if (! p_wnd->is_retrans) {
+                                cagetime now;
+                                rtt = now - p_wnd->stamp;
+                        }
 
-                if (p_wnd->seqnum == eacknum &&
-                    p_wnd->is_sent && ! p_wnd->is_acked) {
                         p_wnd->pbuf.reset();
-                        p_wnd->is_acked = true;
+                        m_swnd_acked.set(pos);
+                        m_swnd_eacked++;
+
+                        if (eack_max - snd_una >= snd_nxt - snd_una ||
+                            eacknum - snd_una > eack_max - snd_una)
+                                eack_max = eacknum;
+
+                        if (rtt >= 0.0)
+                                update_rtt(rtt);
+
+                        cc_ack(1, rtt);
+
+                        pos = (pos + 1) % m_swnd_len;
+                        n--;
                 }
 
 
                 // remove head of sending window
                 while (m_swnd_head != m_swnd_ostand &&
                        m_swnd[m_swnd_head].is_sent &&
-                       m_swnd[m_swnd_head].is_acked) {
+                       m_swnd_acked.test(m_swnd_head)) {
+                        snd_una = m_swnd[m_swnd_head].seqnum;
+
+                        m_swnd_used--;
+                        m_swnd_eacked--;
                         m_swnd_head++;
                         if (m_swnd_head >= m_swnd_len)
                                 m_swnd_head %= m_swnd_len;
@@ -1835,25 +3088,32 @@ namespace libcage {
                         idx %= m_rwnd_len;
 
                 // insert buffer to receive window
-                if (! m_rwnd[idx].is_used) {
-                        m_rwnd[idx].pbuf      = pbuf;
-                        m_rwnd[idx].seqnum    = seqnum;
-                        m_rwnd[idx].is_used   = true;
-                        m_rwnd[idx].is_eacked = false;
+                if (! m_rwnd_used_map.test(idx)) {
+                        m_rwnd[idx] = pbuf;
+                        m_rwnd_used_map.set(idx);
+                        m_rwnd_delivered.reset(idx);
 
                         m_rwnd_used++;
+
+                        if (rcv_fec > 0)
+                                add_fec(pbuf, seqnum);
                 }
 
                 // remove head of receive window
-                while (m_rwnd[m_rwnd_head].is_used) {
+                while (m_rwnd_used_map.test(m_rwnd_head)) {
+                        packetbuf_ptr &p = m_rwnd[m_rwnd_head];
+
                         rcv_cur++;
 
-                        if (m_rwnd[m_rwnd_head].pbuf->get_len() > 0)
-                                rqueue.push(m_rwnd[m_rwnd_head].pbuf);
+                        if (is_stream) {
+                                if (! m_rwnd_delivered.test(m_rwnd_head))
+                                        deliver(p);
+                        } else if (p->get_len() > 0) {
+                                rqueue.push(p);
+                        }
 
-                        m_rwnd[m_rwnd_head].pbuf.reset();
-                        m_rwnd[m_rwnd_head].is_used   = false;
-                        m_rwnd[m_rwnd_head].is_eacked = false;
+                        p.reset();
+                        m_rwnd_used_map.reset(m_rwnd_head);
 
                         m_rwnd_used--;
                         m_rwnd_head++;
@@ -1861,9 +3121,28 @@ namespace libcage {
                                 m_rwnd_head %= m_rwnd_len;
                 }
 
-                // send ack
-                if (rcv_cur - rcv_ack > rcv_max / 4 || pbuf->get_len() == 0)
+                // the blocks received entirely are no longer needed
+                if (rcv_fec > 0) {
+                        uint32_t done = (rcv_cur - rcv_irs) / rcv_fec;
+
+                        while (! m_fec_blocks.empty() &&
+                               m_fec_blocks.begin()->first < done)
+                                m_fec_blocks.erase(m_fec_blocks.begin());
+                }
+
+                // substreams are not blocked by segments lost in the
+                // other substreams
+                if (is_stream && m_rwnd_used > 0)
+                        deliver_rwnd();
+
+                // send ack every ack_segs segments to clock the congestion
+                // window of the sender, and at once when a segment is
+                // missing so that the sender can detect the loss
+                if (rcv_cur - rcv_ack >= rdp::ack_segs ||
+                    m_rwnd_used > 0 || pbuf->get_len() == 0)
                         delayed_ack();
+                else if (rcv_cur != rcv_ack)
+                        schedule_ack();
 
                 return;
         }
@@ -1871,29 +3150,45 @@ namespace libcage {
         void
         rdp_con::delayed_ack()
         {
-                // for eack
-#define MAX_EACK 64
-                uint32_t seqs[MAX_EACK];
-                int idx;
-                int i, j;
-
-                idx = m_rwnd_head;
-
-                i = 0;
-                j = 0;
-                while (i < m_rwnd_used && j < MAX_EACK) {
-                        if (m_rwnd[idx].is_used) {
-                                if (! m_rwnd[idx].is_eacked) {
-                                        seqs[j] = htonl(m_rwnd[idx].seqnum);
-                                        m_rwnd[idx].is_eacked = true;
-                                        j++;
-                                }
-                                i++;
+                // every ack reports all the segments received out of
+                // sequence, so the sender recovers from lost acks
+                uint32_t seqs[rdp::eacks_max];
+                int      j = 0;
+                int      off  = 0;
+                int      used = 0;
+
+                while (used < m_rwnd_used) {
+                        int idx = (m_rwnd_head + off) % m_rwnd_len;
+                        int n;
+
+                        off += m_rwnd_used_map.find(idx, m_rwnd_len - off,
+                                                    true);
+                        if (off >= m_rwnd_len)
+                                break;
+
+                        idx = (m_rwnd_head + off) % m_rwnd_len;
+                        n   = m_rwnd_used_map.find(idx, m_rwnd_len - off,
+                                                   false);
+
+                        uint32_t start = rcv_cur + 1 + off;
+
+                        if (is_sack) {
+                                if (j + 2 > rdp::eacks_max)
+                                        break;
+
+                                seqs[j++] = htonl(start);
+                                seqs[j++] = htonl(start + n - 1);
+                        } else {
+                                for (int k = 0; k < n &&
+                                             j < rdp::eacks_max; k++)
+                                        seqs[j++] = htonl(start + k);
+
+                                if (j >= rdp::eacks_max)
+                                        break;
                         }
 
-                        idx++;
-                        if (idx >= m_rwnd_len)
-                                idx %= m_rwnd_len;
+                        off  += n;
+                        used += n;
                 }
 
                 if (rcv_cur == rcv_ack && j == 0)
@@ -1931,6 +3226,47 @@ namespace libcage {
                 acked_time.update();
         }
 
+        void
+        rdp_con::schedule_ack()
+        {
+                double at = (acked_time - ref_rdp.m_epoch) + rdp::ack_interval;
+
+                ref_rdp.schedule(*this, at);
+        }
+
+        void
+        rdp::get_readable_streams(int desc, std::vector<uint16_t> &ids)
+        {
+                std::map<int, rdp_con_ptr>::iterator it;
+
+                it = m_desc2conn.find(desc);
+                if (it == m_desc2conn.end())
+                        return;
+
+                if (! it->second->rqueue.empty())
+                        ids.push_back(0);
+
+                std::map<uint16_t, rdp_con::stream>::iterator it_s;
+
+                for (it_s = it->second->streams.begin();
+                     it_s != it->second->streams.end(); ++it_s) {
+                        if (it_s->first > 0 && ! it_s->second.rqueue.empty())
+                                ids.push_back(it_s->first);
+                }
+        }
+
+        int
+        rdp::get_send_space(int desc)
+        {
+                std::map<int, rdp_con_ptr>::iterator it;
+
+                it = m_desc2conn.find(desc);
+                if (it == m_desc2conn.end() || ! it->second->is_sendable())
+                        return -1;
+
+                return it->second->get_swnd_space();
+        }
+
         void
         rdp::get_status(std::vector<rdp_status> &vec)
         {
@@ -1945,10 +3281,18 @@ namespace libcage {
                         if (lis_it != m_listening.right.end()) {
                                 rdp_status s;
 
-                                s.state = LISTEN;
-                                s.did   = zero;
-                                s.dport = 0;
-                                s.sport = lis_it->second;
+                                s.state    = LISTEN;
+                                s.did      = zero;
+                                s.dport    = 0;
+                                s.sport    = lis_it->second;
+                                s.cwnd     = 0;
+                                s.ssthresh = 0;
+                                s.srtt     = -1.0;
+                                s.rto      = 0.0;
+                                s.retrans_timeout = 0;
+                                s.retrans_fast    = 0;
+                                s.fec_recovered   = 0;
+                                s.seg_size        = 0;
 
                                 vec.push_back(s);
 
@@ -1962,10 +3306,34 @@ namespace libcage {
                         if (conn_it != m_desc2conn.end()) {
                                 rdp_status s;
 
-                                s.state = conn_it->second->state;
-                                s.did   = conn_it->second->addr.did;
-                                s.dport = conn_it->second->addr.dport;
-                                s.sport = conn_it->second->addr.sport;
+                                rdp_con_ptr p_con = conn_it->second;
+
+                                s.state = p_con->state;
+                                s.did   = p_con->addr.did;
+                                s.dport = p_con->addr.dport;
+                                s.sport = p_con->addr.sport;
+
+                                s.seg_size = p_con->sbuf_max;
+
+                                if (p_con->cc) {
+                                        s.cwnd     = (uint32_t)p_con->cc->cwnd;
+                                        s.ssthresh = (uint32_t)p_con->cc->ssthresh;
+                                        s.srtt     = p_con->srtt;
+                                        s.rto      = p_con->rto;
+                                        s.retrans_timeout = p_con->retrans_timeout;
+                                        s.retrans_fast    = p_con->retrans_fast;
+                                        s.fec_recovered   = p_con->fec_recovered;
+                                } else {
+                                        // the sending window is not
+                                        // initialized yet
+                                        s.cwnd     = 0;
+                                        s.ssthresh = 0;
+                                        s.srtt     = -1.0;
+                                        s.rto      = 0.0;
+                                        s.retrans_timeout = 0;
+                                        s.retrans_fast    = 0;
+                                        s.fec_recovered   = 0;
+                                }
 
                                 vec.push_back(s);
                                 
@@ -1985,4 +3353,23 @@ namespace libcage {
         {
                 return m_max_retrans;
         }
+
+        void
+        rdp::set_congestion_control(rdp_cc_algo algo)
+        {
+                m_cc_algo = algo;
+        }
+
+        rdp_cc_algo
+        rdp::get_congestion_control()
+        {
+                return m_cc_algo;
+        }
+
+        void
+        rdp::get_retrans_count(uint64_t &timeout, uint64_t &fast)
+        {
+                timeout = m_retrans_timeout;
+                fast    = m_retrans_fast;
+        }
 }
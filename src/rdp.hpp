@@ -65,6 +65,8 @@ namespace libcage {
                 FAILED,
                 READY2READ,
                 BROKEN,
+                WRITABLE, // send() was short and the send window has
+                          // drained below the low-water mark
         };
 
         enum rdp_state {
@@ -94,6 +96,69 @@ namespace libcage {
                 uint16_t seg_size_max; // SEG.BMAX
         };
 
+        // SYN with options. implementations which don't know the options
+        // read only rdp_syn and ignore them
+        struct rdp_syn_opt {
+                rdp_syn  syn;
+                uint8_t  wnd_shift;   // SEG.MAX is shifted left by this
+                uint8_t  options;     // rdp::syn_opt_*
+                uint8_t  fec_block;   // segments per parity segment sent
+                uint8_t  reserved;
+        };
+
+        // SYN with syn_opt_data is followed by SEG.DLEN octets of data,
+        // which consume no sequence number. the SYN-ACK echoes the
+        // option when the data was taken, otherwise the data is sent
+        // again as the first segment
+
+        // precedes the data of every segment when substreams are
+        // negotiated. the segments of a substream are delivered in
+        // order of seq, independently of the other substreams
+        struct rdp_stream_head {
+                uint16_t id;
+                uint16_t seq;
+        };
+
+        // parity segment, which consumes no sequence number. SEG.DLEN
+        // octets of the XOR of the data of count segments from SEG.SEQ,
+        // zero padded, follow. the blocks start at RCV.IRS + 1 and
+        // have rdp_syn_opt::fec_block segments. a partial block is
+        // covered when the sender goes idle
+        struct rdp_fec_head {
+                rdp_head head;
+                uint16_t count;
+                uint16_t len;   // XOR of the lengths of the data
+        };
+
+        // buffer sizes of a connection
+        class rdp_config {
+        public:
+                static const uint32_t   rcv_max_default;
+                static const uint32_t   rbuf_max_default;
+                static const uint32_t   sbuf_len_default;
+
+                uint32_t        rcv_max;  // segments buffered for receiving
+                uint32_t        rbuf_max; // the largest segment received in
+                                          // octets
+                uint32_t        sbuf_len; // segments buffered for sending
+                bool            is_stream; // multiplex substreams if the
+                                           // peer agrees
+                uint8_t         fec_block; // send a parity segment every
+                                           // fec_block segments if the
+                                           // peer can decode it. 0 for
+                                           // none
+                uint32_t        pace_burst; // segments sent back to back
+                                            // when they are paced by the
+                                            // estimated bandwidth. 0 for
+                                            // no pacing
+
+                rdp_config() : rcv_max(rcv_max_default),
+                               rbuf_max(rbuf_max_default),
+                               sbuf_len(sbuf_len_default),
+                               is_stream(false), fec_block(0),
+                               pace_burst(0) { }
+        };
+
         class rdp_con;
         typedef boost::shared_ptr<rdp_con> rdp_con_ptr;
 
@@ -110,16 +175,102 @@ namespace libcage {
                 }
         };
 
+        enum rdp_cc_algo {
+                CC_NEWRENO,
+                CC_CUBIC,
+                CC_DELAY,
+        };
+
         struct rdp_status {
                 rdp_state    state;
                 id_const_ptr did;
                 uint16_t     dport;
                 uint16_t     sport;
+                uint32_t     cwnd;     // congestion window in segments
+                uint32_t     ssthresh; // slow start threshold in segments
+                double       srtt;     // smoothed round trip time in seconds
+                double       rto;      // retransmission timeout in seconds
+                uint32_t     retrans_timeout; // segments resent by timeout
+                uint32_t     retrans_fast;    // segments resent by EACK gaps
+                uint32_t     fec_recovered;   // segments rebuilt by parity
+                uint32_t     seg_size;        // the largest segment sent
         };
 
         size_t hash_value(const rdp_addr &addr);
 
+        // congestion controller of a connection.
+        // the windows are counted in segments
+        class rdp_cc {
+        public:
+                static const double     cwnd_init;
+                static const double     cwnd_min;
+
+                double          cwnd;
+                double          ssthresh;
+
+                // num segments were acknowledged newly. rtt is a sample of
+                // the round trip time in seconds, or negative if there is
+                // no valid sample
+                virtual void    on_ack(uint32_t num, double rtt) = 0;
+
+                // a segment was lost while the following ones arrived
+                virtual void    on_loss() = 0;
+
+                // the retransmission timer expired
+                virtual void    on_timeout() = 0;
+
+                rdp_cc() : cwnd(cwnd_init), ssthresh(1e9) { }
+                virtual ~rdp_cc() { }
+        };
+
+        typedef boost::shared_ptr<rdp_cc> rdp_cc_ptr;
+
+        class rdp_cc_newreno : public rdp_cc {
+        public:
+                virtual void    on_ack(uint32_t num, double rtt);
+                virtual void    on_loss();
+                virtual void    on_timeout();
+        };
+
+        class rdp_cc_cubic : public rdp_cc {
+                static const double     beta;
+                static const double     c;
+
+        public:
+                virtual void    on_ack(uint32_t num, double rtt);
+                virtual void    on_loss();
+                virtual void    on_timeout();
+
+                rdp_cc_cubic() : m_w_max(0.0), m_w_est(0.0), m_k(0.0),
+                                 m_is_epoch(false) { }
+
+        private:
+                double          m_w_max;
+                double          m_w_est;
+                double          m_k;
+                bool            m_is_epoch;
+                cagetime        m_epoch;
+        };
+
+        // Vegas like delay based controller
+        class rdp_cc_delay : public rdp_cc {
+                static const double     alpha;
+                static const double     beta;
+                static const double     gamma;
+
+        public:
+                virtual void    on_ack(uint32_t num, double rtt);
+                virtual void    on_loss();
+                virtual void    on_timeout();
+
+                rdp_cc_delay() : m_base_rtt(-1.0) { }
+
+        private:
+                double          m_base_rtt;
+        };
+
         typedef boost::function<void (id_ptr, packetbuf_ptr)> callback_dgram_out;
+        typedef boost::function<int (id_ptr)> callback_path_mtu;
         typedef boost::function<void (int desc, rdp_addr addr,
                                       rdp_event event)> callback_rdp_event;
 
@@ -131,38 +282,121 @@ namespace libcage {
                 static const uint8_t   flag_rst;
                 static const uint8_t   flag_nul;
                 static const uint8_t   flag_fin;
+                static const uint8_t   flag_fec;
                 static const uint8_t   flag_ver;
 
-                static const uint32_t  rbuf_max_default;
-                static const uint32_t  rcv_max_default;
                 static const uint16_t  well_known_port_max;
                 static const uint16_t  sbuf_limit;
-                static const uint32_t  timer_rdp_usec;
+                static const uint8_t   wnd_shift_max;
+                static const double    timer_granularity;
                 static const double    ack_interval;
+                static const uint32_t  ack_segs;
+                static const double    rto_init;
+                static const double    rto_min;
+                static const double    rto_max;
+                static const uint32_t  dupthresh;
+                static const double    swnd_lowat;
+                static const uint8_t   syn_opt_stream;
+                static const uint8_t   syn_opt_data;
+                static const uint8_t   syn_opt_sack;
+                static const uint8_t   syn_opt_fec;
+                static const double    fec_delay;
+                static const double    pace_slot;
+                static const double    pace_gain;
+                static const double    pace_gain_ss;
+                static const int       eacks_max; // words in an EACK
 
         public:
+                static const uint16_t  stream_max;
+                static const uint8_t   fec_block_max;
+                static const uint16_t  syn_data_max;
+
                 rdp(rand_uint &rnd, timer &tm);
                 virtual ~rdp();
 
                 int             listen(uint16_t sport,
-                                       callback_rdp_event func); // passive open
+                                       callback_rdp_event func,
+                                       const rdp_config &conf =
+                                       rdp_config()); // passive open
                 int             connect(uint16_t sport, id_ptr did,
                                         uint16_t dport,
-                                        callback_rdp_event func); // active open
+                                        callback_rdp_event func,
+                                        const rdp_config &conf =
+                                        rdp_config()); // active open
+
+                // active open which sends buf in the SYN. the listener
+                // gets it with ACCEPTED, followed by READY2READ, and
+                // can reply before the handshake completes. the SYN
+                // may be retransmitted, so buf should be an idempotent
+                // request. len must not be more than syn_data_max
+                int             connect(uint16_t sport, id_ptr did,
+                                        uint16_t dport,
+                                        callback_rdp_event func,
+                                        const void *buf, int len,
+                                        const rdp_config &conf =
+                                        rdp_config());
                 void            close(int desc);
                 int             send(int desc, const void *buf, int len);
                 void            receive(int desc, void *buf, int *len);
+
+                // without copying.
+                // pbuf is queued as a segment as it is when it fits in
+                // one and has the head room of packetbuf::construct(),
+                // and the RDP header is prepended to it. so, pbuf must
+                // not be modified after this call. others are copied.
+                int             send(int desc, packetbuf_ptr pbuf);
+
+                // the received segments are appended to bufs.
+                // segments are taken while the total length is not
+                // more than *len, and *len is set to the total length
+                void            receive(int desc,
+                                        std::vector<packetbuf_ptr> &bufs,
+                                        int *len);
+
+                // for substreams, which are available when both ends
+                // set rdp_config::is_stream. the substream 0 is what
+                // send() and receive() above use. stream must be less
+                // than stream_max
+                int             send(int desc, uint16_t stream,
+                                     const void *buf, int len);
+                void            receive(int desc, uint16_t stream,
+                                        void *buf, int *len);
+
+                // the substreams which have data to be read
+                void            get_readable_streams(int desc,
+                                        std::vector<uint16_t> &ids);
                 rdp_state       get_desc_state(int desc);
+
+                // the number of bytes which send() accepts without
+                // returning a short count. -1 unless desc is open or
+                // accepted by the data in the SYN
+                int             get_send_space(int desc);
                 void            get_status(std::vector<rdp_status> &vec);
 
                 void            set_max_retrans(time_t sec);
                 time_t          get_max_retrans();
 
+                // applied to connections opened after this call
+                void            set_congestion_control(rdp_cc_algo algo);
+                rdp_cc_algo     get_congestion_control();
+
+                // the total number of retransmitted segments of all
+                // connections, including closed ones
+                void            get_retrans_count(uint64_t &timeout,
+                                                  uint64_t &fast);
+
                 void            set_callback_rdp_event(int desc,
                                                        callback_rdp_event func);
                 void            set_callback_dgram_out(callback_dgram_out func);
                 void            input_dgram(id_ptr src, packetbuf_ptr pbuf);
 
+                // func returns the largest UDP payload which reaches a
+                // node, or 0 if unknown. segments are made small enough
+                // to fit in it, and update_path_mtu() is called when it
+                // changes
+                void            set_callback_path_mtu(callback_path_mtu func);
+                void            update_path_mtu(id_ptr id);
+
         private:
                 class timer_rdp : public timer::callback {
                 public:
@@ -173,6 +407,8 @@ namespace libcage {
                         rdp    &m_rdp;
                 };
 
+                typedef std::multimap<double, int> deadlines_t;
+
                 typedef boost::bimaps::set_of<uint16_t> _uint16_set;
                 typedef boost::bimaps::set_of<int>      _int_set;
                 typedef boost::bimaps::bimap<_uint16_set,
@@ -182,6 +418,7 @@ namespace libcage {
 
                 std::set<int>               m_desc_set;
                 listening_t                 m_listening; // <port, desc>
+                std::map<int, rdp_config>   m_listening_conf;
                 
                 boost::unordered_map<rdp_addr, rdp_con_ptr>     m_addr2conn;
                 std::map<int, rdp_con_ptr>          m_desc2conn;
@@ -189,18 +426,42 @@ namespace libcage {
 
                 
                 callback_dgram_out          m_output_func;
+                callback_path_mtu           m_path_mtu_func;
 
                 rand_uint                  &m_rnd;
 
                 time_t                      m_max_retrans;
+                rdp_cc_algo                 m_cc_algo;
                 timer                      &m_timer;
                 timer_rdp                   m_timer_rdp;
 
+                // the deadlines of connections which wait for
+                // retransmission, delayed ack, SYN or RST retry.
+                // idle connections are not in here
+                cagetime        m_epoch;
+                deadlines_t     m_deadlines; // <deadline, desc>
+                bool            m_is_timer_set;
+                double          m_timer_at;
+
                 bool            m_is_invoke;
                 std::set<int>   m_desc_closed;
 
+                uint64_t        m_retrans_timeout;
+                uint64_t        m_retrans_fast;
+
                 void            output(id_ptr id, packetbuf_ptr pbuf);
                 int             generate_desc();
+                rdp_cc_ptr      create_cc();
+                void            set_config(rdp_con &con,
+                                           const rdp_config &conf);
+                packetbuf_ptr   make_syn(rdp_con &con, bool is_ack);
+                uint8_t         read_syn(rdp_con &con, packetbuf_ptr pbuf);
+                void            set_sbuf_max(rdp_con &con);
+
+                double          get_clock(); // seconds since m_epoch
+                void            schedule(rdp_con &con, double at);
+                void            set_timer_rdp();
+                void            expire(rdp_con_ptr p_con);
                 void            invoke_event(int desc1, int desc2,
                                              rdp_addr addr, rdp_event event);
 
@@ -226,6 +487,36 @@ namespace libcage {
                 friend class rdp_con;
         };
 
+        // bits of a ring buffer
+        class rdp_bitmap {
+        public:
+                void            resize(int len);
+                bool            test(int idx) const;
+                void            set(int idx);
+                void            reset(int idx);
+
+                // the offset of the first bit which is val in the n
+                // bits from idx, wrapping around. n when there is none
+                int             find(int idx, int n, bool val) const;
+
+        private:
+                std::vector<uint64_t>   m_bits;
+                int                     m_len;
+        };
+
+        // XOR of the data of the segments of a block
+        class rdp_fec {
+        public:
+                std::vector<uint8_t>    data; // zero padded
+                uint16_t        len;  // XOR of the lengths
+                uint64_t        mask; // offsets in the block added
+
+                void            add(int off, const void *buf, int size);
+                void            clear();
+
+                rdp_fec() : len(0), mask(0) { }
+        };
+
         class rdp_con {
         public:
                 rdp_addr        addr;
@@ -242,12 +533,17 @@ namespace libcage {
                                            // This variable is specified by the
                                            // foreign host in the SYN segment
                                            // during connection establishment.
+                uint32_t        sbuf_peer; // sbuf_max specified by the
+                                           // foreign host, before it is
+                                           // limited by the path MTU.
                 uint32_t        rbuf_max;  // The largest possible segment (in
                                            // octets) that can be received. This
                                            // variable is specified by the user
                                            // when the connection is opened. The
                                            // variable is sent to the foreign
                                            // host in the SYN segment.
+                uint32_t        sbuf_len;  // The number of segments buffered
+                                           // for sending.
 
                 // Send Sequence Number Variables:
                 uint32_t        snd_nxt; // The sequence number of the next
@@ -283,68 +579,156 @@ namespace libcage {
                                                    // acknowledged out of
                                                    // sequence.
 
-                time_t          syn_time;
+                double          syn_time; // by rdp::get_clock()
                 time_t          syn_tout;
 
-                time_t          rst_time;
+                double          rst_time; // by rdp::get_clock()
                 time_t          rst_tout;
                 bool            is_retry_rst;
 
+                bool                            is_scheduled;
+                std::multimap<double, int>::iterator    sched_it;
+
+                bool            is_blocked; // the send window was full
+                                            // when send() was called
+
+                packetbuf_ptr   syn_data;    // sent with the SYN
+                bool            is_accepted; // ACCEPTED was signaled by
+                                             // the data in the SYN
+                bool            is_sendable();
+
                 void            init_swnd();
-                bool            enqueue_swnd(packetbuf_ptr pbuf);
+                bool            enqueue_swnd(packetbuf_ptr pbuf,
+                                             uint16_t stream);
+                int             get_dmax(); // data in a segment
+                int             get_swnd_space();
+                bool            is_writable();
                 void            send_ostand_swnd();
 
                 void            init_rwnd();
 
                 bool            retransmit();
+                void            detect_loss();
 
                 void            set_output_func(callback_dgram_out func);
                 void            set_event_func(callback_rdp_event func);
 
                 void            recv_ack(uint32_t acknum);
                 void            recv_eack(uint32_t eacknum);
+                void            recv_sack(uint32_t start, uint32_t end);
 
                 void            delayed_ack();
+                void            schedule_ack();
 
                 std::queue<packetbuf_ptr>       rqueue; // read queue
 
+                class stream {
+                public:
+                        uint16_t        snd_seq; // for the next segment
+                        uint16_t        rcv_seq; // expected to be read
+                        std::queue<packetbuf_ptr>       rqueue;
+
+                        stream() : snd_seq(0), rcv_seq(0) { }
+                };
+
+                // substreams. the read queue of the substream 0 is
+                // rqueue above
+                bool                            is_stream;
+                std::map<uint16_t, stream>      streams;
+
+                // EACKs carry ranges of sequence numbers, the first and
+                // the last, instead of sequence numbers. negotiated by
+                // rdp::syn_opt_sack
+                bool            is_sack;
+
+                // forward error correction
+                uint8_t         snd_fec; // segments per parity sent
+                uint8_t         rcv_fec; // segments per parity received
+                uint32_t        fec_recovered;
+
+                uint32_t        pace_burst;
+
+                void            send_fec(bool is_flush);
+                void            schedule_fec();
+                void            recv_fec(packetbuf_ptr pbuf);
+
+                std::queue<packetbuf_ptr>      *get_rqueue(uint16_t id);
+                bool            is_readable();
+
+                rdp_cc_ptr      cc;
+                uint32_t        recover; // the highest sequence number sent
+                                         // when the window was reduced
+                bool            is_recovering;
+                bool            is_timedout;
+
+                uint32_t        eack_max; // the highest sequence number
+                                          // acked out of sequence
+
+                uint32_t        retrans_timeout;
+                uint32_t        retrans_fast;
+
+                double          srtt;    // smoothed round trip time
+                double          rttvar;  // round trip time variation
+                double          rto;     // retransmission timeout
+
+                uint32_t        get_cwnd();
+                uint32_t        get_flight();
+                void            update_rtt(double r);
+                void            cc_ack(uint32_t num, double rtt);
+                void            cc_loss();
+                void            cc_timeout();
+
 
                 rdp            &ref_rdp;
 
-                rdp_con(rdp &r) : ref_rdp(r) { }
+                rdp_con(rdp &r) : sbuf_peer(0), is_scheduled(false),
+                                  ref_rdp(r) { }
 
         private:
                 class swnd {
                 public:
                         packetbuf_ptr   pbuf;
-                        time_t          sent_time;
-                        bool            is_acked;
                         bool            is_sent;
                         uint32_t        seqnum;
-                        time_t          rt_sec;
+                        double          rto;
+                        cagetime        stamp;
+                        bool            is_retrans;
+                        bool            is_fast; // fast retransmitted
                 };
 
+                void            fast_retransmit(swnd *p_wnd);
+                bool            deliver(packetbuf_ptr pbuf);
+                void            deliver_rwnd();
+
                 boost::shared_array<swnd>        m_swnd;
+                rdp_bitmap      m_swnd_acked;
                 int             m_swnd_len;
                 int             m_swnd_head;
                 int             m_swnd_used;
                 int             m_swnd_ostand; // index of outstanding data
+                int             m_swnd_eacked; // number of segments acked
+                                               // out of sequence
 
-                class rwnd {
-                public:
-                        packetbuf_ptr   pbuf;
-                        uint32_t        seqnum;
-                        bool            is_used;
-                        bool            is_eacked;
-
-                        rwnd() : is_used(false), is_eacked(false) { }
-                };
-
-                boost::shared_array<rwnd>       m_rwnd;
+                boost::shared_array<packetbuf_ptr>      m_rwnd;
+                rdp_bitmap      m_rwnd_used_map;
+                rdp_bitmap      m_rwnd_delivered; // to a substream
                 int             m_rwnd_len;
                 int             m_rwnd_head;
                 int             m_rwnd_used;
 
+                rdp_fec         m_fec;       // of the block being sent
+                uint32_t        m_fec_first; // the first segment of it
+                int             m_fec_sent;  // segments covered by parity
+                double          m_fec_time;  // when the block started
+
+                std::map<uint32_t, rdp_fec>     m_fec_blocks; // received
+
+                void            add_fec(packetbuf_ptr pbuf, uint32_t seqnum);
+
+                double          m_pace_next; // when the next batch is sent
+                double          get_pace_gap();
+                int             get_pace_budget();
+
         public:
                 void            rwnd_recv_data(packetbuf_ptr pbuf,
                                                uint32_t seqnum);
@@ -44,6 +44,8 @@
 
 #include <iterator>
 
+#include <boost/foreach.hpp>
+
 namespace libcage {
 #ifndef WIN32
         int
@@ -195,6 +197,117 @@ namespace libcage {
 #endif // WIN32
         }
 
+        void
+        udphandler::sendto(const std::vector<datagram> &dgrams)
+        {
+#ifdef __linux__
+                const size_t batch = 64;
+                mmsghdr msgs[batch];
+                iovec   iovs[batch][2];
+                size_t  i = 0;
+
+                while (i < dgrams.size()) {
+                        size_t n = dgrams.size() - i;
+                        int    sent;
+
+                        if (n > batch)
+                                n = batch;
+
+                        memset(msgs, 0, sizeof(msgs[0]) * n);
+
+                        for (size_t j = 0; j < n; j++) {
+                                const datagram &d = dgrams[i + j];
+
+                                iovs[j][0].iov_base = (void*)d.head;
+                                iovs[j][0].iov_len  = d.headlen;
+                                iovs[j][1].iov_base = (void*)d.body;
+                                iovs[j][1].iov_len  = d.bodylen;
+
+                                msgs[j].msg_hdr.msg_name    = (void*)d.to;
+                                msgs[j].msg_hdr.msg_namelen = d.tolen;
+                                msgs[j].msg_hdr.msg_iov     = iovs[j];
+                                msgs[j].msg_hdr.msg_iovlen  = 2;
+                        }
+
+                        sent = ::sendmmsg(m_socket, msgs, n, 0);
+                        if (sent < 0) {
+                                perror("sendmmsg");
+
+                                // skip the datagram which failed
+                                sent = 1;
+                        }
+
+                        i += sent;
+                }
+#else
+                char buf[PBUF_SIZE];
+
+                BOOST_FOREACH(const datagram &d, dgrams) {
+                        if (d.headlen + d.bodylen > (int)sizeof(buf))
+                                continue;
+
+                        memcpy(buf, d.head, d.headlen);
+                        memcpy(buf + d.headlen, d.body, d.bodylen);
+
+                        sendto(buf, d.headlen + d.bodylen, d.to, d.tolen);
+                }
+#endif // __linux__
+        }
+
+        bool
+        udphandler::sendto_dontfrag(const void *msg, int len,
+                                    const sockaddr *to, int tolen)
+        {
+#ifndef WIN32
+                int       level = -1, name = -1, val = 0, old = 0;
+                socklen_t olen = sizeof(old);
+                ssize_t   sendlen;
+
+                // the probes must not be fragmented by the local stack,
+                // which does so with the cached path MTU otherwise
+                if (m_domain == PF_INET) {
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+                        level = IPPROTO_IP;
+                        name  = IP_MTU_DISCOVER;
+                        val   = IP_PMTUDISC_PROBE;
+#elif defined(IP_DONTFRAG)
+                        level = IPPROTO_IP;
+                        name  = IP_DONTFRAG;
+                        val   = 1;
+#endif
+                } else if (m_domain == PF_INET6) {
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+                        level = IPPROTO_IPV6;
+                        name  = IPV6_MTU_DISCOVER;
+                        val   = IPV6_PMTUDISC_PROBE;
+#elif defined(IPV6_DONTFRAG)
+                        level = IPPROTO_IPV6;
+                        name  = IPV6_DONTFRAG;
+                        val   = 1;
+#endif
+                }
+
+                if (name >= 0) {
+                        if (getsockopt(m_socket, level, name, &old,
+                                       &olen) < 0 ||
+                            setsockopt(m_socket, level, name, &val,
+                                       sizeof(val)) < 0)
+                                name = -1;
+                }
+
+                sendlen = ::sendto(m_socket, msg, len, 0, to, tolen);
+
+                if (name >= 0)
+                        setsockopt(m_socket, level, name, &old, sizeof(old));
+
+                return sendlen == len;
+#else
+                sendto(msg, len, to, tolen);
+
+                return true;
+#endif // WIN32
+        }
+
         void
         udphandler::sendto(const void *msg, int len, std::string host, int port)
         {
@@ -39,6 +39,7 @@
 
 #include <set>
 #include <string>
+#include <vector>
 
 #ifndef WIN32
         typedef int SOCKET;
@@ -57,6 +58,18 @@ namespace libcage {
                         virtual ~callback() {}
                 };
 
+                // a datagram of head followed by body.
+                // body may be shared among datagrams
+                class datagram {
+                public:
+                        const void     *head;
+                        int             headlen;
+                        const void     *body;
+                        int             bodylen;
+                        const sockaddr *to;
+                        int             tolen;
+                };
+
                 void            set_callback(callback *func);
                 void            set_callback(callback *func, timeval *tout);
                 void            unset_callback();
@@ -70,6 +83,15 @@ namespace libcage {
                 void            sendto(const void *msg, int len,
                                        std::string host, int port);
 
+                // send datagrams at once by sendmmsg(2) if available
+                void            sendto(const std::vector<datagram> &dgrams);
+
+                // send with the don't fragment bit, for probing the path
+                // MTU. false if the datagram is known not to fit
+                bool            sendto_dontfrag(const void *msg, int len,
+                                                const sockaddr *to,
+                                                int tolen);
+
                 bool            get_sockaddr(sockaddr_storage *saddr,
                                              std::string host, int port);
 
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <iostream>
+
+#include <event.h>
+
+#include <libcage/cage.hpp>
+#include <libcage/peers.hpp>
+
+// a micro benchmark of the peer address lookup and the dgram transmission
+// to known and unknown peers
+
+const int port      = 21000;
+const int num_peers = 1000;
+const int num_loop  = 100000;
+const int num_send  = 10000;
+
+libcage::cage *cage;
+event          ev;
+
+double
+elapsed(timeval &tval1)
+{
+        timeval tval2;
+        double  diff;
+
+        gettimeofday(&tval2, NULL);
+
+        diff  = tval2.tv_sec - tval1.tv_sec;
+        diff += tval2.tv_usec / 1000000.0 - tval1.tv_usec / 1000000.0;
+
+        return diff;
+}
+
+void
+print_result(const char *name, double sec, int n)
+{
+        std::cout << name << ": " << sec * 1000000000.0 / n << " [ns/op]"
+                  << std::endl;
+}
+
+void
+peers_callback(libcage::cageaddr &addr)
+{
+
+}
+
+void
+bench_peers()
+{
+        boost::mt19937          gen;
+        libcage::real_dist      dist(0, 1);
+        libcage::rand_real      drnd(gen, dist);
+        libcage::timer          t;
+        libcage::peers          p(drnd, t);
+        std::vector<libcage::id_ptr> known, unknown;
+        libcage::cageaddr       addr;
+        timeval tval;
+        int     found;
+
+        p.set_callback(&peers_callback);
+
+        for (int i = 0; i < num_peers; i++) {
+                libcage::in_ptr in(new sockaddr_in);
+                libcage::id_ptr id1(new libcage::uint160_t);
+                libcage::id_ptr id2(new libcage::uint160_t);
+
+                *id1 = i * 2;
+                *id2 = i * 2 + 1;
+
+                memset(in.get(), 0, sizeof(sockaddr_in));
+                in->sin_family      = PF_INET;
+                in->sin_port        = htons(10000 + i);
+                in->sin_addr.s_addr = htonl(0x7f000001);
+
+                addr.id     = id1;
+                addr.domain = libcage::domain_inet;
+                addr.saddr  = in;
+
+                p.add_node(addr);
+
+                known.push_back(id1);
+                unknown.push_back(id2);
+        }
+
+        found = 0;
+        gettimeofday(&tval, NULL);
+        for (int i = 0; i < num_loop; i++) {
+                try {
+                        addr = p.get_addr(known[i % num_peers]);
+                        found++;
+                } catch (std::out_of_range) {
+                }
+        }
+        print_result("get_addr, known", elapsed(tval), num_loop);
+
+        gettimeofday(&tval, NULL);
+        for (int i = 0; i < num_loop; i++) {
+                try {
+                        addr = p.get_addr(unknown[i % num_peers]);
+                        found++;
+                } catch (std::out_of_range) {
+                }
+        }
+        print_result("get_addr, unknown", elapsed(tval), num_loop);
+
+        gettimeofday(&tval, NULL);
+        for (int i = 0; i < num_loop; i++) {
+                if (p.find_addr(known[i % num_peers], addr))
+                        found++;
+        }
+        print_result("find_addr, known", elapsed(tval), num_loop);
+
+        gettimeofday(&tval, NULL);
+        for (int i = 0; i < num_loop; i++) {
+                if (p.find_addr(unknown[i % num_peers], addr))
+                        found++;
+        }
+        print_result("find_addr, unknown", elapsed(tval), num_loop);
+
+        if (found != num_loop * 2)
+                std::cout << "wrong lookup results: " << found << std::endl;
+}
+
+void
+bench_dgram(int fd, short event, void *arg)
+{
+        uint8_t buf[16];
+        uint8_t dst[CAGE_ID_LEN];
+        timeval tval;
+
+        memset(buf, 0, sizeof(buf));
+
+        // the joined node knows the first node
+        cage[0].get_id(dst);
+
+        gettimeofday(&tval, NULL);
+        for (int i = 0; i < num_send; i++)
+                cage[1].send_dgram(buf, sizeof(buf), dst);
+        print_result("send_dgram, known", elapsed(tval), num_send);
+
+        gettimeofday(&tval, NULL);
+        for (int i = 0; i < num_send; i++) {
+                memset(dst, 0, sizeof(dst));
+                memcpy(dst, &i, sizeof(i));
+
+                cage[1].send_dgram(buf, sizeof(buf), dst);
+        }
+        print_result("send_dgram, unknown", elapsed(tval), num_send);
+
+        exit(0);
+}
+
+void
+join_callback(bool result)
+{
+        if (! result) {
+                std::cerr << "failed in joining" << std::endl;
+                exit(-1);
+        }
+
+        timeval tval;
+
+        tval.tv_sec  = 1;
+        tval.tv_usec = 0;
+
+        evtimer_set(&ev, bench_dgram, NULL);
+        evtimer_add(&ev, &tval);
+}
+
+int
+main(int argc, char *argv[])
+{
+        event_init();
+
+        bench_peers();
+
+        cage = new libcage::cage[2];
+
+        for (int i = 0; i < 2; i++) {
+                if (! cage[i].open(PF_INET, port + i, false)) {
+                        std::cerr << "cannot open port: Port = "
+                                  << port + i << std::endl;
+                        return -1;
+                }
+        }
+
+        cage[1].join("localhost", port, &join_callback);
+
+        event_dispatch();
+
+        return 0;
+}